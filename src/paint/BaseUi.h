@@ -6,30 +6,166 @@
 #ifndef H_BASE_UI
 #define H_BASE_UI
 
-struct Rect {
-	int x, y, w, h;
+#include "Rect.h"
 
-	Rect() : x(0), y(0), w(0), h(0) {}
-	Rect(int _x, int _y, int _w, int _h) : x(_x), y(_y), w(_w), h(_h) {}
+#include <algorithm>
+#include <climits>
+#include <vector>
 
-	bool Contains(int _x, int _y) const {
-		return _x >= x && _y >= y && _x < x + w && _y < y + h;
+class UiElement;
+
+/**
+ * Elements whose OnTick() needs to be called, because they animate or have
+ * work left for the next frames. Only they get ticked, and while there are
+ * none the main loop sleeps until the next input event.
+ * Times are in seconds, on the clock given to Tick().
+ */
+class AnimationScheduler {
+public:
+	/// Tick element on the next frame, and on every frame until deadline
+	void Start(UiElement *element, double deadline = 0) {
+		for (Animation & animation : m_animations) {
+			if (animation.element == element) {
+				animation.deadline = std::max(animation.deadline, deadline);
+				return;
+			}
+		}
+		Animation animation = { element, deadline };
+		m_animations.push_back(animation);
+	}
+
+	/// Also tick element on the frame after every input event, for elements
+	/// that follow state that any input may change
+	void Listen(UiElement *element) {
+		if (std::find(m_listeners.begin(), m_listeners.end(), element) == m_listeners.end()) {
+			m_listeners.push_back(element);
+		}
+	}
+
+	/// Forget element, before it gets destroyed
+	void Stop(UiElement *element) {
+		for (size_t i = m_animations.size(); i-- > 0;) {
+			if (m_animations[i].element == element) {
+				m_animations.erase(m_animations.begin() + i);
+			}
+		}
+		for (Animation & animation : m_ticking) {
+			if (animation.element == element) {
+				animation.element = NULL;
+			}
+		}
+		m_listeners.erase(std::remove(m_listeners.begin(), m_listeners.end(), element), m_listeners.end());
+	}
+
+	/// Call on every input event
+	void OnInput() {
+		for (UiElement *element : m_listeners) {
+			Start(element);
+		}
 	}
-	bool IsNull() const {
-		return x == 0 && y == 0 && w == 0 && h == 0;
+
+	/// True if some element needs to be ticked on the next frame
+	bool IsRunning() const { return !m_animations.empty(); }
+
+	/// Call OnTick() of the elements that asked for it, then forget the ones
+	/// whose deadline has passed
+	void Tick(double time);
+
+	/// Scheduler shared by the whole application
+	static AnimationScheduler & Global() {
+		static AnimationScheduler scheduler;
+		return scheduler;
+	}
+
+private:
+	struct Animation {
+		UiElement *element;
+		double deadline;
+	};
+
+private:
+	std::vector<Animation> m_animations;
+	std::vector<Animation> m_ticking; /// Being ticked, NULL once stopped
+	std::vector<UiElement*> m_listeners;
+};
+
+/**
+ * Sends mouse moves down the tree, and keeps the path of elements that got
+ * them: the root, then the item that each layout has the mouse over. Only
+ * elements on the previous and new paths get ResetMouse() and ResetDebug()
+ * afterwards, so that a move costs the depth of the tree times the cost of
+ * finding items, rather than its size.
+ */
+class HoverTracker {
+public:
+	void MouseMove(UiElement *root, int x, int y);
+
+	/// Forget element, before it gets destroyed
+	void Forget(UiElement *element) {
+		for (std::vector<UiElement*> *path : { &m_path, &m_previousPath }) {
+			auto it = std::find(path->begin(), path->end(), element);
+			// Elements after it are its children
+			path->erase(it, path->end());
+		}
 	}
+
+	/// Tracker of the main window
+	static HoverTracker & Global() {
+		static HoverTracker tracker;
+		return tracker;
+	}
+
+private:
+	std::vector<UiElement*> m_path, m_previousPath;
 };
 
+/**
+ * Layout is done in two passes. Layouts first measure their items by
+ * reading their size hints once, then arrange them with SetRect(). An
+ * element only gets arranged again, running its Update(), when its rect
+ * changes or when it got InvalidateLayout(), which marks it and its parents
+ * up to the root. This happens when its size hint, margin or items change.
+ * Layout() on the root then arranges the marked elements only.
+ *
+ * Elements report what they need repainted with Damage() or Invalidate(),
+ * which marks them and all of their parents up to the root. The window
+ * takes the damage of the root once per frame and only repaints that part
+ * of itself, skipping the frame altogether when nothing is damaged.
+ */
 class UiElement {
 public:
+	/// Elements may draw borders a little out of their rect
+	static const int PaintOverflow = 2;
+
+	UiElement()
+		: m_parent(NULL)
+		, m_isLayoutDirty(true)
+		, m_isDamaged(false)
+		, m_debug(false)
+	{}
+	virtual ~UiElement() {
+		AnimationScheduler::Global().Stop(this);
+		HoverTracker::Global().Forget(this);
+	}
+
 	// Getters / Setters
 
 	void SetRect(Rect rect) {
-		m_rect = rect;
+		if (rect == m_rect && !m_isLayoutDirty) {
+			return;
+		}
+		if (rect != m_rect) {
+			Invalidate();
+			m_rect = rect;
+			Invalidate();
+		}
 		m_innerRect.x = m_rect.x + m_margin.x;
 		m_innerRect.y = m_rect.y + m_margin.y;
 		m_innerRect.w = m_rect.w - m_margin.x - m_margin.w;
 		m_innerRect.h = m_rect.h - m_margin.y - m_margin.h;
+		// Update() may invalidate the layout again
+		m_isLayoutDirty = false;
+		++LayoutPassCount();
 		Update();
 	}
 	void SetRect(int x, int y, int w, int h) { SetRect(::Rect(x, y, w, h)); }
@@ -38,12 +174,23 @@ public:
 	/// Return content rect, ie rect minus margin
 	const ::Rect & InnerRect() const { return m_innerRect; }
 
-	void SetMargin(::Rect margin) { m_margin = margin; Update(); }
+	void SetMargin(::Rect margin) {
+		if (margin != m_margin) {
+			m_margin = margin;
+			InvalidateLayout();
+		}
+	}
 	void SetMargin(int x, int y, int w, int h) { SetMargin(::Rect(x, y, w, h)); }
 	const ::Rect & Margin() const { return m_margin; }
 
 	void SetSizeHint(::Rect hint) {
-		m_sizeHint = hint;
+		if (hint != m_sizeHint) {
+			m_sizeHint = hint;
+			// Items are measured by their layout
+			if (NULL != m_parent) {
+				m_parent->InvalidateLayout();
+			}
+		}
 	}
 	void SetSizeHint(int x, int y, int w, int h) {
 		SetSizeHint(::Rect(x, y, w, h));
@@ -64,6 +211,59 @@ public:
 		return m_sizeHint;
 	}
 
+	/// Have the next layout pass arrange the element again
+	void InvalidateLayout() {
+		m_isLayoutDirty = true;
+		if (NULL != m_parent) {
+			m_parent->InvalidateLayout();
+		}
+	}
+	bool IsLayoutDirty() const { return m_isLayoutDirty; }
+	/// Arrange again the elements whose layout got invalidated, from here down
+	void Layout() {
+		SetRect(m_rect);
+	}
+
+	/// Number of times an element got arranged, for statistics
+	static size_t & LayoutPassCount() {
+		static size_t count = 0;
+		return count;
+	}
+
+	/// Element that damage propagates to, usually the layout holding it
+	UiElement *Parent() const { return m_parent; }
+	void SetParent(UiElement *parent) { m_parent = parent; }
+
+	/// Ask for r, in window coordinates, to be repainted
+	void Damage(const ::Rect & r) {
+		if (r.IsEmpty() || (m_isDamaged && m_damage.Contains(r))) {
+			return;
+		}
+		m_damage = m_damage.United(r);
+		m_isDamaged = true;
+		if (NULL != m_parent) {
+			m_parent->Damage(r);
+		}
+	}
+	/// Ask for the whole element to be repainted
+	void Invalidate() {
+		Damage(m_rect.Grown(PaintOverflow));
+	}
+
+	bool IsDamaged() const { return m_isDamaged; }
+	/// Area to repaint since last call to TakeDamage()
+	const ::Rect & Damage() const { return m_damage; }
+	::Rect TakeDamage() {
+		::Rect damage = m_damage;
+		ClearDamage();
+		return damage;
+	}
+
+	/// Part of the window being repainted, elements out of it may skip
+	/// painting. Set by the window for the duration of a frame.
+	static const ::Rect & PaintArea() { return PaintAreaStorage(); }
+	static void SetPaintArea(const ::Rect & area) { PaintAreaStorage() = area; }
+
 public:
 	virtual void OnMouseOver(int x, int y) {
 	}
@@ -71,12 +271,21 @@ public:
 	virtual void OnMouseClick(int button, int action, int mods) {
 	}
 
-	// Called whenever the mouse moved anywhere, before OnMouseOver might be called
+	/// Mouse wheel or touchpad, offsets are in wheel steps
+	virtual void OnScroll(double xoffset, double yoffset) {
+	}
+
+	// Called after a mouse move, on elements that got OnMouseOver() for this
+	// move or the previous one (see HoverTracker)
 	// This is used to keep track of when mouse comes in and gets out
-	// TODO: avoid dispatching to absolutely every object, only send to ones touched by the last mouse move.
 	virtual void ResetMouse() {
 	}
 
+	/// Child that got the last OnMouseOver(), if any
+	virtual UiElement *MouseFocusItem() const {
+		return NULL;
+	}
+
 	virtual void ResetDebug() {
 		m_debug = false;
 	}
@@ -86,6 +295,13 @@ public:
 	virtual void Update() {
 	}
 
+	/// Forget damage, of children too
+	virtual void ClearDamage() {
+		m_isDamaged = false;
+		m_damage = ::Rect();
+	}
+
+	/// Called once per frame while scheduled, see AnimationScheduler
 	virtual void OnTick() {
 	}
 
@@ -101,13 +317,65 @@ public:
 		}
 	}
 
+private:
+	static ::Rect & PaintAreaStorage() {
+		static ::Rect area(INT_MIN / 2, INT_MIN / 2, INT_MAX, INT_MAX);
+		return area;
+	}
+
 private:
 	::Rect m_rect, m_sizeHint, m_innerRect, m_margin;
+	UiElement *m_parent;
+	bool m_isLayoutDirty;
+	::Rect m_damage;
+	bool m_isDamaged;
 	bool m_debug;
 };
 
+inline void HoverTracker::MouseMove(UiElement *root, int x, int y) {
+	root->OnMouseOver(x, y);
+
+	m_previousPath.swap(m_path);
+	m_path.clear();
+	for (UiElement *element = root; NULL != element; element = element->MouseFocusItem()) {
+		m_path.push_back(element);
+	}
+
+	// Paths share their start, then never meet again
+	size_t common = 0;
+	while (common < m_path.size() && common < m_previousPath.size() && m_path[common] == m_previousPath[common]) {
+		++common;
+	}
+	// Elements that the mouse left, then the ones it is over
+	for (size_t i = common; i < m_previousPath.size(); ++i) {
+		m_previousPath[i]->ResetDebug();
+		m_previousPath[i]->ResetMouse();
+	}
+	for (UiElement *element : m_path) {
+		element->ResetDebug();
+		element->ResetMouse();
+	}
+}
+
+inline void AnimationScheduler::Tick(double time) {
+	// Elements that start again while ticked get into the next frame
+	m_ticking.swap(m_animations);
+	m_animations.clear();
+	for (size_t i = 0; i < m_ticking.size(); ++i) {
+		if (NULL != m_ticking[i].element) {
+			m_ticking[i].element->OnTick();
+		}
+		// Might have been stopped by its own tick
+		if (NULL != m_ticking[i].element && m_ticking[i].deadline > time) {
+			Start(m_ticking[i].element, m_ticking[i].deadline);
+		}
+	}
+	m_ticking.clear();
+}
+
 /**
- * Adds OnMouseEnter() and OnMouseLeave() events
+ * Adds OnMouseEnter() and OnMouseLeave() events, fired by the ResetMouse()
+ * that follows the move
  */
 class UiMouseAwareElement : public UiElement {
 public:
@@ -127,6 +395,10 @@ public: // protected
 
 	void ResetMouse() override {
 		UiElement::ResetMouse();
+		// Most elements look different when hovered
+		if (m_isMouseOver != m_wasMouseOver) {
+			Invalidate();
+		}
 		if (m_isMouseOver && !m_wasMouseOver) {
 			OnMouseEnter();
 		}
@@ -168,11 +440,22 @@ public:
 	/// Take ownership of the item
 	void AddItem(UiElement *item) {
 		m_items.push_back(item);
+		item->SetParent(this);
+		// Damage it got before has not reached this layout
+		item->ClearDamage();
+		item->Invalidate();
+		InvalidateLayout();
 	}
-	/// Give back ownership of the item
+	/// Give back ownership of the item, NULL if there is none
 	UiElement *RemoveItem() {
+		if (m_items.empty()) {
+			return NULL;
+		}
 		UiElement *item = m_items.back();
 		m_items.pop_back();
+		item->Invalidate();
+		item->SetParent(NULL);
+		InvalidateLayout();
 		return item;
 	}
 
@@ -183,6 +466,7 @@ public:
 public: // protected
 	void OnMouseOver(int x, int y) override {
 		UiElement::OnMouseOver(x, y);
+		m_mouseFocusIdx = -1;
 		size_t i;
 		if (GetIndexAt(i, x, y)) {
 			Items()[i]->OnMouseOver(x, y);
@@ -197,32 +481,36 @@ public: // protected
 		}
 	}
 
-	void ResetMouse() override {
-		UiElement::ResetMouse();
-		for (auto item : Items()) {
-			item->ResetMouse();
+	void OnScroll(double xoffset, double yoffset) override {
+		UiElement::OnScroll(xoffset, yoffset);
+		if (m_mouseFocusIdx > -1 && m_mouseFocusIdx < Items().size()) {
+			Items()[m_mouseFocusIdx]->OnScroll(xoffset, yoffset);
 		}
-		m_mouseFocusIdx = -1;
 	}
 
-	void ResetDebug() override {
-		UiElement::ResetDebug();
-		for (auto item : Items()) {
-			item->ResetDebug();
+	UiElement *MouseFocusItem() const override {
+		if (m_mouseFocusIdx > -1 && m_mouseFocusIdx < Items().size()) {
+			return Items()[m_mouseFocusIdx];
 		}
+		return NULL;
 	}
 
-	void OnTick() override {
-		UiElement::OnTick();
+	void ClearDamage() override {
+		UiElement::ClearDamage();
 		for (UiElement *item : Items()) {
-			item->OnTick();
+			if (item->IsDamaged()) {
+				item->ClearDamage();
+			}
 		}
 	}
 
 	void Paint(NVGcontext *vg) const override {
 		UiElement::Paint(vg);
+		const ::Rect & area = PaintArea();
 		for (UiElement *item : Items()) {
-			item->Paint(vg);
+			if (!item->Rect().Grown(PaintOverflow).Intersected(area).IsEmpty()) {
+				item->Paint(vg);
+			}
 		}
 		PaintDebug(vg);
 	}
@@ -278,16 +566,16 @@ public:
 		, m_colSpacing(0)
 	{}
 
-	void SetRowCount(int count) { m_rowCount = std::max(1, count); }
+	void SetRowCount(int count) { m_rowCount = std::max(1, count); InvalidateLayout(); }
 	int RowCount() const { return m_rowCount; }
 
-	void SetColCount(int count) { m_colCount = std::max(1, count); }
+	void SetColCount(int count) { m_colCount = std::max(1, count); InvalidateLayout(); }
 	int ColCount() const { return m_colCount; }
 
-	void SetRowSpacing(int spacing) { m_rowSpacing = spacing; }
+	void SetRowSpacing(int spacing) { m_rowSpacing = spacing; InvalidateLayout(); }
 	int RowSpacing() const { return m_rowSpacing; }
 
-	void SetColSpacing(int spacing) { m_colSpacing = spacing; }
+	void SetColSpacing(int spacing) { m_colSpacing = spacing; InvalidateLayout(); }
 	int ColSpacing() const { return m_colSpacing; }
 
 public: // protected
@@ -345,10 +633,176 @@ typedef enum {
 	HideOverflow,
 } BoxLayoutOverflowBehavior;
 
-#define BUI_HBOX_IMPLEMENTATION
-#include "_BoxLayout.inc.h"
-#undef BUI_HBOX_IMPLEMENTATION
-#include "_BoxLayout.inc.h"
+/// Direction in which a box layout stacks its items
+typedef enum {
+	HorizontalBox,
+	VerticalBox,
+} BoxLayoutAxis;
+
+/**
+ * Reads and builds rects along the axis of a box layout (length) and
+ * across it (thickness), specialized for each axis so that box layouts
+ * pick theirs at compile time.
+ */
+template <BoxLayoutAxis axis>
+struct BoxAxis;
+
+template <>
+struct BoxAxis<HorizontalBox> {
+	static int Along(int x, int y) { return x; }
+	static int Start(const ::Rect & r) { return r.x; }
+	static int Length(const ::Rect & r) { return r.w; }
+	static int Thickness(const ::Rect & r) { return r.h; }
+	static ::Rect Size(int length, int thickness) { return ::Rect(0, 0, length, thickness); }
+	/// Part of r starting offset from its start, of the given length
+	static ::Rect Slice(const ::Rect & r, int offset, int length) { return ::Rect(r.x + offset, r.y, length, r.h); }
+};
+
+template <>
+struct BoxAxis<VerticalBox> {
+	static int Along(int x, int y) { return y; }
+	static int Start(const ::Rect & r) { return r.y; }
+	static int Length(const ::Rect & r) { return r.h; }
+	static int Thickness(const ::Rect & r) { return r.w; }
+	static ::Rect Size(int length, int thickness) { return ::Rect(0, 0, thickness, length); }
+	/// Part of r starting offset from its start, of the given length
+	static ::Rect Slice(const ::Rect & r, int offset, int length) { return ::Rect(r.x, r.y + offset, r.w, length); }
+};
+
+/**
+ * Stacks items along an axis. Items get the length of their size hint,
+ * those with a null hint sharing what remains. When there is not enough
+ * room, hinted items shrink unless overflow is hidden.
+ * Update() and GetIndexAt() are final, so subclasses cannot change the
+ * layout but their calls get resolved statically.
+ */
+template <BoxLayoutAxis axis>
+class BoxLayout : public UiLayout {
+private:
+	typedef BoxAxis<axis> Axis;
+
+public:
+	BoxLayout()
+		: UiLayout()
+		, m_overflowBehavior(ShrinkOverflow)
+	{}
+
+	void SetOverflowBehavior(BoxLayoutOverflowBehavior behavior) {
+		if (behavior != m_overflowBehavior) {
+			m_overflowBehavior = behavior;
+			InvalidateLayout();
+		}
+	}
+	BoxLayoutOverflowBehavior OverflowBehavior() const { return m_overflowBehavior; }
+
+	/// Automatically infer size hint from content.
+	void AutoSizeHint() {
+		int sum = 0;
+		int max = 0;
+		for (auto item : Items()) {
+			const ::Rect & rect = item->SizeHint();
+			sum += Axis::Length(rect);
+			max = std::max(max, Axis::Thickness(rect));
+			/* TODO: design issue: unable to determine whether a null size is a forced null size or a not hinted size
+			if (rect.IsNull()) {
+				SetSizeHint(::Rect());
+				return;
+			}
+			*/
+		}
+		SetInnerSizeHint(Axis::Size(sum, max));
+	}
+
+public:
+	void Update() final {
+		// Measure: read each hint once, null hints share what remains
+		m_hints.resize(Items().size());
+		int sumHints = 0;
+		int nullHints = 0;
+		for (size_t i = 0; i < Items().size(); ++i) {
+			const ::Rect & rect = Items()[i]->SizeHint();
+			if (rect.IsNull()) {
+				m_hints[i] = -1;
+				nullHints++;
+			}
+			else {
+				m_hints[i] = Axis::Length(rect);
+				sumHints += m_hints[i];
+			}
+		}
+		int nonNullHints = Items().size() - nullHints;
+		int remainingLength = Axis::Length(InnerRect()) - sumHints;
+		int itemLength = nullHints == 0 ? 0 : std::max(0, (int)floor(remainingLength / nullHints));
+		int lastItemLength = std::max(0, remainingLength) - (nullHints - 1) * itemLength;
+		int hintedItemLengthDelta = nonNullHints == 0 ? 0 : std::min((int)floor(remainingLength / nonNullHints), 0);
+		// The last length might be a bit different to prevent rounding issues
+		int lastHintedItemLengthDelta = -std::max(0, -remainingLength) + (nonNullHints - 1) * hintedItemLengthDelta;
+
+		if (m_overflowBehavior == BoxLayoutOverflowBehavior::HideOverflow) {
+			hintedItemLengthDelta = 0;
+			lastHintedItemLengthDelta = 0;
+		}
+
+		// Arrange: SetRect() only updates items that moved or need it
+		int offset = 0;
+		int nullCount = 0;
+		int nonNullCount = 0;
+		for (size_t i = 0; i < Items().size(); ++i) {
+			int length = 0;
+			if (m_hints[i] < 0) {
+				length = nullCount == nullHints - 1 ? lastItemLength : itemLength;
+				nullCount++;
+			}
+			else {
+				length = m_hints[i];
+				length += (nonNullCount == nonNullHints - 1 ? lastHintedItemLengthDelta : hintedItemLengthDelta);
+				nonNullCount++;
+			}
+			Items()[i]->SetRect(Axis::Slice(InnerRect(), offset, length));
+			offset += length;
+		}
+
+		CacheItemEnds();
+	}
+
+protected:
+	/// Binary search over the item ends cached by Update()
+	bool GetIndexAt(size_t & idx, int x, int y) final {
+		if (m_itemEnds.size() != Items().size()) {
+			// Items were added or removed since
+			CacheItemEnds();
+		}
+		auto it = std::upper_bound(m_itemEnds.begin(), m_itemEnds.end(), Axis::Along(x, y));
+		if (it == m_itemEnds.end()) {
+			return false;
+		}
+		idx = it - m_itemEnds.begin();
+		return true;
+	}
+
+private:
+	/// Where each item ends along the axis, summing their inner sizes. Kept
+	/// from decreasing, which leaves the first item ending after any
+	/// position unchanged.
+	void CacheItemEnds() {
+		m_itemEnds.resize(Items().size());
+		int offset = 0;
+		int end = INT_MIN;
+		for (size_t i = 0; i < Items().size(); ++i) {
+			offset += Axis::Length(Items()[i]->InnerRect());
+			end = std::max(end, Axis::Start(InnerRect()) + offset);
+			m_itemEnds[i] = end;
+		}
+	}
+
+private:
+	BoxLayoutOverflowBehavior m_overflowBehavior;
+	std::vector<int> m_hints; /// Along the axis, -1 for null hints
+	std::vector<int> m_itemEnds;
+};
+
+typedef BoxLayout<HorizontalBox> HBoxLayout;
+typedef BoxLayout<VerticalBox> VBoxLayout;
 
 class Label : public UiElement {
 public: // protected
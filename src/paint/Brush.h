@@ -0,0 +1,389 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_BRUSH
+#define H_BRUSH
+
+#include "Canvas.h"
+#include "Rasterizer.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+/// Shape of the dabs a brush stamps
+enum BrushTip {
+	RoundBrushTip,
+	SquareBrushTip,
+};
+
+/**
+ * Parameters of a brush. Lengths are relative to the brush size chosen by
+ * the user, except spacing that is relative to the dab size.
+ */
+struct BrushSettings {
+	BrushTip tip = RoundBrushTip;
+	float size = 1.0f; /// Dab diameter
+	float roundness = 1.0f; /// Dab height over dab width
+	float angle = 0.0f; /// Rotation of the dabs, in radians
+	float hardness = 1.0f; /// 1 for an antialiased edge, 0 for a soft falloff to the center
+	float flow = 1.0f; /// Opacity of a single dab
+	float spacing = 0.1f; /// Distance between two dabs
+	float jitter = 0.0f; /// Maximum random offset of dabs
+	float sizeJitter = 0.0f; /// Maximum random variation of the dab size, relative to it
+	float texture = 0.0f; /// Strength of the paper grain, in [0, 1]
+	bool isBuildUp = false; /// Overlapping dabs add up, instead of keeping the strongest one
+};
+
+/// Dab, in canvas pixels
+struct BrushDab {
+	float x, y;
+	float radius;
+};
+
+/**
+ * Dab stamping brush engine, writing directly to a tiled canvas.
+ *
+ * Like StrokeRasterizer, it accumulates the coverage of the whole stroke
+ * in a per tile 8-bit buffer and composites the color once over the pixels
+ * as they were when the stroke began, so the result does not depend on how
+ * the stroke got split into calls to Stroke(). Dabs get sorted by tile, and
+ * tiles are stamped in parallel, with SSE2 when available.
+ */
+class BrushEngine {
+public:
+	explicit BrushEngine(ThreadPool & pool = ThreadPool::Global())
+		: m_pool(pool)
+		, m_isInStroke(false)
+		, m_distanceToNextDab(0)
+		, m_random(1)
+		, m_dabCount(0)
+	{}
+
+	/// Pixels that the dabs of segments may cover
+	static ::Rect Bounds(const std::vector<StrokeSegment> & segments, float size, const BrushSettings & settings) {
+		float reach = MaxRadius(size, settings) + settings.jitter * size + 1;
+		return StrokeRasterizer::Bounds(segments, 2 * reach);
+	}
+
+	/// seed makes random brushes reproducible
+	void BeginStroke(uint32_t seed = 1) {
+		m_isInStroke = true;
+		m_distanceToNextDab = 0;
+		m_random = seed == 0 ? 1 : seed;
+		m_dabCount = 0;
+		m_snapshot.Clear();
+		m_coverage.clear();
+	}
+
+	void EndStroke() {
+		m_isInStroke = false;
+		m_snapshot.Clear();
+		m_coverage.clear();
+	}
+
+	bool IsInStroke() const { return m_isInStroke; }
+
+	/// Number of dabs stamped since BeginStroke()
+	size_t DabCount() const { return m_dabCount; }
+
+	/**
+	 * Stamp dabs along segments, that are expected to follow each other.
+	 * Spacing carries over from one call to the next within a stroke.
+	 */
+	void Stroke(TiledCanvas & canvas, const std::vector<StrokeSegment> & segments, float size, Pixel color, const BrushSettings & settings) {
+		bool isOneShot = !m_isInStroke;
+		if (isOneShot) {
+			BeginStroke();
+		}
+
+		float diameter = std::max(settings.size * size, 1.0f);
+		float step = std::max(settings.spacing * diameter, 0.5f);
+		m_dabs.clear();
+		for (const StrokeSegment & s : segments) {
+			float dx = s.x1 - s.x0, dy = s.y1 - s.y0;
+			float length = sqrt(dx * dx + dy * dy);
+			while (m_distanceToNextDab <= length) {
+				float t = length > 0 ? m_distanceToNextDab / length : 0;
+				BrushDab dab;
+				dab.x = s.x0 + t * dx + settings.jitter * size * (Random() - 0.5f);
+				dab.y = s.y0 + t * dy + settings.jitter * size * (Random() - 0.5f);
+				dab.radius = diameter / 2 * (1 + settings.sizeJitter * (2 * Random() - 1));
+				m_dabs.push_back(dab);
+				m_distanceToNextDab += step;
+			}
+			m_distanceToNextDab -= length;
+		}
+		Stamp(canvas, m_dabs, color, settings);
+
+		if (isOneShot) {
+			EndStroke();
+		}
+	}
+
+	/// Stamp given dabs, as part of the current stroke
+	void Stamp(TiledCanvas & canvas, const std::vector<BrushDab> & dabs, Pixel color, const BrushSettings & settings) {
+		if (dabs.empty()) {
+			return;
+		}
+		bool isOneShot = !m_isInStroke;
+		if (isOneShot) {
+			BeginStroke();
+		}
+		m_dabCount += dabs.size();
+
+		// Group dabs by tile. Copy on write and buffer allocation are not
+		// thread safe, so they are done here.
+		m_jobs.clear();
+		m_jobIndices.clear();
+		for (size_t i = 0; i < dabs.size(); ++i) {
+			canvas.ForEachTile(DabBounds(dabs[i], settings), [&](int tx, int ty, const ::Rect & part) {
+				uint64_t key = TileKey(tx, ty);
+				auto it = m_jobIndices.find(key);
+				if (it == m_jobIndices.end()) {
+					m_snapshot.Touch(canvas, canvas.TileRect(tx, ty));
+					std::vector<unsigned char> & coverage = m_coverage[key];
+					if (coverage.empty()) {
+						coverage.assign(TileSize * TileSize, 0);
+					}
+					Job job;
+					job.tile = canvas.MutableTile(tx, ty);
+					job.original = m_snapshot.TileAt(canvas, tx, ty);
+					job.coverage = coverage.data();
+					job.tileX = tx * TileSize;
+					job.tileY = ty * TileSize;
+					it = m_jobIndices.insert(std::make_pair(key, m_jobs.size())).first;
+					m_jobs.push_back(job);
+				}
+				Job & job = m_jobs[it->second];
+				job.area = job.area.United(part);
+				job.dabs.push_back(i);
+			});
+		}
+
+		Pixel background = canvas.Background();
+		m_pool.ParallelFor(m_jobs.size(), [&](size_t i) {
+			StampTile(m_jobs[i], dabs, color, settings, background);
+		});
+
+		if (isOneShot) {
+			EndStroke();
+		}
+	}
+
+private:
+	struct Job {
+		Tile *tile;
+		/// Tile before the stroke started, NULL if blank
+		const Tile *original;
+		/// Accumulated coverage of the stroke over the tile
+		unsigned char *coverage;
+		int tileX, tileY;
+		/// Union of the dabs over this tile, in canvas pixels
+		::Rect area;
+		/// Indices of the dabs that reach this tile
+		std::vector<size_t> dabs;
+	};
+
+	/// Dab parameters needed to compute its coverage
+	struct DabShape {
+		DabShape(const BrushDab & dab, const BrushSettings & settings) {
+			cx = dab.x;
+			cy = dab.y;
+			cosAngle = cos(settings.angle);
+			sinAngle = sin(settings.angle);
+			invRoundness = 1.0f / std::max(settings.roundness, 0.01f);
+			edge = dab.radius + 0.5f;
+			invSoftness = 1.0f / std::max(dab.radius * (1 - settings.hardness), 1.0f);
+			flow = settings.flow;
+		}
+
+		float cx, cy;
+		float cosAngle, sinAngle, invRoundness;
+		float edge, invSoftness, flow;
+	};
+
+private:
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+	static float MaxRadius(float size, const BrushSettings & settings) {
+		return std::max(settings.size * size, 1.0f) / 2 * (1 + settings.sizeJitter);
+	}
+
+	/// Pixels covered by a dab. Elongated dabs are bounded by their width
+	/// whatever their angle, which is enough for brushes.
+	static ::Rect DabBounds(const BrushDab & dab, const BrushSettings & settings) {
+		float reach = dab.radius * std::max(1.0f, settings.roundness) * (settings.tip == SquareBrushTip ? 1.415f : 1.0f) + 1;
+		int x0 = (int)floor(dab.x - reach);
+		int y0 = (int)floor(dab.y - reach);
+		int x1 = (int)ceil(dab.x + reach);
+		int y1 = (int)ceil(dab.y + reach);
+		return ::Rect(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	/// xorshift32, in [0, 1[
+	float Random() {
+		m_random ^= m_random << 13;
+		m_random ^= m_random >> 17;
+		m_random ^= m_random << 5;
+		return (m_random >> 8) * (1.0f / 16777216.0f);
+	}
+
+	/// Stable noise in [0, 1[ used as paper grain
+	static float Grain(int x, int y) {
+		uint32_t h = (uint32_t)x * 374761393u + (uint32_t)y * 668265263u;
+		h = (h ^ (h >> 13)) * 1274126177u;
+		h ^= h >> 16;
+		return (h >> 8) * (1.0f / 16777216.0f);
+	}
+
+	static void StampTile(Job & job, const std::vector<BrushDab> & dabs, Pixel color, const BrushSettings & settings, Pixel background) {
+		float coverage[TileSize];
+		for (size_t d : job.dabs) {
+			DabShape shape(dabs[d], settings);
+			::Rect a = DabBounds(dabs[d], settings).Intersected(job.area);
+			for (int y = a.y; y < a.y + a.h; ++y) {
+				RowCoverage(shape, settings.tip, a.x, y + 0.5f, a.w, coverage);
+				if (settings.texture > 0) {
+					for (int i = 0; i < a.w; ++i) {
+						coverage[i] *= 1 - settings.texture * Grain(a.x + i, y);
+					}
+				}
+				unsigned char *accumulated = job.coverage + (y - job.tileY) * TileSize + (a.x - job.tileX);
+				Accumulate(accumulated, coverage, a.w, settings.isBuildUp);
+			}
+		}
+
+		// Composite the stroke once over the original pixels
+		const ::Rect & a = job.area;
+		int x0 = a.x - job.tileX;
+		Pixel originalColor = NULL != job.original ? job.original->Color() : background;
+		for (int y = a.y; y < a.y + a.h; ++y) {
+			int j = y - job.tileY;
+			const Pixel *originalRow = NULL;
+			if (NULL != job.original && !job.original->IsUniform()) {
+				originalRow = job.original->Row(j) + x0;
+			}
+			CompositeRow(job.tile->MutableRow(j) + x0, originalRow, originalColor, job.coverage + j * TileSize + x0, a.w, color);
+		}
+	}
+
+	/// Coverage of the n pixels of row py starting at column x0, times flow
+	static void RowCoverage(const DabShape & s, BrushTip tip, int x0, float py, int n, float *coverage) {
+		float dy = py - s.cy;
+		int i = 0;
+#ifdef PAINT_HAS_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 signMask = _mm_set1_ps(-0.0f);
+		const __m128 cosAngle = _mm_set1_ps(s.cosAngle), sinAngle = _mm_set1_ps(s.sinAngle);
+		const __m128 dySin = _mm_set1_ps(dy * s.sinAngle), dyCos = _mm_set1_ps(dy * s.cosAngle);
+		const __m128 invRoundness = _mm_set1_ps(s.invRoundness);
+		const __m128 edge = _mm_set1_ps(s.edge), invSoftness = _mm_set1_ps(s.invSoftness);
+		const __m128 flow = _mm_set1_ps(s.flow);
+		for (; i + 4 <= n; i += 4) {
+			__m128 dx = _mm_sub_ps(_mm_add_ps(_mm_set1_ps(x0 + i + 0.5f), _mm_set_ps(3, 2, 1, 0)), _mm_set1_ps(s.cx));
+			__m128 u = _mm_add_ps(_mm_mul_ps(dx, cosAngle), dySin);
+			__m128 v = _mm_mul_ps(_mm_sub_ps(dyCos, _mm_mul_ps(dx, sinAngle)), invRoundness);
+			__m128 d;
+			if (tip == SquareBrushTip) {
+				d = _mm_max_ps(_mm_andnot_ps(signMask, u), _mm_andnot_ps(signMask, v));
+			} else {
+				d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(v, v)));
+			}
+			__m128 c = _mm_mul_ps(_mm_sub_ps(edge, d), invSoftness);
+			c = _mm_min_ps(_mm_max_ps(c, zero), one);
+			_mm_storeu_ps(coverage + i, _mm_mul_ps(c, flow));
+		}
+#endif
+		for (; i < n; ++i) {
+			float dx = x0 + i + 0.5f - s.cx;
+			float u = dx * s.cosAngle + dy * s.sinAngle;
+			float v = (dy * s.cosAngle - dx * s.sinAngle) * s.invRoundness;
+			float d = tip == SquareBrushTip ? std::max(fabs(u), fabs(v)) : sqrt(u * u + v * v);
+			float c = std::min(std::max((s.edge - d) * s.invSoftness, 0.0f), 1.0f);
+			coverage[i] = c * s.flow;
+		}
+	}
+
+	/// Merge the coverage of a dab into the accumulated coverage, keeping
+	/// the max of both or adding them up as alpha does (a + c - a * c)
+	static void Accumulate(unsigned char *accumulated, const float *coverage, int n, bool isBuildUp) {
+		int i = 0;
+#ifdef PAINT_HAS_SSE2
+		const __m128 scale = _mm_set1_ps(255.0f), half = _mm_set1_ps(0.5f);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bias = _mm_set1_epi16(128);
+		for (; i + 16 <= n; i += 16) {
+			__m128i c0 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coverage + i), scale), half));
+			__m128i c1 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coverage + i + 4), scale), half));
+			__m128i c2 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coverage + i + 8), scale), half));
+			__m128i c3 = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(coverage + i + 12), scale), half));
+			__m128i c = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+			__m128i acc = _mm_loadu_si128(reinterpret_cast<const __m128i*>(accumulated + i));
+			if (isBuildUp) {
+				// a * c / 255, rounded, on 16 bits
+				__m128i accLo = _mm_unpacklo_epi8(acc, zero), accHi = _mm_unpackhi_epi8(acc, zero);
+				__m128i cLo = _mm_unpacklo_epi8(c, zero), cHi = _mm_unpackhi_epi8(c, zero);
+				__m128i pLo = _mm_add_epi16(_mm_mullo_epi16(accLo, cLo), bias);
+				__m128i pHi = _mm_add_epi16(_mm_mullo_epi16(accHi, cHi), bias);
+				pLo = _mm_srli_epi16(_mm_add_epi16(pLo, _mm_srli_epi16(pLo, 8)), 8);
+				pHi = _mm_srli_epi16(_mm_add_epi16(pHi, _mm_srli_epi16(pHi, 8)), 8);
+				__m128i lo = _mm_sub_epi16(_mm_add_epi16(accLo, cLo), pLo);
+				__m128i hi = _mm_sub_epi16(_mm_add_epi16(accHi, cHi), pHi);
+				acc = _mm_packus_epi16(lo, hi);
+			} else {
+				acc = _mm_max_epu8(acc, c);
+			}
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(accumulated + i), acc);
+		}
+#endif
+		for (; i < n; ++i) {
+			unsigned int c = (unsigned int)(coverage[i] * 255.0f + 0.5f);
+			unsigned int a = accumulated[i];
+			if (isBuildUp) {
+				unsigned int p = a * c + 128;
+				accumulated[i] = (unsigned char)(a + c - ((p + (p >> 8)) >> 8));
+			} else {
+				accumulated[i] = (unsigned char)std::max(a, c);
+			}
+		}
+	}
+
+	/// Blend color over the original pixels with the accumulated coverage.
+	/// originalRow is NULL when the original tile is uniform of originalColor.
+	static void CompositeRow(Pixel *row, const Pixel *originalRow, Pixel originalColor, const unsigned char *accumulated, int n, Pixel color) {
+		bool isOpaque = PixelA(color) == 255;
+		for (int i = 0; i < n; ++i) {
+			Pixel original = NULL != originalRow ? originalRow[i] : originalColor;
+			unsigned char c = accumulated[i];
+			if (c == 0) {
+				row[i] = original;
+			} else if (c == 255 && isOpaque) {
+				row[i] = color;
+			} else {
+				row[i] = BlendPixel(original, color, c * (1.0f / 255.0f));
+			}
+		}
+	}
+
+private:
+	ThreadPool & m_pool;
+	bool m_isInStroke;
+	float m_distanceToNextDab;
+	uint32_t m_random;
+	size_t m_dabCount;
+	CanvasSnapshot m_snapshot;
+	std::unordered_map<uint64_t, std::vector<unsigned char> > m_coverage;
+	std::vector<BrushDab> m_dabs;
+	std::vector<Job> m_jobs;
+	std::unordered_map<uint64_t, size_t> m_jobIndices;
+};
+
+#endif // H_BRUSH
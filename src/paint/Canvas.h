@@ -0,0 +1,600 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_CANVAS
+#define H_CANVAS
+
+#include "Rect.h"
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PAINT_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
+/// Packed RGBA8 pixel, not premultiplied. On little endian hosts, bytes are
+/// laid out in memory as R, G, B, A, which is what GL_RGBA/GL_UNSIGNED_BYTE expects.
+typedef uint32_t Pixel;
+
+inline Pixel MakePixel(unsigned char r, unsigned char g, unsigned char b, unsigned char a = 255) {
+	return (Pixel)r | ((Pixel)g << 8) | ((Pixel)b << 16) | ((Pixel)a << 24);
+}
+inline unsigned char PixelR(Pixel p) { return p & 0xff; }
+inline unsigned char PixelG(Pixel p) { return (p >> 8) & 0xff; }
+inline unsigned char PixelB(Pixel p) { return (p >> 16) & 0xff; }
+inline unsigned char PixelA(Pixel p) { return (p >> 24) & 0xff; }
+
+/// Set n pixels starting at dst to color
+inline void FillPixels(Pixel *dst, int n, Pixel color) {
+	int i = 0;
+#ifdef PAINT_HAS_SSE2
+	__m128i c = _mm_set1_epi32((int)color);
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), c);
+	}
+#endif
+	for (; i < n; ++i) {
+		dst[i] = color;
+	}
+}
+
+/// Composite color over dst, with color's alpha scaled by coverage in [0, 1]
+inline Pixel BlendPixel(Pixel dst, Pixel color, float coverage) {
+	float a = PixelA(color) * coverage * (1.0f / 255.0f);
+	if (a <= 0.0f) {
+		return dst;
+	}
+	if (a >= 1.0f) {
+		return color;
+	}
+	if (PixelA(dst) == 255) {
+		// Most common case, no need to normalize
+		return MakePixel(
+			(unsigned char)(PixelR(dst) + (PixelR(color) - PixelR(dst)) * a + 0.5f),
+			(unsigned char)(PixelG(dst) + (PixelG(color) - PixelG(dst)) * a + 0.5f),
+			(unsigned char)(PixelB(dst) + (PixelB(color) - PixelB(dst)) * a + 0.5f),
+			255
+		);
+	}
+	float da = PixelA(dst) * (1.0f / 255.0f) * (1.0f - a);
+	float oa = a + da;
+	float invOa = 1.0f / oa;
+	return MakePixel(
+		(unsigned char)((PixelR(color) * a + PixelR(dst) * da) * invOa + 0.5f),
+		(unsigned char)((PixelG(color) * a + PixelG(dst) * da) * invOa + 0.5f),
+		(unsigned char)((PixelB(color) * a + PixelB(dst) * da) * invOa + 0.5f),
+		(unsigned char)(oa * 255.0f + 0.5f)
+	);
+}
+
+/// Remove a fraction coverage in [0, 1] of the alpha of dst
+inline Pixel ErasePixel(Pixel dst, float coverage) {
+	if (coverage >= 1.0f) {
+		return 0;
+	}
+	unsigned char a = (unsigned char)(PixelA(dst) * (1.0f - coverage) + 0.5f);
+	return a == 0 ? 0 : (dst & 0x00ffffff) | ((Pixel)a << 24);
+}
+
+/// Side of the square tiles a canvas is split into, in pixels
+const int TileSize = 64;
+
+/**
+ * Square block of TileSize x TileSize pixels.
+ * A tile that has the same color all over it only stores this color.
+ */
+class Tile {
+public:
+	explicit Tile(Pixel color = 0)
+		: m_color(color)
+	{}
+
+	bool IsUniform() const { return m_pixels.empty(); }
+	/// Color of the whole tile, only relevant if IsUniform()
+	Pixel Color() const { return m_color; }
+
+	Pixel At(int x, int y) const {
+		return IsUniform() ? m_color : m_pixels[y * TileSize + x];
+	}
+
+	/// Return NULL for uniform tiles
+	const Pixel *Row(int y) const {
+		return IsUniform() ? NULL : m_pixels.data() + y * TileSize;
+	}
+
+	/// Uniform tiles get expanded to actual pixel storage first
+	Pixel *MutableData() {
+		if (IsUniform()) {
+			m_pixels.assign(TileSize * TileSize, m_color);
+		}
+		return m_pixels.data();
+	}
+	Pixel *MutableRow(int y) { return MutableData() + y * TileSize; }
+
+	void Fill(Pixel color) {
+		std::vector<Pixel>().swap(m_pixels);
+		m_color = color;
+	}
+
+	/// Go back to uniform storage if all pixels are equal.
+	/// Return true if the tile is uniform afterwards.
+	bool Collapse() {
+		if (IsUniform()) {
+			return true;
+		}
+		Pixel color = m_pixels[0];
+		for (Pixel p : m_pixels) {
+			if (p != color) {
+				return false;
+			}
+		}
+		Fill(color);
+		return true;
+	}
+
+	/// Copy pixels [x0, x1[ of row y into dst
+	void ReadRow(int y, int x0, int x1, Pixel *dst) const {
+		if (IsUniform()) {
+			std::fill(dst, dst + (x1 - x0), m_color);
+		} else {
+			std::copy(Row(y) + x0, Row(y) + x1, dst);
+		}
+	}
+
+	size_t ByteSize() const {
+		return sizeof(Tile) + m_pixels.capacity() * sizeof(Pixel);
+	}
+
+private:
+	Pixel m_color;
+	std::vector<Pixel> m_pixels;
+};
+
+/**
+ * Sparse pixel storage, split into TileSize x TileSize tiles.
+ * Tiles are allocated on first write only, and tiles that have never been
+ * written read as the background color, so that memory scales with the
+ * painted area rather than with the canvas extent.
+ *
+ * Tiles are held through shared pointers so that they can be referenced from
+ * elsewhere (e.g. history) and are detached only when written to.
+ *
+ * Invariant: pixels of edge tiles that lie beyond the canvas size are always
+ * equal to the background color, so growing the canvas never touches pixels.
+ */
+class TiledCanvas {
+public:
+	typedef std::shared_ptr<Tile> TilePtr;
+
+	TiledCanvas()
+		: m_width(0)
+		, m_height(0)
+		, m_tilesX(0)
+		, m_tilesY(0)
+		, m_background(MakePixel(255, 255, 255))
+	{}
+
+	/// Drop all content and start over with a blank canvas
+	void Reset(int w, int h, Pixel background) {
+		m_background = background;
+		m_width = std::max(0, w);
+		m_height = std::max(0, h);
+		m_tilesX = TileCount(m_width);
+		m_tilesY = TileCount(m_height);
+		m_tiles.assign(m_tilesX * m_tilesY, TilePtr());
+	}
+
+	int Width() const { return m_width; }
+	int Height() const { return m_height; }
+	int TilesX() const { return m_tilesX; }
+	int TilesY() const { return m_tilesY; }
+	Pixel Background() const { return m_background; }
+
+	/// Area of tile (tx, ty), clipped to the canvas
+	::Rect TileRect(int tx, int ty) const {
+		int x = tx * TileSize;
+		int y = ty * TileSize;
+		return ::Rect(x, y, std::min(TileSize, m_width - x), std::min(TileSize, m_height - y));
+	}
+
+	/// Read access. Return NULL for tiles that have never been written.
+	const Tile *TileAt(int tx, int ty) const { return m_tiles[ty * m_tilesX + tx].get(); }
+
+	/// Shared access, for those who need to keep a tile as is (e.g. history)
+	const TilePtr & SharedTileAt(int tx, int ty) const { return m_tiles[ty * m_tilesX + tx]; }
+	/// Replace a tile, that may be NULL or shared with someone else
+	void SetTile(int tx, int ty, const TilePtr & tile) { m_tiles[ty * m_tilesX + tx] = tile; }
+
+	/// Write access. Allocate the tile on first write and detach it if it is
+	/// shared with someone else (copy on write).
+	Tile *MutableTile(int tx, int ty) {
+		TilePtr & tile = m_tiles[ty * m_tilesX + tx];
+		if (!tile) {
+			tile = std::make_shared<Tile>(m_background);
+		} else if (tile.use_count() > 1) {
+			tile = std::make_shared<Tile>(*tile);
+		}
+		return tile.get();
+	}
+
+	Pixel PixelAt(int x, int y) const {
+		const Tile *tile = TileAt(x / TileSize, y / TileSize);
+		return tile ? tile->At(x % TileSize, y % TileSize) : m_background;
+	}
+
+	/// Average of the pixels of r that lie within the canvas, weighted by
+	/// alpha. Meant for small areas, such as a color picker sample.
+	Pixel AveragePixel(const ::Rect & r) const {
+		::Rect area = r.Intersected(::Rect(0, 0, m_width, m_height));
+		unsigned int sumR = 0, sumG = 0, sumB = 0, sumA = 0, count = 0;
+		for (int y = area.y; y < area.y + area.h; ++y) {
+			for (int x = area.x; x < area.x + area.w; ++x) {
+				Pixel p = PixelAt(x, y);
+				unsigned int a = PixelA(p);
+				sumR += PixelR(p) * a;
+				sumG += PixelG(p) * a;
+				sumB += PixelB(p) * a;
+				sumA += a;
+				++count;
+			}
+		}
+		if (sumA == 0) {
+			return 0;
+		}
+		return MakePixel(
+			(sumR + sumA / 2) / sumA,
+			(sumG + sumA / 2) / sumA,
+			(sumB + sumA / 2) / sumA,
+			(sumA + count / 2) / count
+		);
+	}
+
+	void SetPixel(int x, int y, Pixel p) {
+		MutableTile(x / TileSize, y / TileSize)->MutableRow(y % TileSize)[x % TileSize] = p;
+	}
+
+	/// Copy rect r, that must lie within the canvas, into dst.
+	/// dstStride is the number of pixels between two rows of dst.
+	void ReadRect(const ::Rect & r, Pixel *dst, int dstStride) const {
+		ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			const Tile *tile = TileAt(tx, ty);
+			int x0 = part.x - tx * TileSize;
+			int y0 = part.y - ty * TileSize;
+			for (int j = 0; j < part.h; ++j) {
+				Pixel *out = dst + (part.y - r.y + j) * dstStride + (part.x - r.x);
+				if (tile) {
+					tile->ReadRow(y0 + j, x0, x0 + part.w, out);
+				} else {
+					std::fill(out, out + part.w, m_background);
+				}
+			}
+		});
+	}
+
+	/// Copy src into rect r, that must lie within the canvas.
+	/// srcStride is the number of pixels between two rows of src.
+	void WriteRect(const ::Rect & r, const Pixel *src, int srcStride) {
+		ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			Tile *tile = MutableTile(tx, ty);
+			int x0 = part.x - tx * TileSize;
+			int y0 = part.y - ty * TileSize;
+			for (int j = 0; j < part.h; ++j) {
+				const Pixel *in = src + (part.y - r.y + j) * srcStride + (part.x - r.x);
+				std::copy(in, in + part.w, tile->MutableRow(y0 + j) + x0);
+			}
+			if (part.w == TileSize && part.h == TileSize) {
+				tile->Collapse();
+			}
+		});
+	}
+
+	/// Fill rect r, that must lie within the canvas. Fully covered tiles
+	/// become uniform, or are released when filled with the background.
+	void FillRect(const ::Rect & r, Pixel color) {
+		ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			if (part.w == TileSize && part.h == TileSize) {
+				TilePtr & tile = m_tiles[ty * m_tilesX + tx];
+				if (color == m_background) {
+					tile.reset();
+				} else {
+					tile = std::make_shared<Tile>(color);
+				}
+				return;
+			}
+			Tile *tile = MutableTile(tx, ty);
+			int x0 = part.x - tx * TileSize;
+			int y0 = part.y - ty * TileSize;
+			for (int j = 0; j < part.h; ++j) {
+				Pixel *row = tile->MutableRow(y0 + j) + x0;
+				std::fill(row, row + part.w, color);
+			}
+		});
+	}
+
+	/// Change the canvas size, keeping the top left content.
+	/// Only edge tiles are touched, the others are kept or dropped as is.
+	void Resize(int w, int h) {
+		w = std::max(0, w);
+		h = std::max(0, h);
+		int tilesX = TileCount(w);
+		int tilesY = TileCount(h);
+		std::vector<TilePtr> tiles(tilesX * tilesY);
+		for (int ty = 0; ty < std::min(tilesY, m_tilesY); ++ty) {
+			for (int tx = 0; tx < std::min(tilesX, m_tilesX); ++tx) {
+				tiles[ty * tilesX + tx] = m_tiles[ty * m_tilesX + tx];
+			}
+		}
+		bool shrinkX = w < m_width;
+		bool shrinkY = h < m_height;
+		m_tiles.swap(tiles);
+		m_width = w;
+		m_height = h;
+		m_tilesX = tilesX;
+		m_tilesY = tilesY;
+
+		// Restore the invariant on what is now the last column and row
+		if (shrinkX && m_tilesX > 0) {
+			for (int ty = 0; ty < m_tilesY; ++ty) {
+				TrimEdgeTile(m_tilesX - 1, ty);
+			}
+		}
+		if (shrinkY && m_tilesY > 0) {
+			for (int tx = 0; tx < m_tilesX; ++tx) {
+				TrimEdgeTile(tx, m_tilesY - 1);
+			}
+		}
+	}
+
+	/// Keep only rect r, that must lie within the canvas. When r is aligned
+	/// on the tile grid, tiles are moved rather than copied.
+	void Crop(const ::Rect & r) {
+		if (r.x % TileSize == 0 && r.y % TileSize == 0) {
+			int offsetX = r.x / TileSize;
+			int offsetY = r.y / TileSize;
+			int tilesX = TileCount(r.w);
+			int tilesY = TileCount(r.h);
+			std::vector<TilePtr> tiles(tilesX * tilesY);
+			for (int ty = 0; ty < tilesY; ++ty) {
+				for (int tx = 0; tx < tilesX; ++tx) {
+					tiles[ty * tilesX + tx] = m_tiles[(ty + offsetY) * m_tilesX + tx + offsetX];
+				}
+			}
+			m_tiles.swap(tiles);
+			m_tilesX = tilesX;
+			m_tilesY = tilesY;
+			m_width = r.w;
+			m_height = r.h;
+			if (m_tilesX > 0 && m_tilesY > 0) {
+				for (int ty = 0; ty < m_tilesY; ++ty) {
+					TrimEdgeTile(m_tilesX - 1, ty);
+				}
+				for (int tx = 0; tx < m_tilesX; ++tx) {
+					TrimEdgeTile(tx, m_tilesY - 1);
+				}
+			}
+			return;
+		}
+
+		TiledCanvas cropped;
+		cropped.Reset(r.w, r.h, m_background);
+		std::vector<Pixel> buffer(TileSize * TileSize);
+		for (int ty = 0; ty < cropped.TilesY(); ++ty) {
+			for (int tx = 0; tx < cropped.TilesX(); ++tx) {
+				::Rect dst = cropped.TileRect(tx, ty);
+				::Rect src(dst.x + r.x, dst.y + r.y, dst.w, dst.h);
+				Pixel color;
+				if (IsUniform(src, color)) {
+					cropped.FillRect(dst, color);
+					continue;
+				}
+				ReadRect(src, buffer.data(), TileSize);
+				cropped.WriteRect(dst, buffer.data(), TileSize);
+			}
+		}
+		*this = cropped;
+	}
+
+	/**
+	 * Copy rect srcRect of src to (x, y). When the offset between both is a
+	 * multiple of TileSize, whole tiles get shared rather than copied.
+	 * Parts that fall out of either canvas are ignored.
+	 */
+	void CopyRect(const TiledCanvas & src, const ::Rect & srcRect, int x, int y) {
+		int dx = x - srcRect.x, dy = y - srcRect.y;
+		::Rect area = srcRect
+			.Intersected(::Rect(0, 0, src.Width(), src.Height()))
+			.Intersected(::Rect(-dx, -dy, m_width, m_height));
+		bool isAligned = dx % TileSize == 0 && dy % TileSize == 0;
+		std::vector<Pixel> buffer;
+		src.ForEachTile(area, [&](int tx, int ty, const ::Rect & part) {
+			if (isAligned && part.w == TileSize && part.h == TileSize) {
+				const TilePtr & tile = src.SharedTileAt(tx, ty);
+				int dstTx = tx + dx / TileSize, dstTy = ty + dy / TileSize;
+				if (tile) {
+					SetTile(dstTx, dstTy, tile);
+				} else {
+					FillRect(TileRect(dstTx, dstTy), src.Background());
+				}
+				return;
+			}
+			buffer.resize(TileSize * TileSize);
+			src.ReadRect(part, buffer.data(), part.w);
+			WriteRect(::Rect(part.x + dx, part.y + dy, part.w, part.h), buffer.data(), part.w);
+		});
+	}
+
+	/// Give back the storage of the tiles of r that ended up having a single
+	/// color, releasing those that are back to the background, so that later
+	/// IsBlank() calls see them. Only call while no other thread reads them.
+	void Compact(const ::Rect & r) {
+		ForEachTile(r, [&](int tx, int ty, const ::Rect &) {
+			TilePtr & tile = m_tiles[ty * m_tilesX + tx];
+			if (!tile || !tile->Collapse()) {
+				return;
+			}
+			if (tile->Color() == m_background) {
+				tile.reset();
+			}
+		});
+	}
+
+	/// True if no pixel of rect r differs from the background. This only looks
+	/// at tile storage, so it is cheap but may return false for tiles that
+	/// have been painted back with the background color.
+	bool IsBlank(const ::Rect & r) const {
+		bool blank = true;
+		ForEachTile(r, [&](int tx, int ty, const ::Rect &) {
+			const Tile *tile = TileAt(tx, ty);
+			if (tile && !(tile->IsUniform() && tile->Color() == m_background)) {
+				blank = false;
+			}
+		});
+		return blank;
+	}
+
+	/// True if all pixels of rect r have the same color, which is then put
+	/// in color. Like IsBlank(), this only looks at tile storage.
+	bool IsUniform(const ::Rect & r, Pixel & color) const {
+		bool uniform = true;
+		bool isFirst = true;
+		ForEachTile(r, [&](int tx, int ty, const ::Rect &) {
+			const Tile *tile = TileAt(tx, ty);
+			Pixel tileColor = tile ? tile->Color() : m_background;
+			if (tile && !tile->IsUniform()) {
+				uniform = false;
+			} else if (isFirst) {
+				color = tileColor;
+				isFirst = false;
+			} else if (tileColor != color) {
+				uniform = false;
+			}
+		});
+		return uniform && !isFirst;
+	}
+
+	/// Memory used by tile storage, in bytes
+	size_t ByteSize() const {
+		size_t size = m_tiles.capacity() * sizeof(TilePtr);
+		for (const TilePtr & tile : m_tiles) {
+			if (tile) {
+				size += tile->ByteSize();
+			}
+		}
+		return size;
+	}
+
+	/// Call f(tx, ty, part) for all tiles intersecting r, where part is the
+	/// intersection of r with the tile, in canvas coordinates.
+	template <typename F>
+	void ForEachTile(const ::Rect & r, F f) const {
+		::Rect clipped = r.Intersected(::Rect(0, 0, m_width, m_height));
+		if (clipped.IsEmpty()) {
+			return;
+		}
+		int tx0 = clipped.x / TileSize;
+		int ty0 = clipped.y / TileSize;
+		int tx1 = (clipped.x + clipped.w - 1) / TileSize;
+		int ty1 = (clipped.y + clipped.h - 1) / TileSize;
+		for (int ty = ty0; ty <= ty1; ++ty) {
+			for (int tx = tx0; tx <= tx1; ++tx) {
+				::Rect part = clipped.Intersected(::Rect(tx * TileSize, ty * TileSize, TileSize, TileSize));
+				f(tx, ty, part);
+			}
+		}
+	}
+
+private:
+	static int TileCount(int size) { return (size + TileSize - 1) / TileSize; }
+
+	/// Reset pixels of tile (tx, ty) that lie beyond the canvas to background
+	void TrimEdgeTile(int tx, int ty) {
+		const Tile *tile = TileAt(tx, ty);
+		if (!tile || (tile->IsUniform() && tile->Color() == m_background)) {
+			return;
+		}
+		::Rect inside = TileRect(tx, ty);
+		if (inside.w == TileSize && inside.h == TileSize) {
+			return;
+		}
+		Tile *mutableTile = MutableTile(tx, ty);
+		for (int j = 0; j < TileSize; ++j) {
+			Pixel *row = mutableTile->MutableRow(j);
+			int begin = j < inside.h ? inside.w : 0;
+			std::fill(row + begin, row + TileSize, m_background);
+		}
+	}
+
+private:
+	int m_width, m_height;
+	int m_tilesX, m_tilesY;
+	Pixel m_background;
+	std::vector<TilePtr> m_tiles;
+};
+
+/**
+ * Tiles of a canvas as they were when first touched since the last Clear().
+ * Tiles are shared with the canvas until it writes to them, so keeping a
+ * snapshot of a region costs nothing until it gets modified.
+ */
+class CanvasSnapshot {
+public:
+	void Clear() {
+		m_tiles.clear();
+	}
+
+	/// Remember tiles intersecting r, unless already done.
+	/// Must be called before the canvas writes to them.
+	void Touch(const TiledCanvas & canvas, const ::Rect & r) {
+		canvas.ForEachTile(r, [&](int tx, int ty, const ::Rect &) {
+			uint64_t key = TileKey(tx, ty);
+			if (m_tiles.find(key) == m_tiles.end()) {
+				m_tiles[key] = canvas.SharedTileAt(tx, ty);
+			}
+		});
+	}
+
+	bool IsTouched(int tx, int ty) const {
+		return m_tiles.find(TileKey(tx, ty)) != m_tiles.end();
+	}
+
+	/// Tile (tx, ty) as it was when touched, NULL if it was blank.
+	/// Untouched tiles are read from the canvas.
+	const Tile *TileAt(const TiledCanvas & canvas, int tx, int ty) const {
+		auto it = m_tiles.find(TileKey(tx, ty));
+		return it == m_tiles.end() ? canvas.TileAt(tx, ty) : it->second.get();
+	}
+
+	/// Same as TiledCanvas::ReadRect(), but reading snapshot tiles
+	void ReadRect(const TiledCanvas & canvas, const ::Rect & r, Pixel *dst, int dstStride) const {
+		canvas.ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			const Tile *tile = TileAt(canvas, tx, ty);
+			int x0 = part.x - tx * TileSize;
+			int y0 = part.y - ty * TileSize;
+			for (int j = 0; j < part.h; ++j) {
+				Pixel *out = dst + (part.y - r.y + j) * dstStride + (part.x - r.x);
+				if (tile) {
+					tile->ReadRow(y0 + j, x0, x0 + part.w, out);
+				} else {
+					std::fill(out, out + part.w, canvas.Background());
+				}
+			}
+		});
+	}
+
+private:
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+private:
+	std::unordered_map<uint64_t, TiledCanvas::TilePtr> m_tiles;
+};
+
+#endif // H_CANVAS
@@ -0,0 +1,135 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_CLIPBOARD
+#define H_CLIPBOARD
+
+#include "Canvas.h"
+#include "Selection.h"
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Pixels that got cut or copied. Tiles are shared with the canvas they come
+ * from, so copying costs nothing until one side writes to them, and pasting
+ * at an offset that is a multiple of TileSize shares them again.
+ *
+ * The copy is also available as a device independent bitmap for other
+ * applications, but it only gets encoded the first time someone asks.
+ */
+class Clipboard {
+public:
+	Clipboard()
+		: m_originX(0)
+		, m_originY(0)
+		, m_isDibValid(false)
+	{}
+
+	bool IsEmpty() const { return m_shape.IsEmpty(); }
+
+	/// Area that was copied, in the coordinates of the canvas it came from
+	const ::Rect & Bounds() const { return m_bounds; }
+
+	/// Remember the pixels of canvas that are in selection
+	void Copy(const TiledCanvas & canvas, const Selection & selection) {
+		m_shape = selection.Intersected(Selection::FromRect(::Rect(0, 0, canvas.Width(), canvas.Height())));
+		m_bounds = m_shape.Bounds();
+		m_isDibValid = false;
+		std::vector<unsigned char>().swap(m_dib);
+		if (IsEmpty()) {
+			m_pixels = TiledCanvas();
+			return;
+		}
+		// Tile aligned, so that cropping shares the tiles
+		m_originX = m_bounds.x / TileSize * TileSize;
+		m_originY = m_bounds.y / TileSize * TileSize;
+		int x1 = std::min((m_bounds.x + m_bounds.w + TileSize - 1) / TileSize * TileSize, canvas.Width());
+		int y1 = std::min((m_bounds.y + m_bounds.h + TileSize - 1) / TileSize * TileSize, canvas.Height());
+		m_pixels = canvas;
+		m_pixels.Crop(::Rect(m_originX, m_originY, x1 - m_originX, y1 - m_originY));
+	}
+
+	/// Area that Paste() writes to when pasting at (x, y)
+	::Rect PasteBounds(int x, int y) const {
+		return ::Rect(x, y, m_bounds.w, m_bounds.h);
+	}
+
+	/**
+	 * Write the copied pixels to canvas, with the top left corner of their
+	 * bounds at (x, y). Return the pixels that got written, in canvas
+	 * coordinates.
+	 */
+	Selection Paste(TiledCanvas & canvas, int x, int y) const {
+		int dx = x - m_bounds.x, dy = y - m_bounds.y;
+		m_shape.ForEachRectInside(m_bounds, [&](const ::Rect & part) {
+			::Rect src(part.x - m_originX, part.y - m_originY, part.w, part.h);
+			canvas.CopyRect(m_pixels, src, part.x + dx, part.y + dy);
+		});
+		return m_shape.Translated(dx, dy)
+			.Intersected(Selection::FromRect(::Rect(0, 0, canvas.Width(), canvas.Height())));
+	}
+
+	/**
+	 * Copy encoded as a BITMAPINFOHEADER followed by bottom-up rows of 32 bit
+	 * BGRA pixels, which is what the CF_DIB clipboard format expects.
+	 * Pixels out of the selection are transparent.
+	 */
+	const std::vector<unsigned char> & Dib() {
+		if (m_isDibValid) {
+			return m_dib;
+		}
+		m_isDibValid = true;
+		int w = m_bounds.w, h = m_bounds.h;
+		const size_t headerSize = 40;
+		m_dib.assign(headerSize + (size_t)w * h * 4, 0);
+		unsigned char *header = m_dib.data();
+		WriteLe(header + 0, 4, (uint32_t)headerSize);
+		WriteLe(header + 4, 4, (uint32_t)w);
+		WriteLe(header + 8, 4, (uint32_t)h);
+		WriteLe(header + 12, 2, 1); // planes
+		WriteLe(header + 14, 2, 32); // bits per pixel
+		WriteLe(header + 20, 4, (uint32_t)(w * h * 4)); // image size, compression being BI_RGB
+
+		std::vector<Pixel> row(w);
+		m_shape.ForEachBand(m_bounds, [&](int y0, int y1, const SelectionSpan *spans, size_t count) {
+			for (int y = y0; y < y1; ++y) {
+				m_pixels.ReadRect(::Rect(m_bounds.x - m_originX, y - m_originY, w, 1), row.data(), w);
+				unsigned char *out = m_dib.data() + headerSize + (size_t)(h - 1 - (y - m_bounds.y)) * w * 4;
+				for (size_t i = 0; i < count; ++i) {
+					int x0 = std::max(spans[i].x0, m_bounds.x) - m_bounds.x;
+					int x1 = std::min(spans[i].x1, m_bounds.x + m_bounds.w) - m_bounds.x;
+					for (int x = x0; x < x1; ++x) {
+						Pixel p = row[x];
+						out[4 * x + 0] = PixelB(p);
+						out[4 * x + 1] = PixelG(p);
+						out[4 * x + 2] = PixelR(p);
+						out[4 * x + 3] = PixelA(p);
+					}
+				}
+			}
+		});
+		return m_dib;
+	}
+
+private:
+	static void WriteLe(unsigned char *dst, int size, uint32_t value) {
+		for (int i = 0; i < size; ++i) {
+			dst[i] = (unsigned char)(value >> (8 * i));
+		}
+	}
+
+private:
+	/// Tiles covering the copy, starting at (m_originX, m_originY) in the
+	/// canvas it came from
+	TiledCanvas m_pixels;
+	int m_originX, m_originY;
+	::Rect m_bounds;
+	Selection m_shape;
+	std::vector<unsigned char> m_dib;
+	bool m_isDibValid;
+};
+
+#endif // H_CLIPBOARD
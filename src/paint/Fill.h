@@ -0,0 +1,346 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_FILL
+#define H_FILL
+
+#include "Canvas.h"
+#include "ThreadPool.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * Bucket fill. Find() looks for the region of pixels connected to a seed
+ * that are close to its color, then Fill() paints it, so that what is about
+ * to change is known in between (e.g. for the history).
+ *
+ * The search never looks at pixels one by one: each tile row gets reduced
+ * once to a 64 bit word telling which of its pixels match the seed, lazily
+ * and with SIMD comparisons, then the scanline fill works on these words.
+ * Spans to visit go on an explicit stack that is reused from a fill to the
+ * next. Painting is done tile by tile in parallel, and fully covered tiles
+ * become uniform.
+ */
+class FloodFill {
+public:
+	explicit FloodFill(ThreadPool & pool = ThreadPool::Global())
+		: m_pool(pool)
+		, m_tilesX(0)
+		, m_tilesY(0)
+		, m_width(0)
+		, m_height(0)
+		, m_target(0)
+		, m_tolerance(0)
+		, m_pixelCount(0)
+	{}
+
+	/**
+	 * Find the 4-connected region around (x, y) whose pixels differ from
+	 * the one at (x, y) by at most tolerance on each channel.
+	 * Return its bounding box, empty if (x, y) is out of the canvas.
+	 */
+	::Rect Find(const TiledCanvas & canvas, int x, int y, int tolerance) {
+		m_bounds = ::Rect();
+		m_pixelCount = 0;
+		m_width = canvas.Width();
+		m_height = canvas.Height();
+		m_tilesX = canvas.TilesX();
+		m_tilesY = canvas.TilesY();
+		m_match.assign(m_tilesX * m_tilesY * TileSize, 0);
+		m_filled.assign(m_tilesX * m_tilesY * TileSize, 0);
+		m_isMatchComputed.assign(m_tilesX * m_tilesY, false);
+		if (x < 0 || y < 0 || x >= m_width || y >= m_height) {
+			return m_bounds;
+		}
+		m_target = canvas.PixelAt(x, y);
+		m_tolerance = std::min(std::max(tolerance, 0), 255);
+
+		m_stack.clear();
+		int x0 = SpanStart(canvas, y, x);
+		int x1 = SpanEnd(canvas, y, x);
+		MarkFilled(y, x0, x1);
+		m_stack.push_back(Span(y, x0, x1));
+		while (!m_stack.empty()) {
+			Span span = m_stack.back();
+			m_stack.pop_back();
+			if (span.y > 0) {
+				ScanRow(canvas, span.y - 1, span.x0, span.x1);
+			}
+			if (span.y + 1 < m_height) {
+				ScanRow(canvas, span.y + 1, span.x0, span.x1);
+			}
+		}
+		return m_bounds;
+	}
+
+	/// Number of pixels in the region found by the last call to Find()
+	size_t PixelCount() const { return m_pixelCount; }
+
+	/// Call f(y, x0, x1) for runs of pixels [x0, x1[ of row y that make the
+	/// region found by the last call to Find(), top to bottom and left to
+	/// right. Runs that cross tile borders come in several parts.
+	template <typename F>
+	void ForEachRun(F f) const {
+		if (m_bounds.IsEmpty()) {
+			return;
+		}
+		int tx0 = m_bounds.x / TileSize;
+		int tx1 = (m_bounds.x + m_bounds.w - 1) / TileSize;
+		for (int y = m_bounds.y; y < m_bounds.y + m_bounds.h; ++y) {
+			for (int tx = tx0; tx <= tx1; ++tx) {
+				uint64_t bits = m_filled[TileIndex(tx, y / TileSize) * TileSize + y % TileSize];
+				while (bits != 0) {
+					int begin = CountTrailingZeros(bits);
+					uint64_t rest = ~(bits >> begin);
+					int length = rest == 0 ? TileSize - begin : CountTrailingZeros(rest);
+					f(y, tx * TileSize + begin, tx * TileSize + begin + length);
+					bits = begin + length >= TileSize ? 0 : bits & (~(uint64_t)0 << (begin + length));
+				}
+			}
+		}
+	}
+
+	/// Paint the region found by the last call to Find() with color.
+	/// The canvas must not have changed size in between.
+	void Fill(TiledCanvas & canvas, Pixel color) {
+		m_jobs.clear();
+		canvas.ForEachTile(m_bounds, [&](int tx, int ty, const ::Rect &) {
+			const uint64_t *filled = &m_filled[TileIndex(tx, ty) * TileSize];
+			::Rect tileRect = canvas.TileRect(tx, ty);
+			uint64_t full = RowMask(tileRect.w);
+			bool isEmpty = true, isFull = true;
+			for (int j = 0; j < tileRect.h; ++j) {
+				isEmpty = isEmpty && filled[j] == 0;
+				isFull = isFull && filled[j] == full;
+			}
+			if (isEmpty) {
+				return;
+			}
+			if (isFull) {
+				canvas.FillRect(tileRect, color);
+				return;
+			}
+			// Allocation is not thread safe, so it happens here
+			Job job;
+			job.tile = canvas.MutableTile(tx, ty);
+			job.filled = filled;
+			job.rows = tileRect.h;
+			m_jobs.push_back(job);
+		});
+
+		m_pool.ParallelFor(m_jobs.size(), [&](size_t i) {
+			const Job & job = m_jobs[i];
+			for (int j = 0; j < job.rows; ++j) {
+				uint64_t bits = job.filled[j];
+				Pixel *row = job.tile->MutableRow(j);
+				while (bits != 0) {
+					int begin = CountTrailingZeros(bits);
+					uint64_t rest = ~(bits >> begin);
+					int length = rest == 0 ? TileSize - begin : CountTrailingZeros(rest);
+					FillPixels(row + begin, length, color);
+					bits = begin + length >= TileSize ? 0 : bits & (~(uint64_t)0 << (begin + length));
+				}
+			}
+		});
+	}
+
+private:
+	struct Span {
+		Span(int y, int x0, int x1) : y(y), x0(x0), x1(x1) {}
+		int y, x0, x1; /// Pixels [x0, x1[ of row y
+	};
+
+	struct Job {
+		Tile *tile;
+		const uint64_t *filled;
+		int rows;
+	};
+
+private:
+	static int CountTrailingZeros(uint64_t bits) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return (int)index;
+#else
+		return __builtin_ctzll(bits);
+#endif
+	}
+
+	static int HighestBit(uint64_t bits) {
+#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse64(&index, bits);
+		return (int)index;
+#else
+		return 63 - __builtin_clzll(bits);
+#endif
+	}
+
+	/// Bits of the first n pixels of a tile row
+	static uint64_t RowMask(int n) {
+		return n >= TileSize ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+	}
+
+	size_t TileIndex(int tx, int ty) const { return (size_t)ty * m_tilesX + tx; }
+
+	/// Pixels of tile row y that match the target and are not filled yet.
+	/// Bit i is pixel tx * TileSize + i.
+	uint64_t Candidates(const TiledCanvas & canvas, int tx, int y) {
+		size_t tile = TileIndex(tx, y / TileSize);
+		if (!m_isMatchComputed[tile]) {
+			ComputeMatch(canvas, tx, y / TileSize);
+		}
+		size_t i = tile * TileSize + y % TileSize;
+		return m_match[i] & ~m_filled[i];
+	}
+
+	void ComputeMatch(const TiledCanvas & canvas, int tx, int ty) {
+		size_t tile = TileIndex(tx, ty);
+		m_isMatchComputed[tile] = true;
+		uint64_t *match = &m_match[tile * TileSize];
+		::Rect tileRect = canvas.TileRect(tx, ty);
+		uint64_t mask = RowMask(tileRect.w);
+		const Tile *t = canvas.TileAt(tx, ty);
+		if (NULL == t || t->IsUniform()) {
+			bool isMatch = Matches(NULL != t ? t->Color() : canvas.Background());
+			for (int j = 0; j < tileRect.h; ++j) {
+				match[j] = isMatch ? mask : 0;
+			}
+			return;
+		}
+		for (int j = 0; j < tileRect.h; ++j) {
+			match[j] = MatchRow(t->Row(j)) & mask;
+		}
+	}
+
+	bool Matches(Pixel p) const {
+		return abs((int)PixelR(p) - (int)PixelR(m_target)) <= m_tolerance
+			&& abs((int)PixelG(p) - (int)PixelG(m_target)) <= m_tolerance
+			&& abs((int)PixelB(p) - (int)PixelB(m_target)) <= m_tolerance
+			&& abs((int)PixelA(p) - (int)PixelA(m_target)) <= m_tolerance;
+	}
+
+	/// Bit i is set if pixel i of the TileSize pixels of row matches
+	uint64_t MatchRow(const Pixel *row) const {
+		uint64_t bits = 0;
+		int i = 0;
+#ifdef PAINT_HAS_SSE2
+		const __m128i target = _mm_set1_epi32((int)m_target);
+		const __m128i tolerance = _mm_set1_epi8((char)m_tolerance);
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 4 <= TileSize; i += 4) {
+			__m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+			__m128i diff = _mm_or_si128(_mm_subs_epu8(p, target), _mm_subs_epu8(target, p));
+			// One bit per channel, set if within tolerance
+			int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(diff, tolerance), zero));
+			m = m & (m >> 1) & (m >> 2) & (m >> 3) & 0x1111;
+			uint64_t pixels = (m & 1) | ((m >> 3) & 2) | ((m >> 6) & 4) | ((m >> 9) & 8);
+			bits |= pixels << i;
+		}
+#endif
+		for (; i < TileSize; ++i) {
+			if (Matches(row[i])) {
+				bits |= (uint64_t)1 << i;
+			}
+		}
+		return bits;
+	}
+
+	/// First pixel of the run of candidates that contains (x, y)
+	int SpanStart(const TiledCanvas & canvas, int y, int x) {
+		int tx = x / TileSize;
+		int bit = x % TileSize;
+		for (;;) {
+			// Pixels at or left of bit that are not candidates
+			uint64_t others = ~Candidates(canvas, tx, y) & RowMask(bit + 1);
+			if (others != 0) {
+				return tx * TileSize + HighestBit(others) + 1;
+			}
+			if (tx == 0) {
+				return 0;
+			}
+			--tx;
+			bit = TileSize - 1;
+		}
+	}
+
+	/// First pixel after (x, y) that is not a candidate
+	int SpanEnd(const TiledCanvas & canvas, int y, int x) {
+		int tx = x / TileSize;
+		int bit = x % TileSize;
+		for (;;) {
+			uint64_t rest = ~(Candidates(canvas, tx, y) >> bit);
+			if (bit > 0) {
+				rest &= RowMask(TileSize - bit);
+			}
+			if (rest != 0) {
+				return std::min(tx * TileSize + bit + CountTrailingZeros(rest), m_width);
+			}
+			++tx;
+			bit = 0;
+			if (tx >= m_tilesX) {
+				return m_width;
+			}
+		}
+	}
+
+	void MarkFilled(int y, int x0, int x1) {
+		for (int x = x0; x < x1;) {
+			int tx = x / TileSize;
+			int bit = x % TileSize;
+			int n = std::min(x1 - x, TileSize - bit);
+			m_filled[TileIndex(tx, y / TileSize) * TileSize + y % TileSize] |= RowMask(n) << bit;
+			x += n;
+		}
+		m_pixelCount += x1 - x0;
+		m_bounds = m_bounds.United(::Rect(x0, y, x1 - x0, 1));
+	}
+
+	/// Push the runs of candidates of row y that touch [x0, x1[
+	void ScanRow(const TiledCanvas & canvas, int y, int x0, int x1) {
+		int x = x0;
+		while (x < x1) {
+			int tx = x / TileSize;
+			int bit = x % TileSize;
+			uint64_t bits = Candidates(canvas, tx, y) >> bit;
+			int limit = std::min(TileSize - bit, x1 - x);
+			bits &= RowMask(limit);
+			if (bits == 0) {
+				x += limit;
+				continue;
+			}
+			int start = x + CountTrailingZeros(bits);
+			int spanStart = start == x0 ? SpanStart(canvas, y, start) : start;
+			int spanEnd = SpanEnd(canvas, y, start);
+			MarkFilled(y, spanStart, spanEnd);
+			m_stack.push_back(Span(y, spanStart, spanEnd));
+			x = spanEnd;
+		}
+	}
+
+private:
+	ThreadPool & m_pool;
+	int m_tilesX, m_tilesY;
+	int m_width, m_height;
+	Pixel m_target;
+	int m_tolerance;
+	/// One word per tile row, bit i being pixel i of the row
+	std::vector<uint64_t> m_match;
+	std::vector<uint64_t> m_filled;
+	std::vector<bool> m_isMatchComputed;
+	std::vector<Span> m_stack;
+	std::vector<Job> m_jobs;
+	::Rect m_bounds;
+	size_t m_pixelCount;
+};
+
+#endif // H_FILL
@@ -0,0 +1,86 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#include "Font.h"
+
+#include <fstream>
+#include <iterator>
+
+// NanoVG also builds stb_truetype, so this copy is kept private to the file
+#define STB_TRUETYPE_STATIC
+#define STB_TRUETYPE_IMPLEMENTATION
+#include "stb_truetype.h"
+
+struct Font::Impl {
+	std::vector<unsigned char> data;
+	stbtt_fontinfo info;
+	int ascent, descent, lineGap;
+};
+
+Font::Font()
+	: m_id(0)
+{}
+
+Font::~Font() {}
+
+bool Font::Load(const std::string & filename) {
+	static int lastId = 0;
+	m_impl.reset();
+
+	std::ifstream file(filename.c_str(), std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	std::unique_ptr<Impl> impl(new Impl());
+	impl->data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	int offset = stbtt_GetFontOffsetForIndex(impl->data.data(), 0);
+	if (offset < 0 || !stbtt_InitFont(&impl->info, impl->data.data(), offset)) {
+		return false;
+	}
+	stbtt_GetFontVMetrics(&impl->info, &impl->ascent, &impl->descent, &impl->lineGap);
+	m_impl = std::move(impl);
+	m_id = ++lastId;
+	return true;
+}
+
+bool Font::IsLoaded() const {
+	return NULL != m_impl.get();
+}
+
+int Font::GlyphIndex(uint32_t codepoint) const {
+	return stbtt_FindGlyphIndex(&m_impl->info, (int)codepoint);
+}
+
+float Font::Ascent(float size) const {
+	return m_impl->ascent * stbtt_ScaleForPixelHeight(&m_impl->info, size);
+}
+
+float Font::LineHeight(float size) const {
+	return (m_impl->ascent - m_impl->descent + m_impl->lineGap) * stbtt_ScaleForPixelHeight(&m_impl->info, size);
+}
+
+float Font::Advance(int glyph, float size) const {
+	int advance, leftSideBearing;
+	stbtt_GetGlyphHMetrics(&m_impl->info, glyph, &advance, &leftSideBearing);
+	return advance * stbtt_ScaleForPixelHeight(&m_impl->info, size);
+}
+
+float Font::Kerning(int glyph, int nextGlyph, float size) const {
+	return stbtt_GetGlyphKernAdvance(&m_impl->info, glyph, nextGlyph) * stbtt_ScaleForPixelHeight(&m_impl->info, size);
+}
+
+void Font::Rasterize(int glyph, float size, float shiftX, GlyphBitmap & bitmap) const {
+	float scale = stbtt_ScaleForPixelHeight(&m_impl->info, size);
+	int x0, y0, x1, y1;
+	stbtt_GetGlyphBitmapBoxSubpixel(&m_impl->info, glyph, scale, scale, shiftX, 0, &x0, &y0, &x1, &y1);
+	bitmap.left = x0;
+	bitmap.top = y0;
+	bitmap.width = x1 - x0;
+	bitmap.height = y1 - y0;
+	bitmap.coverage.assign(bitmap.width * bitmap.height, 0);
+	if (bitmap.width > 0 && bitmap.height > 0) {
+		stbtt_MakeGlyphBitmapSubpixel(&m_impl->info, bitmap.coverage.data(), bitmap.width, bitmap.height, bitmap.width, scale, scale, shiftX, 0, glyph);
+	}
+}
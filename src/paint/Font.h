@@ -0,0 +1,58 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_FONT
+#define H_FONT
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/// Coverage of a glyph, placed relative to the pen on the baseline
+struct GlyphBitmap {
+	int left, top; /// Offset of the top left pixel, y going down
+	int width, height;
+	std::vector<unsigned char> coverage;
+};
+
+/**
+ * TrueType font, rasterized on the CPU with the stb_truetype copy that
+ * NanoVG ships. Sizes are in pixels, from the top of the ascent to the
+ * bottom of the descent.
+ */
+class Font {
+public:
+	Font();
+	~Font();
+
+	bool Load(const std::string & filename);
+	bool IsLoaded() const;
+
+	/// Different for every loaded font, so that caches can tell them apart
+	int Id() const { return m_id; }
+
+	int GlyphIndex(uint32_t codepoint) const;
+
+	float Ascent(float size) const;
+	/// Distance between consecutive baselines
+	float LineHeight(float size) const;
+	float Advance(int glyph, float size) const;
+	float Kerning(int glyph, int nextGlyph, float size) const;
+
+	/// Draw glyph shifted right by shiftX, that is within [0, 1[
+	void Rasterize(int glyph, float size, float shiftX, GlyphBitmap & bitmap) const;
+
+private:
+	Font(const Font &);
+	Font & operator=(const Font &);
+
+private:
+	struct Impl;
+	std::unique_ptr<Impl> m_impl;
+	int m_id;
+};
+
+#endif // H_FONT
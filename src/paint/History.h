@@ -0,0 +1,364 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_HISTORY
+#define H_HISTORY
+
+#include "Canvas.h"
+
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Undo/redo history of a tiled canvas.
+ * A step only records the tiles that the edit touched. While in the undo
+ * stack, a step holds these tiles as they were before the edit, and undoing
+ * it swaps them with the current tiles of the canvas, so that it then holds
+ * what is needed to redo it. Tiles are never copied by the history itself:
+ * the canvas detaches the ones it writes to (see TiledCanvas::MutableTile),
+ * so the memory used by a step is proportional to the damaged region.
+ *
+ * Usage: BeginStep(), then Touch() any region before writing to it, then
+ * EndStep(). When the history gets bigger than its budget, the oldest steps
+ * get compressed, then dropped.
+ *
+ * Steps may share tiles, with each other or with the canvas and clipboard.
+ * The history only counts tiles that nothing but itself holds, each once,
+ * since dropping the other ones would not free anything.
+ */
+class History {
+public:
+	History(size_t budget = 256 * 1024 * 1024)
+		: m_budget(budget)
+		, m_byteSize(0)
+		, m_isInStep(false)
+	{}
+
+	/// Maximum memory used by the history, in bytes
+	void SetBudget(size_t budget) { m_budget = budget; EnforceBudget(); }
+	size_t Budget() const { return m_budget; }
+	/// Memory used by the undo and redo stacks, in bytes, as of the last
+	/// time the budget was enforced
+	size_t ByteSize() const { return m_byteSize; }
+
+	size_t UndoCount() const { return m_undo.size(); }
+	size_t RedoCount() const { return m_redo.size(); }
+	bool CanUndo() const { return !m_isInStep && !m_undo.empty(); }
+	bool CanRedo() const { return !m_isInStep && !m_redo.empty(); }
+	bool IsInStep() const { return m_isInStep; }
+
+	void BeginStep(const TiledCanvas & canvas) {
+		if (m_isInStep) {
+			return;
+		}
+		m_current = Step();
+		m_current.widthBefore = canvas.Width();
+		m_current.heightBefore = canvas.Height();
+		m_touched.clear();
+		m_isInStep = true;
+	}
+
+	/// Remember tiles intersecting r as they are now. Must be called before
+	/// writing to them during a step, does nothing out of a step.
+	void Touch(const TiledCanvas & canvas, const ::Rect & r) {
+		if (!m_isInStep) {
+			return;
+		}
+		canvas.ForEachTile(r, [&](int tx, int ty, const ::Rect &) {
+			if (!m_touched.insert(TileKey(tx, ty)).second) {
+				return;
+			}
+			TileChange change;
+			change.tx = tx;
+			change.ty = ty;
+			change.tile = canvas.SharedTileAt(tx, ty);
+			m_current.changes.push_back(change);
+		});
+	}
+
+	void EndStep(const TiledCanvas & canvas) {
+		if (!m_isInStep) {
+			return;
+		}
+		m_isInStep = false;
+		m_current.widthAfter = canvas.Width();
+		m_current.heightAfter = canvas.Height();
+
+		// Keep only the tiles that actually changed
+		std::vector<TileChange> & changes = m_current.changes;
+		size_t kept = 0;
+		for (const TileChange & change : changes) {
+			bool isInside = change.tx < canvas.TilesX() && change.ty < canvas.TilesY();
+			if (!isInside || canvas.SharedTileAt(change.tx, change.ty) != change.tile) {
+				changes[kept++] = change;
+			}
+		}
+		changes.resize(kept);
+		changes.shrink_to_fit();
+
+		bool sizeChanged = m_current.widthBefore != m_current.widthAfter || m_current.heightBefore != m_current.heightAfter;
+		if (changes.empty() && !sizeChanged) {
+			return;
+		}
+
+		m_redo.clear();
+		m_undo.push_back(m_current);
+		m_current = Step();
+		EnforceBudget();
+	}
+
+	/// Revert the last step. damage is set to the area that changed, or to
+	/// the whole canvas if its size changed.
+	bool Undo(TiledCanvas & canvas, ::Rect & damage) {
+		if (!CanUndo()) {
+			return false;
+		}
+		Step step = m_undo.back();
+		m_undo.pop_back();
+
+		damage = Swap(canvas, step, step.widthBefore, step.heightBefore);
+
+		m_redo.push_back(step);
+		// Swapping unpacks tiles
+		EnforceBudget();
+		return true;
+	}
+
+	/// Replay the last undone step
+	bool Redo(TiledCanvas & canvas, ::Rect & damage) {
+		if (!CanRedo()) {
+			return false;
+		}
+		Step step = m_redo.back();
+		m_redo.pop_back();
+
+		damage = Swap(canvas, step, step.widthAfter, step.heightAfter);
+
+		m_undo.push_back(step);
+		EnforceBudget();
+		return true;
+	}
+
+	void Clear() {
+		m_undo.clear();
+		m_redo.clear();
+		m_byteSize = 0;
+	}
+
+private:
+	struct TileChange {
+		int tx, ty;
+		TiledCanvas::TilePtr tile;
+		/// Run length encoded copy of tile, used once the step got compressed
+		std::vector<uint32_t> packedTile;
+	};
+
+	struct Step {
+		Step()
+			: widthBefore(0), heightBefore(0)
+			, widthAfter(0), heightAfter(0)
+			, isCompressed(false)
+		{}
+
+		int widthBefore, heightBefore;
+		int widthAfter, heightAfter;
+		std::vector<TileChange> changes;
+		bool isCompressed;
+	};
+
+	/// How many changes of the history hold a tile
+	struct TileHolders {
+		int count;
+		bool isCounted; /// Nothing else holds it, so it is part of the byte size
+	};
+	typedef std::unordered_map<const Tile*, TileHolders> HolderMap;
+
+private:
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+	/// Exchange the tiles of the step with the ones of the canvas, and
+	/// resize the canvas to w x h. Tile indices of a step are only valid
+	/// at the largest of its two sizes, hence the order of resizes.
+	::Rect Swap(TiledCanvas & canvas, Step & step, int w, int h) {
+		bool sizeChanged = w != canvas.Width() || h != canvas.Height();
+		if (sizeChanged) {
+			canvas.Resize(std::max(w, canvas.Width()), std::max(h, canvas.Height()));
+		}
+
+		::Rect damage;
+		for (TileChange & change : step.changes) {
+			if (!change.packedTile.empty()) {
+				change.tile = Unpack(change.packedTile);
+				std::vector<uint32_t>().swap(change.packedTile);
+			}
+			TiledCanvas::TilePtr tile = canvas.SharedTileAt(change.tx, change.ty);
+			canvas.SetTile(change.tx, change.ty, change.tile);
+			change.tile = tile;
+			damage = damage.United(canvas.TileRect(change.tx, change.ty));
+		}
+		step.isCompressed = false;
+
+		if (sizeChanged) {
+			canvas.Resize(w, h);
+			return ::Rect(0, 0, w, h);
+		}
+		return damage;
+	}
+
+	/// Memory of a step besides its tiles
+	static size_t OwnByteSize(const Step & step) {
+		size_t size = sizeof(Step) + step.changes.capacity() * sizeof(TileChange);
+		for (const TileChange & change : step.changes) {
+			size += change.packedTile.capacity() * sizeof(uint32_t);
+		}
+		return size;
+	}
+
+	/**
+	 * Memory used by all steps. Each tile is counted once, and only if the
+	 * history holds all references to it. holders gets, for each tile, how
+	 * many changes hold it.
+	 */
+	size_t MeasureByteSize(HolderMap & holders) const {
+		holders.clear();
+		size_t size = 0;
+		for (const std::deque<Step> *stack : { &m_undo, &m_redo }) {
+			for (const Step & step : *stack) {
+				size += OwnByteSize(step);
+				for (const TileChange & change : step.changes) {
+					if (change.tile) {
+						TileHolders & h = holders[change.tile.get()];
+						++h.count;
+					}
+				}
+			}
+		}
+		for (const std::deque<Step> *stack : { &m_undo, &m_redo }) {
+			for (const Step & step : *stack) {
+				for (const TileChange & change : step.changes) {
+					if (!change.tile) {
+						continue;
+					}
+					TileHolders & h = holders[change.tile.get()];
+					if (!h.isCounted && h.count == change.tile.use_count()) {
+						h.isCounted = true;
+						size += change.tile->ByteSize();
+					}
+				}
+			}
+		}
+		return size;
+	}
+
+	/**
+	 * Compress oldest steps first, undone ones last, then drop them in the
+	 * same order if it was not enough. Only what this actually frees is
+	 * subtracted from the byte size.
+	 */
+	void EnforceBudget() {
+		HolderMap holders;
+		m_byteSize = MeasureByteSize(holders);
+		if (m_byteSize <= m_budget) {
+			return;
+		}
+
+		for (std::deque<Step> *stack : { &m_undo, &m_redo }) {
+			for (size_t i = 0; i < stack->size() && m_byteSize > m_budget; ++i) {
+				Step & step = (*stack)[i];
+				if (step.isCompressed) {
+					continue;
+				}
+				m_byteSize -= OwnByteSize(step);
+				Compress(step, holders, m_byteSize);
+				m_byteSize += OwnByteSize(step);
+			}
+		}
+
+		for (std::deque<Step> *stack : { &m_undo, &m_redo }) {
+			while (!stack->empty() && m_byteSize > m_budget) {
+				Step & step = stack->front();
+				m_byteSize -= OwnByteSize(step);
+				for (const TileChange & change : step.changes) {
+					if (!change.tile) {
+						continue;
+					}
+					TileHolders & h = holders[change.tile.get()];
+					if (--h.count == 0 && h.isCounted) {
+						m_byteSize -= change.tile->ByteSize();
+					}
+				}
+				stack->pop_front();
+			}
+		}
+	}
+
+	/// Pack the tiles that only this step holds, and subtract the memory it
+	/// frees from byteSize. Shared tiles are left for later, as packing them
+	/// would not free them.
+	static void Compress(Step & step, HolderMap & holders, size_t & byteSize) {
+		bool isShared = false;
+		for (TileChange & change : step.changes) {
+			if (!change.tile || change.tile->IsUniform()) {
+				continue;
+			}
+			TileHolders & h = holders[change.tile.get()];
+			if (h.count > 1 || !h.isCounted) {
+				isShared = true;
+				continue;
+			}
+			std::vector<uint32_t> packed = Pack(*change.tile);
+			if (packed.size() < TileSize * TileSize / 2) {
+				packed.shrink_to_fit();
+				change.packedTile.swap(packed);
+				byteSize -= change.tile->ByteSize();
+				holders.erase(change.tile.get());
+				change.tile.reset();
+			}
+		}
+		step.isCompressed = !isShared;
+	}
+
+	/// Run length encoding, as a list of (count, color) pairs
+	static std::vector<uint32_t> Pack(const Tile & tile) {
+		std::vector<uint32_t> packed;
+		const Pixel *pixels = tile.Row(0);
+		int i = 0;
+		while (i < TileSize * TileSize) {
+			int j = i + 1;
+			while (j < TileSize * TileSize && pixels[j] == pixels[i]) {
+				++j;
+			}
+			packed.push_back((uint32_t)(j - i));
+			packed.push_back(pixels[i]);
+			i = j;
+		}
+		return packed;
+	}
+
+	static TiledCanvas::TilePtr Unpack(const std::vector<uint32_t> & packed) {
+		TiledCanvas::TilePtr tile = std::make_shared<Tile>();
+		Pixel *out = tile->MutableData();
+		for (size_t i = 0; i + 1 < packed.size(); i += 2) {
+			out = std::fill_n(out, packed[i], packed[i + 1]);
+		}
+		return tile;
+	}
+
+private:
+	size_t m_budget;
+	size_t m_byteSize;
+	std::deque<Step> m_undo;
+	std::deque<Step> m_redo;
+	Step m_current;
+	std::unordered_set<uint64_t> m_touched;
+	bool m_isInStep;
+};
+
+#endif // H_HISTORY
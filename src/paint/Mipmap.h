@@ -0,0 +1,275 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_MIPMAP
+#define H_MIPMAP
+
+#include "Canvas.h"
+#include "ThreadPool.h"
+
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * Downsampled copies of a tiled canvas, used to display it zoomed out.
+ * Level 0 is the canvas itself, and each level is half the size of the
+ * previous one, down to a level that fits in a single tile.
+ *
+ * Levels are maintained lazily: Invalidate() only marks the tiles that an
+ * edit of the canvas affects, and they get recomputed from the level below
+ * when someone asks for them with Update(). Tiles whose sources are all
+ * uniform of the same color stay uniform without looking at any pixel.
+ */
+class MipPyramid {
+public:
+	explicit MipPyramid(const TiledCanvas & base, ThreadPool & pool = ThreadPool::Global())
+		: m_base(base)
+		, m_pool(pool)
+		, m_baseWidth(0)
+		, m_baseHeight(0)
+	{}
+
+	/// Number of levels, including the canvas itself
+	int LevelCount() const { return (int)m_levels.size() + 1; }
+
+	const TiledCanvas & Level(int level) const {
+		return level == 0 ? m_base : m_levels[level - 1].canvas;
+	}
+
+	/// Smallest area of level that covers rect r of the canvas
+	static ::Rect LevelRect(const ::Rect & r, int level) {
+		if (r.IsEmpty()) {
+			return ::Rect();
+		}
+		int x0 = r.x >> level;
+		int y0 = r.y >> level;
+		int x1 = (r.x + r.w + (1 << level) - 1) >> level;
+		int y1 = (r.y + r.h + (1 << level) - 1) >> level;
+		return ::Rect(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	/// Drop all levels, to be called when the whole canvas changed
+	void Reset() {
+		m_levels.clear();
+		m_baseWidth = 0;
+		m_baseHeight = 0;
+		Resize();
+	}
+
+	/// Follow a change of the size of the canvas. Levels keep what is still
+	/// valid, and only their edges get invalidated.
+	void Resize() {
+		int w = m_base.Width(), h = m_base.Height();
+		if (w == m_baseWidth && h == m_baseHeight) {
+			return;
+		}
+		int levelCount = 1;
+		for (int s = std::max(w, h); s > TileSize; s = (s + 1) / 2) {
+			++levelCount;
+		}
+
+		size_t keptLevels = std::min(m_levels.size(), (size_t)levelCount - 1);
+		m_levels.resize(levelCount - 1);
+		for (size_t i = 0; i < m_levels.size(); ++i) {
+			int level = (int)i + 1;
+			int levelWidth = (w + (1 << level) - 1) >> level;
+			int levelHeight = (h + (1 << level) - 1) >> level;
+			if (i < keptLevels) {
+				m_levels[i].canvas.Resize(levelWidth, levelHeight);
+			} else {
+				m_levels[i].canvas.Reset(levelWidth, levelHeight, m_base.Background());
+				m_levels[i].dirtyTiles.clear();
+				m_levels[i].isAllDirty = true;
+			}
+		}
+
+		// Pixels along the old edges were averaged with what lies beyond
+		int keptWidth = std::min(w, m_baseWidth);
+		int keptHeight = std::min(h, m_baseHeight);
+		m_baseWidth = w;
+		m_baseHeight = h;
+		Invalidate(::Rect(keptWidth - 1, 0, w - keptWidth + 1, h));
+		Invalidate(::Rect(0, keptHeight - 1, w, h - keptHeight + 1));
+	}
+
+	/// Call after rect r of the canvas changed
+	void Invalidate(const ::Rect & r) {
+		for (size_t i = 0; i < m_levels.size(); ++i) {
+			MipLevel & level = m_levels[i];
+			if (level.isAllDirty) {
+				continue;
+			}
+			level.canvas.ForEachTile(LevelRect(r, (int)i + 1), [&](int tx, int ty, const ::Rect &) {
+				level.dirtyTiles.insert(TileKey(tx, ty));
+			});
+		}
+	}
+
+	/// Recompute tiles of level that intersect r (in level pixels), and the
+	/// tiles of lower levels that they depend on
+	void Update(int level, const ::Rect & r) {
+		if (level <= 0 || level >= LevelCount()) {
+			return;
+		}
+		MipLevel & l = m_levels[level - 1];
+		if (l.isAllDirty) {
+			l.canvas.ForEachTile(::Rect(0, 0, l.canvas.Width(), l.canvas.Height()), [&](int tx, int ty, const ::Rect &) {
+				l.dirtyTiles.insert(TileKey(tx, ty));
+			});
+			l.isAllDirty = false;
+		}
+		if (l.dirtyTiles.empty()) {
+			return;
+		}
+
+		::Rect sources;
+		std::vector<Job> jobs;
+		l.canvas.ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			if (l.dirtyTiles.find(TileKey(tx, ty)) == l.dirtyTiles.end()) {
+				return;
+			}
+			Job job;
+			job.tx = tx;
+			job.ty = ty;
+			job.area = part;
+			jobs.push_back(job);
+			sources = sources.United(::Rect(part.x * 2, part.y * 2, part.w * 2, part.h * 2));
+		});
+		if (jobs.empty()) {
+			return;
+		}
+		Update(level - 1, sources);
+
+		const TiledCanvas & source = Level(level - 1);
+		size_t kept = 0;
+		for (const Job & constJob : jobs) {
+			Job job = constJob;
+			l.dirtyTiles.erase(TileKey(job.tx, job.ty));
+			Pixel color;
+			if (IsUniformSource(source, job.tx, job.ty, color)) {
+				l.canvas.FillRect(job.area, color);
+				continue;
+			}
+			// Allocation is not thread safe, so it happens here
+			job.tile = l.canvas.MutableTile(job.tx, job.ty);
+			jobs[kept++] = job;
+		}
+		jobs.resize(kept);
+
+		m_pool.ParallelFor(jobs.size(), [&](size_t i) {
+			Downsample(source, jobs[i]);
+		});
+	}
+
+	/// Number of tiles waiting to be recomputed, in all levels
+	size_t DirtyTileCount() const {
+		size_t count = 0;
+		for (const MipLevel & level : m_levels) {
+			count += level.isAllDirty ? level.canvas.TilesX() * level.canvas.TilesY() : level.dirtyTiles.size();
+		}
+		return count;
+	}
+
+private:
+	struct MipLevel {
+		MipLevel() : isAllDirty(true) {}
+
+		TiledCanvas canvas;
+		std::unordered_set<uint64_t> dirtyTiles;
+		/// Set when the level has never been computed, so that dirty
+		/// tiles do not need to be listed one by one
+		bool isAllDirty;
+	};
+
+	struct Job {
+		Job() : tx(0), ty(0), tile(NULL) {}
+
+		int tx, ty;
+		::Rect area;
+		Tile *tile;
+	};
+
+private:
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+	/// True if the (up to) four source tiles of tile (tx, ty) are uniform
+	/// of the same color, which is then returned in color
+	static bool IsUniformSource(const TiledCanvas & source, int tx, int ty, Pixel & color) {
+		bool isFirst = true;
+		for (int sy = 2 * ty; sy < std::min(2 * ty + 2, source.TilesY()); ++sy) {
+			for (int sx = 2 * tx; sx < std::min(2 * tx + 2, source.TilesX()); ++sx) {
+				const Tile *tile = source.TileAt(sx, sy);
+				if (tile && !tile->IsUniform()) {
+					return false;
+				}
+				Pixel c = tile ? tile->Color() : source.Background();
+				if (!isFirst && c != color) {
+					return false;
+				}
+				color = c;
+				isFirst = false;
+			}
+		}
+		return !isFirst;
+	}
+
+	/// Box filter. Source pixels beyond the source size are clamped to its
+	/// last row and column.
+	static void Downsample(const TiledCanvas & source, const Job & job) {
+		const ::Rect & a = job.area;
+		::Rect sourceRect = ::Rect(a.x * 2, a.y * 2, a.w * 2, a.h * 2).Intersected(::Rect(0, 0, source.Width(), source.Height()));
+		const int stride = 2 * TileSize;
+		Pixel buffer[2 * TileSize * 2 * TileSize];
+		source.ReadRect(sourceRect, buffer, stride);
+
+		int x0 = a.x - job.tx * TileSize;
+		int y0 = a.y - job.ty * TileSize;
+		int lastX = sourceRect.w - 1, lastY = sourceRect.h - 1;
+		for (int j = 0; j < a.h; ++j) {
+			const Pixel *row0 = buffer + std::min(2 * j, lastY) * stride;
+			const Pixel *row1 = buffer + std::min(2 * j + 1, lastY) * stride;
+			Pixel *out = job.tile->MutableRow(y0 + j) + x0;
+			for (int i = 0; i < a.w; ++i) {
+				int i0 = std::min(2 * i, lastX), i1 = std::min(2 * i + 1, lastX);
+				out[i] = Average(row0[i0], row0[i1], row1[i0], row1[i1]);
+			}
+		}
+	}
+
+	/// Average of four pixels, weighted by alpha
+	static Pixel Average(Pixel p0, Pixel p1, Pixel p2, Pixel p3) {
+		unsigned int a0 = PixelA(p0), a1 = PixelA(p1), a2 = PixelA(p2), a3 = PixelA(p3);
+		unsigned int a = a0 + a1 + a2 + a3;
+		if (a == 4 * 255) {
+			// Most common case, no need to weight
+			return MakePixel(
+				(PixelR(p0) + PixelR(p1) + PixelR(p2) + PixelR(p3) + 2) / 4,
+				(PixelG(p0) + PixelG(p1) + PixelG(p2) + PixelG(p3) + 2) / 4,
+				(PixelB(p0) + PixelB(p1) + PixelB(p2) + PixelB(p3) + 2) / 4,
+				255
+			);
+		}
+		if (a == 0) {
+			return 0;
+		}
+		return MakePixel(
+			(PixelR(p0) * a0 + PixelR(p1) * a1 + PixelR(p2) * a2 + PixelR(p3) * a3 + a / 2) / a,
+			(PixelG(p0) * a0 + PixelG(p1) * a1 + PixelG(p2) * a2 + PixelG(p3) * a3 + a / 2) / a,
+			(PixelB(p0) * a0 + PixelB(p1) * a1 + PixelB(p2) * a2 + PixelB(p3) * a3 + a / 2) / a,
+			(a + 2) / 4
+		);
+	}
+
+private:
+	const TiledCanvas & m_base;
+	ThreadPool & m_pool;
+	int m_baseWidth, m_baseHeight;
+	std::vector<MipLevel> m_levels;
+};
+
+#endif // H_MIPMAP
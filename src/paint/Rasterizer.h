@@ -0,0 +1,375 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_RASTERIZER
+#define H_RASTERIZER
+
+#include "Canvas.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+/// Line segment, in canvas pixels
+struct StrokeSegment {
+	float x0, y0, x1, y1;
+};
+
+struct StrokePoint {
+	float x, y;
+};
+
+/**
+ * Segments of a polyline, bucketed by the tiles that they may reach once
+ * stroked. Finding the segments near an area then costs about the number
+ * of segments there, rather than the length of the whole polyline.
+ */
+class SegmentGrid {
+public:
+	SegmentGrid()
+		: m_margin(0)
+		, m_count(0)
+	{}
+
+	/// Forget all segments. Only tiles within bounds get indexed, and
+	/// segments reach margin pixels around them.
+	void Reset(const ::Rect & bounds, float margin) {
+		m_cells.clear();
+		m_bounds = bounds;
+		m_margin = margin;
+		m_count = 0;
+	}
+
+	float Margin() const { return m_margin; }
+	/// Number of segments added, which is the index of the next one
+	size_t Count() const { return m_count; }
+
+	void Add(const StrokePoint & a, const StrokePoint & b) {
+		::Rect r = ::Rect(
+			(int)floor(std::min(a.x, b.x) - m_margin),
+			(int)floor(std::min(a.y, b.y) - m_margin),
+			(int)ceil(fabs(b.x - a.x) + 2 * m_margin) + 1,
+			(int)ceil(fabs(b.y - a.y) + 2 * m_margin) + 1
+		).Intersected(m_bounds);
+		if (!r.IsEmpty()) {
+			for (int ty = r.y / TileSize; ty <= (r.y + r.h - 1) / TileSize; ++ty) {
+				for (int tx = r.x / TileSize; tx <= (r.x + r.w - 1) / TileSize; ++tx) {
+					m_cells[TileKey(tx, ty)].push_back((uint32_t)m_count);
+				}
+			}
+		}
+		++m_count;
+	}
+
+	/// Indices of the segments that may reach area, in increasing order
+	void Query(const ::Rect & area, std::vector<uint32_t> & indices) const {
+		indices.clear();
+		::Rect r = area.Intersected(m_bounds);
+		if (r.IsEmpty()) {
+			return;
+		}
+		for (int ty = r.y / TileSize; ty <= (r.y + r.h - 1) / TileSize; ++ty) {
+			for (int tx = r.x / TileSize; tx <= (r.x + r.w - 1) / TileSize; ++tx) {
+				auto it = m_cells.find(TileKey(tx, ty));
+				if (it != m_cells.end()) {
+					indices.insert(indices.end(), it->second.begin(), it->second.end());
+				}
+			}
+		}
+		std::sort(indices.begin(), indices.end());
+		indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	}
+
+private:
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+private:
+	::Rect m_bounds;
+	float m_margin;
+	size_t m_count;
+	std::unordered_map<uint64_t, std::vector<uint32_t> > m_cells;
+};
+
+/**
+ * CPU stroke engine, writing directly to a tiled canvas.
+ * It does not need any graphics context, so it works on headless machines.
+ *
+ * Between BeginStroke() and EndStroke(), the coverage of the whole stroke is
+ * accumulated in a per tile 8-bit buffer, allocated only for tiles that the
+ * stroke reaches. Each call to Stroke() max-combines the coverage of the new
+ * segments into it and composites the stroke color once over the pixels as
+ * they were before the stroke, so overlapping segments and joints between
+ * flushes never get blended twice, and only pixels whose coverage grew get
+ * blended at all.
+ */
+class StrokeRasterizer {
+public:
+	explicit StrokeRasterizer(ThreadPool & pool = ThreadPool::Global())
+		: m_pool(pool)
+		, m_isInStroke(false)
+	{}
+
+	/// Pixels that segments of the given width may cover
+	static ::Rect Bounds(const std::vector<StrokeSegment> & segments, float width) {
+		if (segments.empty()) {
+			return ::Rect();
+		}
+		float margin = width / 2 + 1;
+		float minX = segments[0].x0, maxX = segments[0].x0;
+		float minY = segments[0].y0, maxY = segments[0].y0;
+		for (const StrokeSegment & s : segments) {
+			minX = std::min(minX, std::min(s.x0, s.x1));
+			maxX = std::max(maxX, std::max(s.x0, s.x1));
+			minY = std::min(minY, std::min(s.y0, s.y1));
+			maxY = std::max(maxY, std::max(s.y0, s.y1));
+		}
+		int x0 = (int)floor(minX - margin);
+		int y0 = (int)floor(minY - margin);
+		int x1 = (int)ceil(maxX + margin);
+		int y1 = (int)ceil(maxY + margin);
+		return ::Rect(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	void BeginStroke() {
+		m_isInStroke = true;
+		m_snapshot.Clear();
+		m_coverage.clear();
+	}
+
+	void EndStroke() {
+		m_isInStroke = false;
+		m_snapshot.Clear();
+		m_coverage.clear();
+	}
+
+	bool IsInStroke() const { return m_isInStroke; }
+
+	/**
+	 * Draw segments with round caps, composited over the canvas with color.
+	 * Antialiasing is computed analytically from the distance to the
+	 * segments. Out of BeginStroke()/EndStroke(), segments make a stroke on
+	 * their own. Tiles are rasterized in parallel.
+	 */
+	void Stroke(TiledCanvas & canvas, const std::vector<StrokeSegment> & segments, float width, Pixel color) {
+		Rasterize(canvas, segments, width, color, false);
+	}
+
+	/// Same as Stroke(), but removing alpha from the pixels instead of
+	/// compositing a color over them
+	void Erase(TiledCanvas & canvas, const std::vector<StrokeSegment> & segments, float width) {
+		Rasterize(canvas, segments, width, 0, true);
+	}
+
+private:
+	/// Segment with precomputed values for distance computation
+	struct Segment {
+		Segment(const StrokeSegment & s)
+			: ax(s.x0), ay(s.y0)
+			, dx(s.x1 - s.x0), dy(s.y1 - s.y0)
+		{
+			float length2 = dx * dx + dy * dy;
+			invLength2 = length2 > 0 ? 1.0f / length2 : 0.0f;
+			minY = std::min(s.y0, s.y1);
+			maxY = std::max(s.y0, s.y1);
+		}
+
+		float Distance(float px, float py) const {
+			float pax = px - ax, pay = py - ay;
+			float t = std::min(std::max((pax * dx + pay * dy) * invLength2, 0.0f), 1.0f);
+			float ex = pax - t * dx, ey = pay - t * dy;
+			return sqrt(ex * ex + ey * ey);
+		}
+
+		float ax, ay, dx, dy;
+		float invLength2;
+		float minY, maxY;
+	};
+
+	struct Job {
+		Tile *tile;
+		/// Tile before the stroke started, NULL if blank
+		const Tile *original;
+		/// Accumulated coverage of the stroke over the tile
+		unsigned char *coverage;
+		int tileX, tileY;
+		::Rect area;
+	};
+
+private:
+	void Rasterize(TiledCanvas & canvas, const std::vector<StrokeSegment> & segments, float width, Pixel color, bool isErasing) {
+		if (segments.empty()) {
+			return;
+		}
+		bool isOneShot = !m_isInStroke;
+		if (isOneShot) {
+			BeginStroke();
+		}
+		float radius = std::max(width / 2, 0.5f);
+
+		m_segments.clear();
+		for (const StrokeSegment & s : segments) {
+			m_segments.push_back(Segment(s));
+		}
+
+		// Copy on write and buffer allocation are not thread safe, so they
+		// are done here for all the tiles that the segments reach
+		m_jobs.clear();
+		canvas.ForEachTile(Bounds(segments, width), [&](int tx, int ty, const ::Rect & part) {
+			::Rect tileRect = canvas.TileRect(tx, ty);
+			if (!Reaches(tileRect, radius)) {
+				return;
+			}
+			m_snapshot.Touch(canvas, tileRect);
+			std::vector<unsigned char> & coverage = m_coverage[TileKey(tx, ty)];
+			if (coverage.empty()) {
+				coverage.assign(TileSize * TileSize, 0);
+			}
+			Job job;
+			job.tile = canvas.MutableTile(tx, ty);
+			job.original = m_snapshot.TileAt(canvas, tx, ty);
+			job.coverage = coverage.data();
+			job.tileX = tx * TileSize;
+			job.tileY = ty * TileSize;
+			job.area = part;
+			m_jobs.push_back(job);
+		});
+
+		Pixel background = canvas.Background();
+		m_pool.ParallelFor(m_jobs.size(), [&](size_t i) {
+			RasterizeTile(m_jobs[i], radius, color, background, isErasing);
+		});
+
+		if (isOneShot) {
+			EndStroke();
+		}
+	}
+
+	bool Reaches(const ::Rect & r, float radius) const {
+		float cx = r.x + r.w * 0.5f, cy = r.y + r.h * 0.5f;
+		float reach = radius + 1 + 0.5f * sqrt((float)(r.w * r.w + r.h * r.h));
+		for (const Segment & s : m_segments) {
+			if (s.Distance(cx, cy) <= reach) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+	void RasterizeTile(const Job & job, float radius, Pixel color, Pixel background, bool isErasing) const {
+		const ::Rect & a = job.area;
+		float coverage[TileSize];
+		std::vector<const Segment*> rowSegments;
+		rowSegments.reserve(m_segments.size());
+		float reach = radius + 1;
+
+		for (int y = a.y; y < a.y + a.h; ++y) {
+			float py = y + 0.5f;
+			rowSegments.clear();
+			for (const Segment & s : m_segments) {
+				if (py >= s.minY - reach && py <= s.maxY + reach) {
+					rowSegments.push_back(&s);
+				}
+			}
+			if (rowSegments.empty()) {
+				continue;
+			}
+
+			RowCoverage(rowSegments, a.x, py, a.w, radius, coverage);
+
+			int x0 = a.x - job.tileX;
+			int j = y - job.tileY;
+			Pixel *row = job.tile->MutableRow(j) + x0;
+			const Pixel *originalRow = NULL;
+			if (NULL != job.original && !job.original->IsUniform()) {
+				originalRow = job.original->Row(j) + x0;
+			}
+			Pixel originalColor = NULL != job.original ? job.original->Color() : background;
+			CompositeRow(row, originalRow, originalColor, job.coverage + j * TileSize + x0, coverage, a.w, color, isErasing);
+		}
+	}
+
+	/// Coverage of the n pixels of row py starting at column x0
+	static void RowCoverage(const std::vector<const Segment*> & segments, int x0, float py, int n, float radius, float *coverage) {
+		float edge = radius + 0.5f;
+		int i = 0;
+#ifdef PAINT_HAS_SSE2
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 vedge = _mm_set1_ps(edge);
+		for (; i + 4 <= n; i += 4) {
+			__m128 px = _mm_add_ps(_mm_set1_ps(x0 + i + 0.5f), _mm_set_ps(3, 2, 1, 0));
+			__m128 cov = zero;
+			for (const Segment *s : segments) {
+				__m128 dx = _mm_set1_ps(s->dx), dy = _mm_set1_ps(s->dy);
+				__m128 pax = _mm_sub_ps(px, _mm_set1_ps(s->ax));
+				__m128 pay = _mm_set1_ps(py - s->ay);
+				__m128 t = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(pax, dx), _mm_mul_ps(pay, dy)), _mm_set1_ps(s->invLength2));
+				t = _mm_min_ps(_mm_max_ps(t, zero), one);
+				__m128 ex = _mm_sub_ps(pax, _mm_mul_ps(t, dx));
+				__m128 ey = _mm_sub_ps(pay, _mm_mul_ps(t, dy));
+				__m128 d = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ex, ex), _mm_mul_ps(ey, ey)));
+				__m128 c = _mm_min_ps(_mm_max_ps(_mm_sub_ps(vedge, d), zero), one);
+				cov = _mm_max_ps(cov, c);
+			}
+			_mm_storeu_ps(coverage + i, cov);
+		}
+#endif
+		for (; i < n; ++i) {
+			float px = x0 + i + 0.5f;
+			float cov = 0;
+			for (const Segment *s : segments) {
+				cov = std::max(cov, std::min(std::max(edge - s->Distance(px, py), 0.0f), 1.0f));
+			}
+			coverage[i] = cov;
+		}
+	}
+
+	/**
+	 * Merge coverage into the accumulated stroke coverage, and recomposite
+	 * pixels whose coverage grew from their original value. Fully covered
+	 * runs are filled at once when the color is opaque, or when erasing.
+	 * originalRow is NULL when the original tile is uniform of originalColor.
+	 */
+	static void CompositeRow(Pixel *row, const Pixel *originalRow, Pixel originalColor, unsigned char *accumulated, const float *coverage, int n, Pixel color, bool isErasing) {
+		bool isOpaque = isErasing || PixelA(color) == 255;
+		int i = 0;
+		while (i < n) {
+			if (isOpaque && coverage[i] >= 1.0f) {
+				int j = i;
+				while (j < n && coverage[j] >= 1.0f) {
+					accumulated[j] = 255;
+					++j;
+				}
+				FillPixels(row + i, j - i, color);
+				i = j;
+				continue;
+			}
+			unsigned char c = (unsigned char)(coverage[i] * 255.0f + 0.5f);
+			if (c > accumulated[i]) {
+				accumulated[i] = c;
+				Pixel original = NULL != originalRow ? originalRow[i] : originalColor;
+				row[i] = isErasing ? ErasePixel(original, c * (1.0f / 255.0f)) : BlendPixel(original, color, c * (1.0f / 255.0f));
+			}
+			++i;
+		}
+	}
+
+private:
+	ThreadPool & m_pool;
+	bool m_isInStroke;
+	CanvasSnapshot m_snapshot;
+	std::unordered_map<uint64_t, std::vector<unsigned char> > m_coverage;
+	std::vector<Segment> m_segments;
+	std::vector<Job> m_jobs;
+};
+
+#endif // H_RASTERIZER
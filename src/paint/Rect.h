@@ -0,0 +1,71 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_RECT
+#define H_RECT
+
+#include <algorithm>
+
+struct Rect {
+	int x, y, w, h;
+
+	Rect() : x(0), y(0), w(0), h(0) {}
+	Rect(int _x, int _y, int _w, int _h) : x(_x), y(_y), w(_w), h(_h) {}
+
+	bool Contains(int _x, int _y) const {
+		return _x >= x && _y >= y && _x < x + w && _y < y + h;
+	}
+	/// True if every pixel of other is in the rect, always for empty ones
+	bool Contains(const Rect & other) const {
+		return other.IsEmpty() || (other.x >= x && other.y >= y && other.x + other.w <= x + w && other.y + other.h <= y + h);
+	}
+	bool IsNull() const {
+		return x == 0 && y == 0 && w == 0 && h == 0;
+	}
+	/// True if the rect covers no pixel at all (unlike IsNull(), position is ignored)
+	bool IsEmpty() const {
+		return w <= 0 || h <= 0;
+	}
+
+	bool operator==(const Rect & other) const {
+		return x == other.x && y == other.y && w == other.w && h == other.h;
+	}
+	bool operator!=(const Rect & other) const {
+		return !(*this == other);
+	}
+
+	Rect Intersected(const Rect & other) const {
+		int x0 = std::max(x, other.x);
+		int y0 = std::max(y, other.y);
+		int x1 = std::min(x + w, other.x + other.w);
+		int y1 = std::min(y + h, other.y + other.h);
+		if (x1 <= x0 || y1 <= y0) {
+			return Rect();
+		}
+		return Rect(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	/// Smallest rect containing both, empty rects are ignored
+	Rect United(const Rect & other) const {
+		if (other.IsEmpty()) {
+			return *this;
+		}
+		if (IsEmpty()) {
+			return other;
+		}
+		int x0 = std::min(x, other.x);
+		int y0 = std::min(y, other.y);
+		int x1 = std::max(x + w, other.x + other.w);
+		int y1 = std::max(y + h, other.y + other.h);
+		return Rect(x0, y0, x1 - x0, y1 - y0);
+	}
+
+	/// Rect with margin more pixels on each side
+	Rect Grown(int margin) const {
+		return Rect(x - margin, y - margin, w + 2 * margin, h + 2 * margin);
+	}
+};
+
+#endif // H_RECT
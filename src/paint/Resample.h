@@ -0,0 +1,370 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_RESAMPLE
+#define H_RESAMPLE
+
+#include "Canvas.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <vector>
+
+enum ResampleFilter {
+	NearestFilter,
+	BilinearFilter,
+	BicubicFilter, /// Catmull-Rom
+	Lanczos3Filter,
+};
+
+/**
+ * Scaling of a tiled canvas.
+ *
+ * Filters are separable, so each output tile is computed with a horizontal
+ * pass over the source rows it depends on, then a vertical pass, with
+ * weights computed once per column and per row. Bands of output tiles are
+ * spread over a thread pool, and each goes through its tiles one by one so
+ * that intermediate rows stay small. Colors are filtered premultiplied by
+ * alpha, as four floats per pixel that fit in an SSE register.
+ */
+class Resampler {
+public:
+	explicit Resampler(ThreadPool & pool = ThreadPool::Global())
+		: m_pool(pool)
+		, m_isSimdEnabled(true)
+	{}
+
+	/// Only meant to compare with the scalar code, SIMD is used by default
+	/// when available
+	void SetSimdEnabled(bool enabled) { m_isSimdEnabled = enabled; }
+
+	/// Scale the whole of src into dst, that is reset to w x h
+	void Resize(const TiledCanvas & src, TiledCanvas & dst, int w, int h, ResampleFilter filter) {
+		dst.Reset(w, h, src.Background());
+		if (w <= 0 || h <= 0 || src.Width() <= 0 || src.Height() <= 0) {
+			return;
+		}
+		Weights columns = ComputeWeights(src.Width(), w, filter);
+		Weights rows = ComputeWeights(src.Height(), h, filter);
+
+		// Allocation is not thread safe, so it happens here
+		std::vector<Tile*> tiles(dst.TilesX() * dst.TilesY());
+		for (int ty = 0; ty < dst.TilesY(); ++ty) {
+			for (int tx = 0; tx < dst.TilesX(); ++tx) {
+				tiles[ty * dst.TilesX() + tx] = dst.MutableTile(tx, ty);
+			}
+		}
+
+		bool isSimd = m_isSimdEnabled;
+		m_pool.ParallelFor(dst.TilesY(), [&](size_t ty) {
+			Band band(src, dst, columns, rows, (int)ty);
+			for (int tx = 0; tx < dst.TilesX(); ++tx) {
+				Tile *tile = tiles[ty * dst.TilesX() + tx];
+				if (filter == NearestFilter) {
+					band.Nearest(tx, tile);
+				} else {
+					band.Filter(tx, tile, isSimd);
+				}
+				tile->Collapse();
+			}
+		});
+	}
+
+private:
+	/// Contributions of source pixels to each destination pixel of a line
+	struct Weights {
+		std::vector<int> first; /// First source pixel
+		std::vector<int> count; /// Number of source pixels
+		std::vector<float> weights; /// maxCount per destination pixel
+		int maxCount;
+	};
+
+	/// Output tiles of a row of tiles, with buffers reused from one to the next
+	class Band {
+	public:
+		Band(const TiledCanvas & src, const TiledCanvas & dst, const Weights & columns, const Weights & rows, int ty)
+			: m_src(src)
+			, m_columns(columns)
+			, m_rows(rows)
+		{
+			m_area = dst.TileRect(0, ty);
+			m_area.w = dst.Width();
+			int last = m_area.y + m_area.h - 1;
+			m_srcY0 = rows.first[m_area.y];
+			m_srcY1 = rows.first[m_area.y] + rows.count[m_area.y];
+			for (int y = m_area.y + 1; y <= last; ++y) {
+				m_srcY0 = std::min(m_srcY0, rows.first[y]);
+				m_srcY1 = std::max(m_srcY1, rows.first[y] + rows.count[y]);
+			}
+		}
+
+		void Nearest(int tx, Tile *tile) {
+			int x0 = tx * TileSize;
+			int w = std::min(TileSize, m_area.w - x0);
+			m_row.resize(w);
+			for (int j = 0; j < m_area.h; ++j) {
+				int sy = m_rows.first[m_area.y + j];
+				for (int i = 0; i < w; ++i) {
+					m_row[i] = m_src.PixelAt(m_columns.first[x0 + i], sy);
+				}
+				std::copy(m_row.begin(), m_row.end(), tile->MutableRow(j));
+			}
+		}
+
+		void Filter(int tx, Tile *tile, bool isSimd) {
+			int x0 = tx * TileSize;
+			int w = std::min(TileSize, m_area.w - x0);
+			int srcX0 = m_columns.first[x0];
+			int srcX1 = m_columns.first[x0] + m_columns.count[x0];
+			for (int x = x0 + 1; x < x0 + w; ++x) {
+				srcX0 = std::min(srcX0, m_columns.first[x]);
+				srcX1 = std::max(srcX1, m_columns.first[x] + m_columns.count[x]);
+			}
+			int srcW = srcX1 - srcX0;
+
+			// Horizontal pass, from source rows to w x (m_srcY1 - m_srcY0)
+			m_row.resize(srcW);
+			m_premultiplied.resize(4 * srcW);
+			m_horizontal.resize(4 * TileSize * (m_srcY1 - m_srcY0));
+			for (int sy = m_srcY0; sy < m_srcY1; ++sy) {
+				m_src.ReadRect(::Rect(srcX0, sy, srcW, 1), m_row.data(), srcW);
+				float *out = &m_horizontal[4 * TileSize * (sy - m_srcY0)];
+				if (isSimd) {
+					HorizontalSimd(x0, w, srcX0, out);
+				} else {
+					Horizontal(x0, w, srcX0, out);
+				}
+			}
+
+			// Vertical pass, into the tile
+			for (int j = 0; j < m_area.h; ++j) {
+				int y = m_area.y + j;
+				const float *weights = &m_rows.weights[y * m_rows.maxCount];
+				const float *in = &m_horizontal[4 * TileSize * (m_rows.first[y] - m_srcY0)];
+				Pixel *out = tile->MutableRow(j);
+				if (isSimd) {
+					VerticalSimd(in, weights, m_rows.count[y], w, out);
+				} else {
+					Vertical(in, weights, m_rows.count[y], w, out);
+				}
+			}
+		}
+
+	private:
+		static void Premultiply(Pixel p, float *out) {
+			float a = PixelA(p) * (1.0f / 255.0f);
+			out[0] = PixelR(p) * a;
+			out[1] = PixelG(p) * a;
+			out[2] = PixelB(p) * a;
+			out[3] = PixelA(p);
+		}
+
+		static Pixel Unpremultiply(const float *in) {
+			float a = std::min(std::max(in[3], 0.0f), 255.0f);
+			if (a < 0.5f) {
+				return 0;
+			}
+			float s = 255.0f / a;
+			return MakePixel(
+				(unsigned char)std::min(std::max(in[0] * s + 0.5f, 0.0f), 255.0f),
+				(unsigned char)std::min(std::max(in[1] * s + 0.5f, 0.0f), 255.0f),
+				(unsigned char)std::min(std::max(in[2] * s + 0.5f, 0.0f), 255.0f),
+				(unsigned char)(a + 0.5f)
+			);
+		}
+
+		void Horizontal(int x0, int w, int srcX0, float *out) {
+			for (size_t i = 0; i < m_row.size(); ++i) {
+				Premultiply(m_row[i], &m_premultiplied[4 * i]);
+			}
+			for (int i = 0; i < w; ++i) {
+				int x = x0 + i;
+				const float *weights = &m_columns.weights[x * m_columns.maxCount];
+				const float *in = &m_premultiplied[4 * (m_columns.first[x] - srcX0)];
+				float acc[4] = { 0, 0, 0, 0 };
+				for (int k = 0; k < m_columns.count[x]; ++k) {
+					for (int c = 0; c < 4; ++c) {
+						acc[c] += weights[k] * in[4 * k + c];
+					}
+				}
+				std::copy(acc, acc + 4, out + 4 * i);
+			}
+		}
+
+		static void Vertical(const float *in, const float *weights, int count, int w, Pixel *out) {
+			for (int i = 0; i < w; ++i) {
+				float acc[4] = { 0, 0, 0, 0 };
+				for (int k = 0; k < count; ++k) {
+					for (int c = 0; c < 4; ++c) {
+						acc[c] += weights[k] * in[4 * (k * TileSize + i) + c];
+					}
+				}
+				out[i] = Unpremultiply(acc);
+			}
+		}
+
+#ifdef PAINT_HAS_SSE2
+		void HorizontalSimd(int x0, int w, int srcX0, float *out) {
+			const __m128i zero = _mm_setzero_si128();
+			for (size_t i = 0; i < m_row.size(); ++i) {
+				Pixel p = m_row[i];
+				__m128i v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p), zero), zero);
+				float a = PixelA(p) * (1.0f / 255.0f);
+				_mm_storeu_ps(&m_premultiplied[4 * i], _mm_mul_ps(_mm_cvtepi32_ps(v), _mm_set_ps(1.0f, a, a, a)));
+			}
+			for (int i = 0; i < w; ++i) {
+				int x = x0 + i;
+				const float *weights = &m_columns.weights[x * m_columns.maxCount];
+				const float *in = &m_premultiplied[4 * (m_columns.first[x] - srcX0)];
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < m_columns.count[x]; ++k) {
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(in + 4 * k)));
+				}
+				_mm_storeu_ps(out + 4 * i, acc);
+			}
+		}
+
+		static void VerticalSimd(const float *in, const float *weights, int count, int w, Pixel *out) {
+			const __m128 zero = _mm_setzero_ps();
+			const __m128 max = _mm_set1_ps(255.0f);
+			for (int i = 0; i < w; ++i) {
+				__m128 acc = _mm_setzero_ps();
+				for (int k = 0; k < count; ++k) {
+					acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(in + 4 * (k * TileSize + i))));
+				}
+				acc = _mm_min_ps(_mm_max_ps(acc, zero), max);
+				float a = _mm_cvtss_f32(_mm_shuffle_ps(acc, acc, _MM_SHUFFLE(3, 3, 3, 3)));
+				if (a < 0.5f) {
+					out[i] = 0;
+					continue;
+				}
+				float s = 255.0f / a;
+				__m128 color = _mm_mul_ps(acc, _mm_set_ps(1.0f, s, s, s));
+				// Saturating packs clamp color channels that overshoot
+				__m128i v = _mm_cvtps_epi32(color);
+				v = _mm_packs_epi32(v, v);
+				v = _mm_packus_epi16(v, v);
+				out[i] = (Pixel)_mm_cvtsi128_si32(v);
+			}
+		}
+#else
+		void HorizontalSimd(int x0, int w, int srcX0, float *out) { Horizontal(x0, w, srcX0, out); }
+		static void VerticalSimd(const float *in, const float *weights, int count, int w, Pixel *out) { Vertical(in, weights, count, w, out); }
+#endif
+
+	private:
+		const TiledCanvas & m_src;
+		const Weights & m_columns;
+		const Weights & m_rows;
+		::Rect m_area; /// Destination pixels of the band
+		int m_srcY0, m_srcY1; /// Source rows that the band depends on
+		std::vector<Pixel> m_row;
+		std::vector<float> m_premultiplied;
+		std::vector<float> m_horizontal;
+	};
+
+private:
+	static float Radius(ResampleFilter filter) {
+		switch (filter) {
+		case BilinearFilter: return 1.0f;
+		case BicubicFilter: return 2.0f;
+		case Lanczos3Filter: return 3.0f;
+		default: return 0.5f;
+		}
+	}
+
+	static float Kernel(ResampleFilter filter, float x) {
+		x = fabs(x);
+		switch (filter) {
+		case BilinearFilter:
+			return std::max(1.0f - x, 0.0f);
+		case BicubicFilter: {
+			const float a = -0.5f;
+			if (x < 1.0f) {
+				return ((a + 2.0f) * x - (a + 3.0f)) * x * x + 1.0f;
+			}
+			if (x < 2.0f) {
+				return ((a * x - 5.0f * a) * x + 8.0f * a) * x - 4.0f * a;
+			}
+			return 0.0f;
+		}
+		case Lanczos3Filter: {
+			if (x < 1e-6f) {
+				return 1.0f;
+			}
+			if (x >= 3.0f) {
+				return 0.0f;
+			}
+			const float pi = 3.14159265358979f;
+			return 3.0f * sin(pi * x) * sin(pi * x / 3.0f) / (pi * pi * x * x);
+		}
+		default:
+			return x <= 0.5f ? 1.0f : 0.0f;
+		}
+	}
+
+	/**
+	 * Weights to go from srcSize to dstSize pixels. The filter is stretched
+	 * when shrinking, so that all source pixels contribute, and source
+	 * pixels beyond the edges are clamped to the edges.
+	 * Nearest only gives the source pixel, in first.
+	 */
+	static Weights ComputeWeights(int srcSize, int dstSize, ResampleFilter filter) {
+		Weights w;
+		float scale = (float)dstSize / srcSize;
+		w.first.resize(dstSize);
+		w.count.resize(dstSize);
+		if (filter == NearestFilter) {
+			for (int i = 0; i < dstSize; ++i) {
+				w.first[i] = std::min((int)((i + 0.5f) / scale), srcSize - 1);
+				w.count[i] = 1;
+			}
+			w.maxCount = 1;
+			w.weights.assign(dstSize, 1.0f);
+			return w;
+		}
+
+		float filterScale = std::max(1.0f, 1.0f / scale);
+		float support = Radius(filter) * filterScale;
+		w.maxCount = std::min((int)ceil(2 * support) + 2, srcSize);
+		w.weights.assign(dstSize * w.maxCount, 0.0f);
+		std::vector<float> contributions;
+		for (int i = 0; i < dstSize; ++i) {
+			float center = (i + 0.5f) / scale;
+			int j0 = (int)floor(center - support);
+			int j1 = (int)ceil(center + support);
+			int first = std::min(std::max(j0, 0), srcSize - 1);
+			int last = std::min(std::max(j1 - 1, 0), srcSize - 1);
+			contributions.assign(last - first + 1, 0.0f);
+			float sum = 0;
+			for (int j = j0; j < j1; ++j) {
+				float weight = Kernel(filter, (j + 0.5f - center) / filterScale);
+				contributions[std::min(std::max(j, first), last) - first] += weight;
+				sum += weight;
+			}
+			// Zero weights at both ends would only cost time
+			int begin = 0, end = (int)contributions.size();
+			while (begin < end - 1 && contributions[begin] == 0.0f) {
+				++begin;
+			}
+			while (end > begin + 1 && contributions[end - 1] == 0.0f) {
+				--end;
+			}
+			w.first[i] = first + begin;
+			w.count[i] = std::min(end - begin, w.maxCount);
+			float invSum = sum != 0.0f ? 1.0f / sum : 0.0f;
+			for (int k = 0; k < w.count[i]; ++k) {
+				w.weights[i * w.maxCount + k] = contributions[begin + k] * invSum;
+			}
+		}
+		return w;
+	}
+
+private:
+	ThreadPool & m_pool;
+	bool m_isSimdEnabled;
+};
+
+#endif // H_RESAMPLE
@@ -0,0 +1,428 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_SELECTION
+#define H_SELECTION
+
+#include "Rect.h"
+#include "Rasterizer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+/// Pixels [x0, x1[ of a row
+struct SelectionSpan {
+	int x0, x1;
+};
+
+enum SelectionOp {
+	UnionSelectionOp,
+	SubtractSelectionOp,
+	IntersectSelectionOp,
+	XorSelectionOp,
+};
+
+/**
+ * Set of pixels, stored as run length encoded rows. Consecutive rows that
+ * have the same spans are grouped in a single band, so a rectangle costs a
+ * single band of a single span whatever its size.
+ * An empty selection means that nothing is selected.
+ */
+class Selection {
+public:
+	static Selection FromRect(const ::Rect & r) {
+		Selection selection;
+		if (!r.IsEmpty()) {
+			SelectionSpan span = { r.x, r.x + r.w };
+			selection.AddBand(r.y, r.y + r.h, &span, 1);
+		}
+		return selection;
+	}
+
+	/// Pixels whose center lies inside the polygon, with the even-odd rule
+	static Selection FromPolygon(const std::vector<StrokePoint> & points) {
+		Selection selection;
+		if (points.size() < 3) {
+			return selection;
+		}
+		struct Edge {
+			float x0, y0, x1, y1;
+		};
+		std::vector<Edge> edges;
+		float minY = points[0].y, maxY = points[0].y;
+		for (size_t i = 0; i < points.size(); ++i) {
+			const StrokePoint & a = points[i];
+			const StrokePoint & b = points[(i + 1) % points.size()];
+			minY = std::min(minY, a.y);
+			maxY = std::max(maxY, a.y);
+			if (a.y == b.y) {
+				continue;
+			}
+			Edge e = { a.x, a.y, b.x, b.y };
+			if (e.y0 > e.y1) {
+				std::swap(e.x0, e.x1);
+				std::swap(e.y0, e.y1);
+			}
+			edges.push_back(e);
+		}
+		std::sort(edges.begin(), edges.end(), [](const Edge & a, const Edge & b) { return a.y0 < b.y0; });
+
+		// Edges crossing the current row, taken in order of their top
+		std::vector<const Edge*> active;
+		std::vector<float> crossings;
+		std::vector<SelectionSpan> row;
+		size_t nextEdge = 0;
+		for (int y = (int)floor(minY); y <= (int)ceil(maxY); ++y) {
+			float py = y + 0.5f;
+			while (nextEdge < edges.size() && edges[nextEdge].y0 <= py) {
+				active.push_back(&edges[nextEdge++]);
+			}
+			crossings.clear();
+			size_t kept = 0;
+			for (const Edge *e : active) {
+				if (e->y1 <= py) {
+					continue;
+				}
+				active[kept++] = e;
+				if (e->y0 <= py) {
+					crossings.push_back(e->x0 + (py - e->y0) * (e->x1 - e->x0) / (e->y1 - e->y0));
+				}
+			}
+			active.resize(kept);
+			std::sort(crossings.begin(), crossings.end());
+			row.clear();
+			for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+				SelectionSpan span = { (int)ceil(crossings[i] - 0.5f), (int)ceil(crossings[i + 1] - 0.5f) };
+				if (span.x1 <= span.x0) {
+					continue;
+				}
+				if (!row.empty() && row.back().x1 == span.x0) {
+					row.back().x1 = span.x1;
+				} else {
+					row.push_back(span);
+				}
+			}
+			selection.AddBand(y, y + 1, row.data(), row.size());
+		}
+		return selection;
+	}
+
+	bool IsEmpty() const { return m_bands.empty(); }
+
+	/// Smallest rect containing the selection
+	::Rect Bounds() const {
+		if (IsEmpty()) {
+			return ::Rect();
+		}
+		int x0 = INT_MAX, x1 = INT_MIN;
+		for (const Band & band : m_bands) {
+			x0 = std::min(x0, m_spans[band.first].x0);
+			x1 = std::max(x1, m_spans[band.first + band.count - 1].x1);
+		}
+		return ::Rect(x0, m_bands.front().y0, x1 - x0, m_bands.back().y1 - m_bands.front().y0);
+	}
+
+	bool Contains(int x, int y) const {
+		const Band *band = BandAt(y);
+		if (NULL == band) {
+			return false;
+		}
+		const SelectionSpan *span = SpanAt(*band, x);
+		return NULL != span && span->x0 <= x;
+	}
+
+	/// True if all pixels of r are selected
+	bool Contains(const ::Rect & r) const {
+		bool isInside = true;
+		ForEachBand(r, [&](int, int, const SelectionSpan *spans, size_t count) {
+			const SelectionSpan *span = std::lower_bound(spans, spans + count, r.x + 1, [](const SelectionSpan & s, int x) { return s.x1 < x; });
+			if (span == spans + count || span->x0 > r.x || span->x1 < r.x + r.w) {
+				isInside = false;
+			}
+		});
+		return isInside;
+	}
+
+	/// Memory used by the selection, in bytes
+	size_t ByteSize() const {
+		return sizeof(Selection) + m_bands.capacity() * sizeof(Band) + m_spans.capacity() * sizeof(SelectionSpan);
+	}
+
+	size_t BandCount() const { return m_bands.size(); }
+
+	Selection Combined(const Selection & other, SelectionOp op) const {
+		Selection result;
+		std::vector<SelectionSpan> spans;
+		size_t i = 0, j = 0;
+		int y = INT_MIN;
+		while (i < m_bands.size() || j < other.m_bands.size()) {
+			int nextA = i < m_bands.size() ? m_bands[i].y0 : INT_MAX;
+			int nextB = j < other.m_bands.size() ? other.m_bands[j].y0 : INT_MAX;
+			// Skip rows where neither has anything
+			y = std::max(y, std::min(nextA, nextB));
+			bool inA = nextA <= y, inB = nextB <= y;
+			int y1 = std::min(inA ? m_bands[i].y1 : nextA, inB ? other.m_bands[j].y1 : nextB);
+
+			const SelectionSpan *a = inA ? &m_spans[m_bands[i].first] : NULL;
+			const SelectionSpan *b = inB ? &other.m_spans[other.m_bands[j].first] : NULL;
+			CombineSpans(a, inA ? m_bands[i].count : 0, b, inB ? other.m_bands[j].count : 0, op, spans);
+			result.AddBand(y, y1, spans.data(), spans.size());
+
+			if (inA && m_bands[i].y1 == y1) {
+				++i;
+			}
+			if (inB && other.m_bands[j].y1 == y1) {
+				++j;
+			}
+			y = y1;
+		}
+		return result;
+	}
+
+	Selection United(const Selection & other) const { return Combined(other, UnionSelectionOp); }
+	Selection Subtracted(const Selection & other) const { return Combined(other, SubtractSelectionOp); }
+	Selection Intersected(const Selection & other) const { return Combined(other, IntersectSelectionOp); }
+
+	Selection Translated(int dx, int dy) const {
+		Selection selection = *this;
+		for (Band & band : selection.m_bands) {
+			band.y0 += dy;
+			band.y1 += dy;
+		}
+		for (SelectionSpan & span : selection.m_spans) {
+			span.x0 += dx;
+			span.x1 += dx;
+		}
+		return selection;
+	}
+
+	/**
+	 * Call f(y0, y1, spans, count) for consecutive groups of rows [y0, y1[
+	 * that cover the rows of r, where spans are the count selected spans of
+	 * these rows. Spans are not clipped to r, and count is 0 for rows that
+	 * have nothing selected.
+	 */
+	template <typename F>
+	void ForEachBand(const ::Rect & r, F f) const {
+		if (r.IsEmpty()) {
+			return;
+		}
+		int y = r.y;
+		int yEnd = r.y + r.h;
+		auto it = std::upper_bound(m_bands.begin(), m_bands.end(), y, [](int y, const Band & band) { return y < band.y1; });
+		for (; y < yEnd && it != m_bands.end(); ++it) {
+			if (it->y0 > y) {
+				int y1 = std::min(it->y0, yEnd);
+				f(y, y1, (const SelectionSpan*)NULL, (size_t)0);
+				y = y1;
+				if (y >= yEnd) {
+					break;
+				}
+			}
+			int y1 = std::min(it->y1, yEnd);
+			f(y, y1, &m_spans[it->first], it->count);
+			y = y1;
+		}
+		if (y < yEnd) {
+			f(y, yEnd, (const SelectionSpan*)NULL, (size_t)0);
+		}
+	}
+
+	/// Call f(part) for rects that together cover the selected pixels of r
+	template <typename F>
+	void ForEachRectInside(const ::Rect & r, F f) const {
+		ForEachBand(r, [&](int y0, int y1, const SelectionSpan *spans, size_t count) {
+			for (size_t i = 0; i < count; ++i) {
+				int x0 = std::max(spans[i].x0, r.x), x1 = std::min(spans[i].x1, r.x + r.w);
+				if (x0 < x1) {
+					f(::Rect(x0, y0, x1 - x0, y1 - y0));
+				}
+			}
+		});
+	}
+
+	/// Call f(part) for rects that together cover the pixels of r that are
+	/// not selected
+	template <typename F>
+	void ForEachRectOutside(const ::Rect & r, F f) const {
+		ForEachBand(r, [&](int y0, int y1, const SelectionSpan *spans, size_t count) {
+			int x = r.x;
+			for (size_t i = 0; i < count && x < r.x + r.w; ++i) {
+				int x1 = std::min(spans[i].x0, r.x + r.w);
+				if (x < x1) {
+					f(::Rect(x, y0, x1 - x, y1 - y0));
+				}
+				x = std::max(x, spans[i].x1);
+			}
+			if (x < r.x + r.w) {
+				f(::Rect(x, y0, r.x + r.w - x, y1 - y0));
+			}
+		});
+	}
+
+	/**
+	 * Call f(x0, y0, x1, y1) for the horizontal and vertical segments that
+	 * make the outline of the selection, in pixel corner coordinates.
+	 */
+	template <typename F>
+	void ForEachEdge(F f) const {
+		std::vector<SelectionSpan> changes;
+		for (size_t i = 0; i < m_bands.size(); ++i) {
+			const Band & band = m_bands[i];
+			const SelectionSpan *spans = &m_spans[band.first];
+			for (size_t k = 0; k < band.count; ++k) {
+				f(spans[k].x0, band.y0, spans[k].x0, band.y1);
+				f(spans[k].x1, band.y0, spans[k].x1, band.y1);
+			}
+			// Top edges are where this band differs from the previous one
+			bool isTouching = i > 0 && m_bands[i - 1].y1 == band.y0;
+			const SelectionSpan *previous = isTouching ? &m_spans[m_bands[i - 1].first] : NULL;
+			CombineSpans(spans, band.count, previous, isTouching ? m_bands[i - 1].count : 0, XorSelectionOp, changes);
+			for (const SelectionSpan & s : changes) {
+				f(s.x0, band.y0, s.x1, band.y0);
+			}
+			bool isLast = i + 1 == m_bands.size() || m_bands[i + 1].y0 != band.y1;
+			if (isLast) {
+				for (size_t k = 0; k < band.count; ++k) {
+					f(spans[k].x0, band.y1, spans[k].x1, band.y1);
+				}
+			}
+		}
+	}
+
+private:
+	/// Rows [y0, y1[, whose spans are m_spans[first .. first + count[
+	struct Band {
+		int y0, y1;
+		size_t first, count;
+	};
+
+private:
+	/// Append rows [y0, y1[ below the existing bands, merging them with the
+	/// last band when they have the same spans
+	void AddBand(int y0, int y1, const SelectionSpan *spans, size_t count) {
+		if (count == 0 || y1 <= y0) {
+			return;
+		}
+		if (!m_bands.empty()) {
+			Band & last = m_bands.back();
+			if (last.y1 == y0 && last.count == count && std::equal(spans, spans + count, m_spans.begin() + last.first, [](const SelectionSpan & a, const SelectionSpan & b) { return a.x0 == b.x0 && a.x1 == b.x1; })) {
+				last.y1 = y1;
+				return;
+			}
+		}
+		Band band = { y0, y1, m_spans.size(), count };
+		m_bands.push_back(band);
+		m_spans.insert(m_spans.end(), spans, spans + count);
+	}
+
+	/// Band containing row y, if any
+	const Band *BandAt(int y) const {
+		auto it = std::upper_bound(m_bands.begin(), m_bands.end(), y, [](int y, const Band & band) { return y < band.y1; });
+		return it == m_bands.end() || it->y0 > y ? NULL : &*it;
+	}
+
+	/// First span of band that ends after x, if any
+	const SelectionSpan *SpanAt(const Band & band, int x) const {
+		const SelectionSpan *begin = &m_spans[band.first];
+		const SelectionSpan *end = begin + band.count;
+		const SelectionSpan *span = std::upper_bound(begin, end, x, [](int x, const SelectionSpan & s) { return x < s.x1; });
+		return span == end ? NULL : span;
+	}
+
+	/// Spans of a row that are in a and/or b according to op, in out
+	static void CombineSpans(const SelectionSpan *a, size_t countA, const SelectionSpan *b, size_t countB, SelectionOp op, std::vector<SelectionSpan> & out) {
+		out.clear();
+		// Boundaries of a and b are walked in order, even ones being starts
+		size_t i = 0, j = 0;
+		bool wasIn = false;
+		int start = 0;
+		while (i < 2 * countA || j < 2 * countB) {
+			int xa = i < 2 * countA ? (i % 2 == 0 ? a[i / 2].x0 : a[i / 2].x1) : INT_MAX;
+			int xb = j < 2 * countB ? (j % 2 == 0 ? b[j / 2].x0 : b[j / 2].x1) : INT_MAX;
+			int x = std::min(xa, xb);
+			if (xa == x) {
+				++i;
+			}
+			if (xb == x) {
+				++j;
+			}
+			bool inA = i % 2 == 1, inB = j % 2 == 1;
+			bool isIn;
+			switch (op) {
+			case UnionSelectionOp:
+				isIn = inA || inB;
+				break;
+			case SubtractSelectionOp:
+				isIn = inA && !inB;
+				break;
+			case IntersectSelectionOp:
+				isIn = inA && inB;
+				break;
+			default:
+				isIn = inA != inB;
+				break;
+			}
+			if (isIn && !wasIn) {
+				start = x;
+			} else if (!isIn && wasIn) {
+				SelectionSpan span = { start, x };
+				out.push_back(span);
+			}
+			wasIn = isIn;
+		}
+	}
+
+private:
+	std::vector<Band> m_bands;
+	std::vector<SelectionSpan> m_spans;
+
+	friend class SelectionBuilder;
+};
+
+/**
+ * Build a selection from runs of pixels given top to bottom, and left
+ * to right within a row. Runs of a row may touch or overlap.
+ */
+class SelectionBuilder {
+public:
+	SelectionBuilder() : m_y(0) {}
+
+	void AddRun(int y, int x0, int x1) {
+		if (x1 <= x0) {
+			return;
+		}
+		if (!m_row.empty() && y != m_y) {
+			m_selection.AddBand(m_y, m_y + 1, m_row.data(), m_row.size());
+			m_row.clear();
+		}
+		m_y = y;
+		if (!m_row.empty() && m_row.back().x1 >= x0) {
+			m_row.back().x1 = std::max(m_row.back().x1, x1);
+		} else {
+			SelectionSpan span = { x0, x1 };
+			m_row.push_back(span);
+		}
+	}
+
+	Selection Finish() {
+		if (!m_row.empty()) {
+			m_selection.AddBand(m_y, m_y + 1, m_row.data(), m_row.size());
+			m_row.clear();
+		}
+		Selection selection;
+		std::swap(selection, m_selection);
+		return selection;
+	}
+
+private:
+	Selection m_selection;
+	std::vector<SelectionSpan> m_row;
+	int m_y;
+};
+
+#endif // H_SELECTION
@@ -0,0 +1,245 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_SHAPE
+#define H_SHAPE
+
+#include "Canvas.h"
+#include "Rasterizer.h"
+
+#include <cmath>
+#include <vector>
+
+enum ShapeKind {
+	LineShape,
+	RectangleShape,
+	EllipseShape,
+	PolygonShape,
+	ArrowShape, /// Block arrow pointing right, within the dragged box
+};
+
+struct ShapeStyle {
+	float width; /// Of the outline
+	bool isOutlined;
+	bool isFilled; /// Lines never are
+	Pixel outlineColor;
+	Pixel fillColor;
+};
+
+/**
+ * Shape of the shape tools, kept as control points while it is being drawn
+ * so that it can still change, and only turned into pixels by Render().
+ * All shapes but polygons are defined by the two corners of a dragged box,
+ * polygons by their vertices.
+ */
+class Shape {
+public:
+	Shape()
+		: m_kind(LineShape)
+	{
+		m_style.width = 1;
+		m_style.isOutlined = true;
+		m_style.isFilled = false;
+		m_style.outlineColor = MakePixel(0, 0, 0);
+		m_style.fillColor = MakePixel(255, 255, 255);
+	}
+
+	/// Start over, from a single point
+	void Reset(ShapeKind kind, const ShapeStyle & style, const StrokePoint & start) {
+		m_kind = kind;
+		m_style = style;
+		m_points.assign(2, start);
+	}
+
+	ShapeKind Kind() const { return m_kind; }
+	const std::vector<StrokePoint> & Points() const { return m_points; }
+
+	/// Drag the last control point
+	void MoveLastPoint(const StrokePoint & point) {
+		m_points.back() = point;
+	}
+
+	/// Add a vertex to a polygon
+	void AddPoint(const StrokePoint & point) {
+		m_points.push_back(point);
+	}
+
+	bool IsClosed() const {
+		return m_kind != LineShape && (m_kind != PolygonShape || m_points.size() > 2);
+	}
+
+	/// Outline as a polyline, that goes back to its start for closed shapes
+	void Path(std::vector<StrokePoint> & path) const {
+		path.clear();
+		const StrokePoint & a = m_points.front();
+		const StrokePoint & b = m_points.back();
+		float x0 = std::min(a.x, b.x), x1 = std::max(a.x, b.x);
+		float y0 = std::min(a.y, b.y), y1 = std::max(a.y, b.y);
+		switch (m_kind) {
+		case LineShape:
+			path.push_back(a);
+			path.push_back(b);
+			return;
+		case RectangleShape:
+			path.push_back(Point(x0, y0));
+			path.push_back(Point(x1, y0));
+			path.push_back(Point(x1, y1));
+			path.push_back(Point(x0, y1));
+			break;
+		case EllipseShape: {
+			float rx = (x1 - x0) / 2, ry = (y1 - y0) / 2;
+			float cx = x0 + rx, cy = y0 + ry;
+			// Segments of about 2 px
+			const float pi = 3.14159265358979f;
+			int count = std::min(std::max((int)(pi * (rx + ry) / 2), 16), 2048);
+			for (int i = 0; i < count; ++i) {
+				float angle = 2 * pi * i / count;
+				path.push_back(Point(cx + rx * cos(angle), cy + ry * sin(angle)));
+			}
+			break;
+		}
+		case PolygonShape:
+			path = m_points;
+			break;
+		case ArrowShape: {
+			float h = y1 - y0, cy = (y0 + y1) / 2;
+			float head = std::max(x1 - h / 2, x0 + (x1 - x0) / 2);
+			path.push_back(Point(x0, y0 + h / 4));
+			path.push_back(Point(head, y0 + h / 4));
+			path.push_back(Point(head, y0));
+			path.push_back(Point(x1, cy));
+			path.push_back(Point(head, y1));
+			path.push_back(Point(head, y1 - h / 4));
+			path.push_back(Point(x0, y1 - h / 4));
+			break;
+		}
+		}
+		if (IsClosed()) {
+			path.push_back(path.front());
+		}
+	}
+
+	/// Pixels that Render() may change
+	::Rect Bounds() const {
+		std::vector<StrokePoint> path;
+		Path(path);
+		float margin = (m_style.isOutlined || !IsClosed() ? m_style.width / 2 : 0) + 1;
+		float minX = path[0].x, maxX = path[0].x, minY = path[0].y, maxY = path[0].y;
+		for (const StrokePoint & p : path) {
+			minX = std::min(minX, p.x); maxX = std::max(maxX, p.x);
+			minY = std::min(minY, p.y); maxY = std::max(maxY, p.y);
+		}
+		int x0 = (int)floor(minX - margin), y0 = (int)floor(minY - margin);
+		return ::Rect(x0, y0, (int)ceil(maxX + margin) - x0, (int)ceil(maxY + margin) - y0);
+	}
+
+	/// Draw into canvas, the fill going under the outline
+	void Render(TiledCanvas & canvas, StrokeRasterizer & rasterizer) const {
+		std::vector<StrokePoint> path;
+		Path(path);
+		if (m_style.isFilled && IsClosed()) {
+			FillPolygon(canvas, path, m_style.fillColor);
+		}
+		if (m_style.isOutlined || !IsClosed()) {
+			std::vector<StrokeSegment> segments(path.size() - 1);
+			for (size_t i = 0; i + 1 < path.size(); ++i) {
+				StrokeSegment s = { path[i].x, path[i].y, path[i + 1].x, path[i + 1].y };
+				segments[i] = s;
+			}
+			rasterizer.Stroke(canvas, segments, m_style.width, m_style.outlineColor);
+		}
+	}
+
+private:
+	static StrokePoint Point(float x, float y) {
+		StrokePoint p = { x, y };
+		return p;
+	}
+
+	/**
+	 * Blend color over the inside of polygon, with the even-odd rule.
+	 * Coverage is exact horizontally and sampled on a few lines per row.
+	 */
+	static void FillPolygon(TiledCanvas & canvas, const std::vector<StrokePoint> & polygon, Pixel color) {
+		const int subRows = 4;
+		float minX = polygon[0].x, maxX = polygon[0].x, minY = polygon[0].y, maxY = polygon[0].y;
+		for (const StrokePoint & p : polygon) {
+			minX = std::min(minX, p.x); maxX = std::max(maxX, p.x);
+			minY = std::min(minY, p.y); maxY = std::max(maxY, p.y);
+		}
+		::Rect area = ::Rect((int)floor(minX), (int)floor(minY), (int)ceil(maxX) - (int)floor(minX) + 1, (int)ceil(maxY) - (int)floor(minY) + 1)
+			.Intersected(::Rect(0, 0, canvas.Width(), canvas.Height()));
+		if (area.IsEmpty()) {
+			return;
+		}
+
+		std::vector<float> coverage(area.w);
+		std::vector<float> crossings;
+		for (int y = area.y; y < area.y + area.h; ++y) {
+			std::fill(coverage.begin(), coverage.end(), 0.0f);
+			for (int s = 0; s < subRows; ++s) {
+				float sy = y + (s + 0.5f) / subRows;
+				crossings.clear();
+				for (size_t i = 0; i + 1 < polygon.size(); ++i) {
+					const StrokePoint & a = polygon[i];
+					const StrokePoint & b = polygon[i + 1];
+					if ((a.y <= sy) != (b.y <= sy)) {
+						crossings.push_back(a.x + (sy - a.y) * (b.x - a.x) / (b.y - a.y));
+					}
+				}
+				std::sort(crossings.begin(), crossings.end());
+				for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+					AddSpan(coverage, crossings[i] - area.x, crossings[i + 1] - area.x, 1.0f / subRows);
+				}
+			}
+
+			canvas.ForEachTile(::Rect(area.x, y, area.w, 1), [&](int tx, int ty, const ::Rect & part) {
+				const float *rowCoverage = &coverage[part.x - area.x];
+				bool isCovered = false;
+				for (int i = 0; i < part.w && !isCovered; ++i) {
+					isCovered = rowCoverage[i] > 0;
+				}
+				if (!isCovered) {
+					return;
+				}
+				Pixel *row = canvas.MutableTile(tx, ty)->MutableRow(y - ty * TileSize) + part.x - tx * TileSize;
+				for (int i = 0; i < part.w; ++i) {
+					if (rowCoverage[i] > 0) {
+						row[i] = BlendPixel(row[i], color, std::min(rowCoverage[i], 1.0f));
+					}
+				}
+			});
+		}
+	}
+
+	/// Add weight times the part of each pixel that [x0, x1[ covers
+	static void AddSpan(std::vector<float> & coverage, float x0, float x1, float weight) {
+		int n = (int)coverage.size();
+		x0 = std::max(x0, 0.0f);
+		x1 = std::min(x1, (float)n);
+		if (x1 <= x0) {
+			return;
+		}
+		int i0 = (int)x0, i1 = (int)x1;
+		if (i0 == i1) {
+			coverage[i0] += (x1 - x0) * weight;
+			return;
+		}
+		coverage[i0] += (i0 + 1 - x0) * weight;
+		for (int i = i0 + 1; i < i1; ++i) {
+			coverage[i] += weight;
+		}
+		if (i1 < n) {
+			coverage[i1] += (x1 - i1) * weight;
+		}
+	}
+
+private:
+	ShapeKind m_kind;
+	ShapeStyle m_style;
+	std::vector<StrokePoint> m_points;
+};
+
+#endif // H_SHAPE
@@ -0,0 +1,84 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+// Kept out of main.cpp, so that windows.h macros do not leak into it
+
+#include "SystemClipboard.h"
+
+#ifdef _WIN32
+
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <GLFW/glfw3.h>
+#define GLFW_EXPOSE_NATIVE_WIN32
+#include <GLFW/glfw3native.h>
+
+#include <cstring>
+
+static WNDPROC previousWindowProc = NULL;
+static DibEncoder encoder;
+
+static void RenderDib() {
+	if (!encoder) {
+		return;
+	}
+	const std::vector<unsigned char> & dib = encoder();
+	HGLOBAL data = GlobalAlloc(GMEM_MOVEABLE, dib.size());
+	if (NULL == data) {
+		return;
+	}
+	memcpy(GlobalLock(data), dib.data(), dib.size());
+	GlobalUnlock(data);
+	if (NULL == SetClipboardData(CF_DIB, data)) {
+		GlobalFree(data);
+	}
+}
+
+/// Windows asks for the data only once someone pastes it
+static LRESULT CALLBACK ClipboardWindowProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
+	switch (message) {
+	case WM_RENDERFORMAT:
+		if (wParam == CF_DIB) {
+			RenderDib();
+		}
+		return 0;
+	case WM_RENDERALLFORMATS:
+		// About to quit, the data must be there for good
+		if (OpenClipboard(hwnd)) {
+			if (GetClipboardOwner() == hwnd) {
+				RenderDib();
+			}
+			CloseClipboard();
+		}
+		return 0;
+	case WM_DESTROYCLIPBOARD:
+		encoder = DibEncoder();
+		break;
+	}
+	return CallWindowProc(previousWindowProc, hwnd, message, wParam, lParam);
+}
+
+void OfferSystemClipboardImage(GLFWwindow *window, const DibEncoder & encode) {
+	HWND hwnd = glfwGetWin32Window(window);
+	if (NULL == previousWindowProc) {
+		previousWindowProc = (WNDPROC)SetWindowLongPtr(hwnd, GWLP_WNDPROC, (LONG_PTR)ClipboardWindowProc);
+	}
+	if (!OpenClipboard(hwnd)) {
+		return;
+	}
+	EmptyClipboard();
+	encoder = encode;
+	// NULL data means that it gets rendered on demand
+	SetClipboardData(CF_DIB, NULL);
+	CloseClipboard();
+}
+
+#else // _WIN32
+
+void OfferSystemClipboardImage(GLFWwindow *, const DibEncoder &) {
+}
+
+#endif // _WIN32
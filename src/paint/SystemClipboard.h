@@ -0,0 +1,25 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_SYSTEM_CLIPBOARD
+#define H_SYSTEM_CLIPBOARD
+
+#include <functional>
+#include <vector>
+
+struct GLFWwindow;
+
+/// Called when another application pastes, must return a CF_DIB bitmap
+typedef std::function<const std::vector<unsigned char> & ()> DibEncoder;
+
+/**
+ * Offer an image to other applications through the system clipboard. It
+ * only gets encoded if one of them actually pastes it.
+ * GLFW only exchanges text, so this is only implemented on Windows, with
+ * delayed rendering, and does nothing elsewhere.
+ */
+void OfferSystemClipboardImage(GLFWwindow *window, const DibEncoder & encode);
+
+#endif // H_SYSTEM_CLIPBOARD
@@ -0,0 +1,280 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_TEXT
+#define H_TEXT
+
+#include "Canvas.h"
+#include "Font.h"
+
+#include <cmath>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Rasterized glyphs, packed in rows of fixed size pages of coverage. A
+ * glyph is drawn once for each font, size and quarter of pixel of
+ * horizontal offset, after which drawing it again is only a copy.
+ * Everything is dropped when the pages reach their budget.
+ */
+class GlyphAtlas {
+public:
+	/// Horizontal positions are rounded to 1 / SubpixelSteps pixel
+	static const int SubpixelSteps = 4;
+	static const int PageSize = 512;
+
+	struct Entry {
+		int page;
+		int x, y; /// In the page
+		int width, height;
+		int left, top; /// Offset from the pen, as in GlyphBitmap
+	};
+
+	GlyphAtlas()
+		: m_maxPageCount(8)
+		, m_shelfX(0)
+		, m_shelfY(0)
+		, m_shelfHeight(0)
+		, m_hitCount(0)
+		, m_missCount(0)
+	{}
+
+	void SetMaxPageCount(int count) { m_maxPageCount = std::max(1, count); }
+
+	/// Lookups served from the cache, and glyphs that had to be drawn
+	size_t HitCount() const { return m_hitCount; }
+	size_t MissCount() const { return m_missCount; }
+
+	const unsigned char *Page(int page) const { return m_pages[page].data(); }
+
+	/// Glyph at size with the given subpixel step, drawn if not cached yet
+	const Entry & Find(const Font & font, int glyph, float size, int subpixel) {
+		uint64_t key = Key(font.Id(), glyph, size, subpixel);
+		auto it = m_entries.find(key);
+		if (it != m_entries.end()) {
+			++m_hitCount;
+			return it->second;
+		}
+		++m_missCount;
+
+		font.Rasterize(glyph, size, (float)subpixel / SubpixelSteps, m_bitmap);
+		Entry entry;
+		entry.width = std::min(m_bitmap.width, (int)PageSize);
+		entry.height = std::min(m_bitmap.height, (int)PageSize);
+		entry.left = m_bitmap.left;
+		entry.top = m_bitmap.top;
+		Allocate(entry);
+		unsigned char *page = m_pages[entry.page].data();
+		for (int j = 0; j < entry.height; ++j) {
+			const unsigned char *row = m_bitmap.coverage.data() + j * m_bitmap.width;
+			std::copy(row, row + entry.width, page + (entry.y + j) * PageSize + entry.x);
+		}
+		return m_entries[key] = entry;
+	}
+
+	void Clear() {
+		m_entries.clear();
+		m_pages.clear();
+		m_shelfX = m_shelfY = m_shelfHeight = 0;
+	}
+
+private:
+	static uint64_t Key(int font, int glyph, float size, int subpixel) {
+		uint64_t quarterSize = (uint64_t)std::max(0, (int)(size * 4 + 0.5f)) & 0xffff;
+		return ((uint64_t)(font & 0xffff) << 48) | (quarterSize << 32)
+			| ((uint64_t)(subpixel & 0xff) << 24) | ((uint64_t)glyph & 0xffffff);
+	}
+
+	/// Find room for entry, in the last shelf or in a new one
+	void Allocate(Entry & entry) {
+		if (m_pages.empty() || m_shelfX + entry.width > PageSize) {
+			m_shelfY += m_shelfHeight;
+			m_shelfX = 0;
+			m_shelfHeight = 0;
+		}
+		if (m_pages.empty() || m_shelfY + entry.height > PageSize) {
+			if ((int)m_pages.size() >= m_maxPageCount) {
+				Clear();
+			}
+			m_pages.push_back(std::vector<unsigned char>(PageSize * PageSize, 0));
+			m_shelfX = m_shelfY = m_shelfHeight = 0;
+		}
+		entry.page = (int)m_pages.size() - 1;
+		entry.x = m_shelfX;
+		entry.y = m_shelfY;
+		m_shelfX += entry.width;
+		m_shelfHeight = std::max(m_shelfHeight, entry.height);
+	}
+
+private:
+	int m_maxPageCount;
+	std::vector<std::vector<unsigned char>> m_pages;
+	std::unordered_map<uint64_t, Entry> m_entries;
+	int m_shelfX, m_shelfY, m_shelfHeight; /// Free space of the last page
+	GlyphBitmap m_bitmap;
+	size_t m_hitCount, m_missCount;
+};
+
+/**
+ * Text being typed, that is still editable. It is laid out from its top
+ * left corner, with explicit line breaks only, and drawn by copying glyphs
+ * from an atlas.
+ */
+class TextLayer {
+public:
+	TextLayer()
+		: m_font(NULL)
+		, m_x(0)
+		, m_y(0)
+		, m_size(24)
+		, m_color(MakePixel(0, 0, 0))
+		, m_revision(0)
+	{}
+
+	/// Start over with an empty text
+	void Reset(const Font *font, float size, Pixel color, float x, float y) {
+		m_font = font;
+		m_size = size;
+		m_color = color;
+		m_x = x;
+		m_y = y;
+		m_text.clear();
+		++m_revision;
+	}
+
+	const std::u32string & Text() const { return m_text; }
+	bool IsEmpty() const { return m_text.empty(); }
+	/// Incremented on every change
+	int Revision() const { return m_revision; }
+
+	void Insert(uint32_t codepoint) {
+		m_text.push_back(codepoint);
+		++m_revision;
+	}
+	void Erase() {
+		if (!m_text.empty()) {
+			m_text.pop_back();
+			++m_revision;
+		}
+	}
+
+	/// Box of the text, and of the caret at its end, in canvas pixels
+	::Rect Bounds() const {
+		if (!IsUsable()) {
+			return ::Rect();
+		}
+		float lineHeight = m_font->LineHeight(m_size);
+		float width = 0, penX = 0;
+		int lineCount = 1;
+		ForEachGlyph([](int, float, float, int) {}, [&](float lineWidth) {
+			width = std::max(width, lineWidth);
+			++lineCount;
+		}, penX);
+		width = std::max(width, penX);
+		int x0 = (int)floor(m_x) - 1, y0 = (int)floor(m_y) - 1;
+		// Glyphs may overhang their advance a little
+		int margin = (int)ceil(m_size / 4) + 1;
+		return ::Rect(x0 - margin, y0 - margin, (int)ceil(width) + 2 * margin + 3, (int)ceil(lineCount * lineHeight) + 2 * margin + 3);
+	}
+
+	/// Caret position, at the end of the text
+	void Caret(float & x, float & y, float & height) const {
+		x = m_x;
+		y = m_y;
+		height = m_size;
+		if (!IsUsable()) {
+			return;
+		}
+		float lineHeight = m_font->LineHeight(m_size);
+		int line = 0;
+		float penX = 0;
+		ForEachGlyph([&](int, float, float, int) {}, [&](float) { ++line; }, penX);
+		x = m_x + penX;
+		y = m_y + line * lineHeight;
+	}
+
+	/// Blend glyphs into canvas, within clip
+	void Render(TiledCanvas & canvas, GlyphAtlas & atlas, const ::Rect & clip) const {
+		if (!IsUsable()) {
+			return;
+		}
+		float ascent = m_font->Ascent(m_size);
+		float lineHeight = m_font->LineHeight(m_size);
+		float dummy = 0;
+		::Rect area = clip.Intersected(::Rect(0, 0, canvas.Width(), canvas.Height()));
+		ForEachGlyph([&](int glyph, float x, float, int line) {
+			float penX = m_x + x;
+			int pixelX = (int)floor(penX);
+			int subpixel = std::min((int)((penX - pixelX) * GlyphAtlas::SubpixelSteps), GlyphAtlas::SubpixelSteps - 1);
+			int baseline = (int)floor(m_y + line * lineHeight + ascent + 0.5f);
+			const GlyphAtlas::Entry & entry = atlas.Find(*m_font, glyph, m_size, subpixel);
+			Blit(canvas, atlas, entry, pixelX + entry.left, baseline + entry.top, area);
+		}, [](float) {}, dummy);
+	}
+
+private:
+	bool IsUsable() const { return NULL != m_font && m_font->IsLoaded(); }
+
+	/**
+	 * Call f(glyph, x, advance, line) with x the pen position relative to the
+	 * start of the line, and newLine(width) at line breaks. penX is left at
+	 * the end of the last line.
+	 */
+	template <typename F, typename G>
+	void ForEachGlyph(F f, G newLine, float & penX) const {
+		int line = 0;
+		int previous = -1;
+		penX = 0;
+		for (uint32_t c : m_text) {
+			if (c == '\n') {
+				newLine(penX);
+				penX = 0;
+				previous = -1;
+				++line;
+				continue;
+			}
+			int glyph = m_font->GlyphIndex(c);
+			if (previous >= 0) {
+				penX += m_font->Kerning(previous, glyph, m_size);
+			}
+			float advance = m_font->Advance(glyph, m_size);
+			f(glyph, penX, advance, line);
+			penX += advance;
+			previous = glyph;
+		}
+	}
+
+	void Blit(TiledCanvas & canvas, const GlyphAtlas & atlas, const GlyphAtlas::Entry & entry, int x, int y, const ::Rect & clip) const {
+		::Rect r = ::Rect(x, y, entry.width, entry.height).Intersected(clip);
+		if (r.IsEmpty()) {
+			return;
+		}
+		const unsigned char *page = atlas.Page(entry.page);
+		canvas.ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			Tile *tile = canvas.MutableTile(tx, ty);
+			for (int j = 0; j < part.h; ++j) {
+				int py = part.y + j;
+				Pixel *row = tile->MutableRow(py - ty * TileSize) + part.x - tx * TileSize;
+				const unsigned char *coverage = page + (entry.y + py - y) * GlyphAtlas::PageSize + entry.x + part.x - x;
+				for (int i = 0; i < part.w; ++i) {
+					if (coverage[i] > 0) {
+						row[i] = BlendPixel(row[i], m_color, coverage[i] * (1.0f / 255.0f));
+					}
+				}
+			}
+		});
+	}
+
+private:
+	const Font *m_font;
+	std::u32string m_text;
+	float m_x, m_y; /// Top left corner, in canvas pixels
+	float m_size;
+	Pixel m_color;
+	int m_revision;
+};
+
+#endif // H_TEXT
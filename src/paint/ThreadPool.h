@@ -0,0 +1,147 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_THREAD_POOL
+#define H_THREAD_POOL
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of worker threads used to spread loops over all cores.
+ * The thread calling ParallelFor() takes part in the work, so a pool of
+ * N threads only starts N - 1 workers.
+ */
+class ThreadPool {
+public:
+	/// threadCount = 0 means one thread per core
+	explicit ThreadPool(unsigned int threadCount = 0)
+		: m_generation(0)
+		, m_isStopping(false)
+	{
+		if (threadCount == 0) {
+			threadCount = std::max(1u, std::thread::hardware_concurrency());
+		}
+		for (unsigned int i = 1; i < threadCount; ++i) {
+			m_threads.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+		}
+	}
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_isStopping = true;
+		}
+		m_wakeUp.notify_all();
+		for (std::thread & thread : m_threads) {
+			thread.join();
+		}
+	}
+
+	unsigned int ThreadCount() const { return (unsigned int)m_threads.size() + 1; }
+
+	/**
+	 * Call f(i) for all i in [0, count[ and return once they are all done.
+	 * Calls happen in no particular order and on any thread, so f must only
+	 * write to data that no other index touches.
+	 * Must not be called concurrently nor from within f.
+	 */
+	template <typename F>
+	void ParallelFor(size_t count, const F & f) {
+		if (count == 0) {
+			return;
+		}
+		if (count == 1 || m_threads.empty()) {
+			for (size_t i = 0; i < count; ++i) {
+				f(i);
+			}
+			return;
+		}
+
+		std::shared_ptr<Job> job = std::make_shared<Job>();
+		job->f = [&f](size_t i) { f(i); };
+		job->count = count;
+		job->next = 0;
+		job->pending = count;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_job = job;
+		++m_generation;
+		lock.unlock();
+		m_wakeUp.notify_all();
+
+		Work(*job);
+
+		// Workers that wake up late only find indices past the count, so
+		// they never call f once this returns
+		lock.lock();
+		m_done.wait(lock, [&job] { return job->pending == 0; });
+		m_job.reset();
+	}
+
+	/// Pool shared by the whole application
+	static ThreadPool & Global() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+private:
+	/// A call to ParallelFor(), that workers keep alive while they use it
+	struct Job {
+		std::function<void(size_t)> f;
+		size_t count;
+		std::atomic<size_t> next;
+		std::atomic<size_t> pending;
+	};
+
+	void Work(Job & job) {
+		for (;;) {
+			size_t i = job.next.fetch_add(1);
+			if (i >= job.count) {
+				break;
+			}
+			job.f(i);
+			if (job.pending.fetch_sub(1) == 1) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_done.notify_all();
+			}
+		}
+	}
+
+	void WorkerLoop() {
+		size_t generation = 0;
+		for (;;) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wakeUp.wait(lock, [&] { return m_isStopping || m_generation != generation; });
+			if (m_isStopping) {
+				return;
+			}
+			generation = m_generation;
+			std::shared_ptr<Job> job = m_job;
+			lock.unlock();
+
+			if (NULL != job) {
+				Work(*job);
+			}
+		}
+	}
+
+private:
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeUp;
+	std::condition_variable m_done;
+	size_t m_generation;
+	bool m_isStopping;
+	std::shared_ptr<Job> m_job; /// Of the current generation
+};
+
+#endif // H_THREAD_POOL
@@ -0,0 +1,339 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+#ifndef H_TRANSFORM
+#define H_TRANSFORM
+
+#include "Canvas.h"
+#include "ThreadPool.h"
+
+#include <cmath>
+#include <vector>
+
+/// Lossless changes of orientation
+enum Orientation {
+	RotateRight, /// 90 degrees clockwise
+	RotateLeft, /// 90 degrees counterclockwise
+	RotateHalfTurn,
+	FlipHorizontal, /// Mirror left and right
+	FlipVertical, /// Mirror top and bottom
+};
+
+/**
+ * Rotation and mirroring of a tiled canvas.
+ *
+ * Right angles and flips only move pixels around, so each output tile is
+ * made from the TileSize x TileSize block of source pixels that lands on
+ * it, transposed and reversed in 4x4 blocks that stay in cache. Blocks that
+ * have a single color are not even read. Other angles are resampled
+ * bilinearly. Both spread rows of output tiles over a thread pool.
+ */
+class Transformer {
+public:
+	explicit Transformer(ThreadPool & pool = ThreadPool::Global())
+		: m_pool(pool)
+		, m_isSimdEnabled(true)
+	{}
+
+	/// Only meant to compare with the scalar code, SIMD is used by default
+	/// when available
+	void SetSimdEnabled(bool enabled) { m_isSimdEnabled = enabled; }
+
+	/// Size of the canvas src becomes once turned
+	static void OrientedSize(const TiledCanvas & src, Orientation orientation, int & w, int & h) {
+		bool isTurned = orientation == RotateRight || orientation == RotateLeft;
+		w = isTurned ? src.Height() : src.Width();
+		h = isTurned ? src.Width() : src.Height();
+	}
+
+	/// Turn or mirror src into dst, that is reset to the matching size
+	void Orient(const TiledCanvas & src, TiledCanvas & dst, Orientation orientation) {
+		int w, h;
+		OrientedSize(src, orientation, w, h);
+		dst.Reset(w, h, src.Background());
+		std::vector<TiledCanvas::TilePtr> tiles(dst.TilesX() * dst.TilesY());
+		bool isSimd = m_isSimdEnabled;
+		m_pool.ParallelFor(dst.TilesY(), [&](size_t ty) {
+			std::vector<Pixel> buffer;
+			for (int tx = 0; tx < dst.TilesX(); ++tx) {
+				tiles[ty * dst.TilesX() + tx] = OrientTile(src, dst.TileRect(tx, (int)ty), orientation, isSimd, buffer);
+			}
+		});
+		for (int ty = 0; ty < dst.TilesY(); ++ty) {
+			for (int tx = 0; tx < dst.TilesX(); ++tx) {
+				dst.SetTile(tx, ty, tiles[ty * dst.TilesX() + tx]);
+			}
+		}
+	}
+
+	/**
+	 * Turn src clockwise by degrees into dst, that is reset to the bounding
+	 * box of the turned image. Corners that the image does not cover are
+	 * left with the background color. Right angles are exact.
+	 */
+	void Rotate(const TiledCanvas & src, TiledCanvas & dst, float degrees) {
+		float turns = degrees / 90.0f;
+		if (turns == floor(turns)) {
+			switch (((int)turns % 4 + 4) % 4) {
+			case 1: Orient(src, dst, RotateRight); return;
+			case 2: Orient(src, dst, RotateHalfTurn); return;
+			case 3: Orient(src, dst, RotateLeft); return;
+			default: dst = src; return;
+			}
+		}
+
+		const float pi = 3.14159265358979f;
+		float c = cos(degrees * pi / 180.0f);
+		float s = sin(degrees * pi / 180.0f);
+		int w = (int)ceil(fabs(src.Width() * c) + fabs(src.Height() * s) - 1e-3f);
+		int h = (int)ceil(fabs(src.Width() * s) + fabs(src.Height() * c) - 1e-3f);
+		dst.Reset(w, h, src.Background());
+
+		std::vector<Tile*> tiles(dst.TilesX() * dst.TilesY());
+		for (int ty = 0; ty < dst.TilesY(); ++ty) {
+			for (int tx = 0; tx < dst.TilesX(); ++tx) {
+				tiles[ty * dst.TilesX() + tx] = dst.MutableTile(tx, ty);
+			}
+		}
+
+		// Source position of destination pixel centers, relative to the
+		// centers of both images
+		float srcCenterX = src.Width() * 0.5f, srcCenterY = src.Height() * 0.5f;
+		float dstCenterX = w * 0.5f, dstCenterY = h * 0.5f;
+		m_pool.ParallelFor(dst.TilesY(), [&](size_t ty) {
+			std::vector<Pixel> buffer;
+			for (int tx = 0; tx < dst.TilesX(); ++tx) {
+				::Rect area = dst.TileRect(tx, (int)ty);
+				// Source pixels that the tile samples, one more on each side
+				float minX = 1e30f, minY = 1e30f, maxX = -1e30f, maxY = -1e30f;
+				for (int corner = 0; corner < 4; ++corner) {
+					float x = area.x + (corner & 1 ? area.w : 0) - dstCenterX;
+					float y = area.y + (corner & 2 ? area.h : 0) - dstCenterY;
+					float sx = c * x + s * y + srcCenterX;
+					float sy = -s * x + c * y + srcCenterY;
+					minX = std::min(minX, sx); maxX = std::max(maxX, sx);
+					minY = std::min(minY, sy); maxY = std::max(maxY, sy);
+				}
+				::Rect window((int)floor(minX) - 1, (int)floor(minY) - 1, 0, 0);
+				window.w = (int)ceil(maxX) + 1 - window.x;
+				window.h = (int)ceil(maxY) + 1 - window.y;
+				Tile *tile = tiles[ty * dst.TilesX() + tx];
+				::Rect inside = window.Intersected(::Rect(0, 0, src.Width(), src.Height()));
+				Pixel color;
+				if (inside.IsEmpty() || (inside.x == window.x && inside.y == window.y && inside.w == window.w && inside.h == window.h && src.IsUniform(window, color))) {
+					tile->Fill(inside.IsEmpty() ? src.Background() : color);
+				} else {
+					buffer.assign(window.w * window.h, src.Background());
+					src.ReadRect(inside, &buffer[(inside.y - window.y) * window.w + inside.x - window.x], window.w);
+					for (int j = 0; j < area.h; ++j) {
+						Pixel *out = tile->MutableRow(j);
+						float y = area.y + j + 0.5f - dstCenterY;
+						for (int i = 0; i < area.w; ++i) {
+							float x = area.x + i + 0.5f - dstCenterX;
+							// Relative to the window, on pixel corners
+							float sx = c * x + s * y + srcCenterX - 0.5f - window.x;
+							float sy = -s * x + c * y + srcCenterY - 0.5f - window.y;
+							out[i] = Bilinear(buffer, window.w, sx, sy);
+						}
+					}
+				}
+				// Pixels beyond the canvas must stay background
+				if (area.w < TileSize || area.h < TileSize) {
+					for (int j = 0; j < TileSize; ++j) {
+						Pixel *row = tile->MutableRow(j);
+						int begin = j < area.h ? area.w : 0;
+						std::fill(row + begin, row + TileSize, src.Background());
+					}
+				}
+				tile->Collapse();
+			}
+		});
+	}
+
+private:
+	/**
+	 * Pixels of the tile of dst covering area, taken from src. The source
+	 * block is laid out in a TileSize x TileSize buffer such that turning the
+	 * whole buffer gives the tile, padding being the background color.
+	 */
+	static TiledCanvas::TilePtr OrientTile(const TiledCanvas & src, const ::Rect & area, Orientation orientation, bool isSimd, std::vector<Pixel> & buffer) {
+		int w = src.Width(), h = src.Height();
+		::Rect block;
+		int offsetX = 0, offsetY = 0;
+		switch (orientation) {
+		case RotateRight:
+			block = ::Rect(area.y, h - area.x - area.w, area.h, area.w);
+			offsetY = TileSize - area.w;
+			break;
+		case RotateLeft:
+			block = ::Rect(w - area.y - area.h, area.x, area.h, area.w);
+			offsetX = TileSize - area.h;
+			break;
+		case RotateHalfTurn:
+			block = ::Rect(w - area.x - area.w, h - area.y - area.h, area.w, area.h);
+			offsetX = TileSize - area.w;
+			offsetY = TileSize - area.h;
+			break;
+		case FlipHorizontal:
+			block = ::Rect(w - area.x - area.w, area.y, area.w, area.h);
+			offsetX = TileSize - area.w;
+			break;
+		case FlipVertical:
+			block = ::Rect(area.x, h - area.y - area.h, area.w, area.h);
+			offsetY = TileSize - area.h;
+			break;
+		}
+
+		Pixel color;
+		if (src.IsUniform(block, color)) {
+			if (color == src.Background()) {
+				return TiledCanvas::TilePtr();
+			}
+			bool isFull = area.w == TileSize && area.h == TileSize;
+			if (isFull && block.x % TileSize == 0 && block.y % TileSize == 0) {
+				return src.SharedTileAt(block.x / TileSize, block.y / TileSize);
+			}
+			if (isFull) {
+				return std::make_shared<Tile>(color);
+			}
+		}
+
+		// Read straight from the source tile when the block is one
+		const Pixel *in = NULL;
+		bool isTileBlock = block.x % TileSize == 0 && block.y % TileSize == 0 && block.w == TileSize && block.h == TileSize;
+		if (isTileBlock) {
+			const Tile *tile = src.TileAt(block.x / TileSize, block.y / TileSize);
+			in = tile ? tile->Row(0) : NULL;
+		}
+		if (!in) {
+			buffer.resize(TileSize * TileSize);
+			if (block.w < TileSize || block.h < TileSize) {
+				std::fill(buffer.begin(), buffer.end(), src.Background());
+			}
+			src.ReadRect(block, &buffer[offsetY * TileSize + offsetX], TileSize);
+			in = buffer.data();
+		}
+
+		TiledCanvas::TilePtr tile = std::make_shared<Tile>();
+		Pixel *out = tile->MutableData();
+		if (isSimd) {
+			OrientBlockSimd(in, out, orientation);
+		} else {
+			OrientBlock(in, out, orientation);
+		}
+		tile->Collapse();
+		return tile;
+	}
+
+	/// Turn a whole TileSize x TileSize block
+	static void OrientBlock(const Pixel *in, Pixel *out, Orientation orientation) {
+		const int last = TileSize - 1;
+		for (int j = 0; j < TileSize; ++j) {
+			Pixel *row = out + j * TileSize;
+			for (int i = 0; i < TileSize; ++i) {
+				switch (orientation) {
+				case RotateRight: row[i] = in[(last - i) * TileSize + j]; break;
+				case RotateLeft: row[i] = in[i * TileSize + last - j]; break;
+				case RotateHalfTurn: row[i] = in[(last - j) * TileSize + last - i]; break;
+				case FlipHorizontal: row[i] = in[j * TileSize + last - i]; break;
+				case FlipVertical: row[i] = in[(last - j) * TileSize + i]; break;
+				}
+			}
+		}
+	}
+
+#ifdef PAINT_HAS_SSE2
+	static __m128i Load(const Pixel *p) { return _mm_loadu_si128((const __m128i*)p); }
+	static void Store(Pixel *p, __m128i v) { _mm_storeu_si128((__m128i*)p, v); }
+
+	static void OrientBlockSimd(const Pixel *in, Pixel *out, Orientation orientation) {
+		const int last = TileSize - 1;
+		switch (orientation) {
+		case RotateRight:
+		case RotateLeft:
+			for (int j = 0; j < TileSize; j += 4) {
+				for (int i = 0; i < TileSize; i += 4) {
+					// Output block at (i, j), from the source rows that become
+					// its columns
+					__m128i r[4];
+					for (int k = 0; k < 4; ++k) {
+						r[k] = orientation == RotateRight
+							? Load(in + (last - i - k) * TileSize + j)
+							: Load(in + (i + k) * TileSize + TileSize - 4 - j);
+					}
+					__m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+					__m128i t1 = _mm_unpacklo_epi32(r[2], r[3]);
+					__m128i t2 = _mm_unpackhi_epi32(r[0], r[1]);
+					__m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+					__m128i c[4] = {
+						_mm_unpacklo_epi64(t0, t1),
+						_mm_unpackhi_epi64(t0, t1),
+						_mm_unpacklo_epi64(t2, t3),
+						_mm_unpackhi_epi64(t2, t3),
+					};
+					for (int k = 0; k < 4; ++k) {
+						int row = orientation == RotateRight ? j + k : j + 3 - k;
+						Store(out + row * TileSize + i, c[k]);
+					}
+				}
+			}
+			break;
+		case RotateHalfTurn:
+		case FlipHorizontal:
+			for (int j = 0; j < TileSize; ++j) {
+				const Pixel *row = in + (orientation == RotateHalfTurn ? last - j : j) * TileSize;
+				for (int i = 0; i < TileSize; i += 4) {
+					__m128i v = Load(row + TileSize - 4 - i);
+					Store(out + j * TileSize + i, _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+				}
+			}
+			break;
+		case FlipVertical:
+			for (int j = 0; j < TileSize; ++j) {
+				std::copy(in + (last - j) * TileSize, in + (last - j + 1) * TileSize, out + j * TileSize);
+			}
+			break;
+		}
+	}
+#else
+	static void OrientBlockSimd(const Pixel *in, Pixel *out, Orientation orientation) { OrientBlock(in, out, orientation); }
+#endif
+
+	/// Sample pixels of stride wide buffer at (x, y), in pixel corner
+	/// coordinates, weighting colors by alpha
+	static Pixel Bilinear(const std::vector<Pixel> & buffer, int stride, float x, float y) {
+		int x0 = (int)floor(x), y0 = (int)floor(y);
+		float fx = x - x0, fy = y - y0;
+		int height = (int)buffer.size() / stride;
+		x0 = std::min(std::max(x0, 0), stride - 2);
+		y0 = std::min(std::max(y0, 0), height - 2);
+		const Pixel *p = &buffer[y0 * stride + x0];
+		Pixel samples[4] = { p[0], p[1], p[stride], p[stride + 1] };
+		float weights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+		float r = 0, g = 0, b = 0, a = 0;
+		for (int k = 0; k < 4; ++k) {
+			float wa = weights[k] * PixelA(samples[k]);
+			r += wa * PixelR(samples[k]);
+			g += wa * PixelG(samples[k]);
+			b += wa * PixelB(samples[k]);
+			a += wa;
+		}
+		if (a < 0.5f) {
+			return 0;
+		}
+		return MakePixel(
+			(unsigned char)std::min(r / a + 0.5f, 255.0f),
+			(unsigned char)std::min(g / a + 0.5f, 255.0f),
+			(unsigned char)std::min(b / a + 0.5f, 255.0f),
+			(unsigned char)std::min(a + 0.5f, 255.0f)
+		);
+	}
+
+private:
+	ThreadPool & m_pool;
+	bool m_isSimdEnabled;
+};
+
+#endif // H_TRANSFORM
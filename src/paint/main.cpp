@@ -12,14 +12,32 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <unordered_set>
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
 
 #include "BaseUi.h"
+#include "Canvas.h"
+#include "History.h"
+#include "Brush.h"
+#include "Clipboard.h"
+#include "Fill.h"
+#include "Mipmap.h"
+#include "Rasterizer.h"
+#include "Resample.h"
+#include "Selection.h"
+#include "Shape.h"
+#include "Text.h"
+#include "Transform.h"
+#include "SystemClipboard.h"
 
 // Function prototypes
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
+void char_callback(GLFWwindow* glfwWindow, unsigned int codepoint);
 void cursor_pos_callback(GLFWwindow* window, double xpos, double ypos);
 void mouse_button_callback(GLFWwindow* glfwWindow, int button, int action, int mods);
+void scroll_callback(GLFWwindow* glfwWindow, double xoffset, double yoffset);
 void window_size_callback(GLFWwindow* glfwWindow, int width, int height);
 
 // Window dimensions
@@ -38,6 +56,7 @@ public:
 	Image(struct NVGcontext* vg, const std::string & filename)
 		: m_img(-1)
 		, m_vg(vg)
+		, m_flags(0)
 	{
 		Load(vg, filename);
 	}
@@ -45,6 +64,7 @@ public:
 	Image()
 		: m_img(-1)
 		, m_vg(NULL)
+		, m_flags(NVG_IMAGE_NEAREST)
 	{}
 
 	~Image() {
@@ -59,18 +79,49 @@ public:
 		nvgImageSize(m_vg, m_img, &m_width, &m_height);
 	}
 
-	void Create(struct NVGcontext* vg, int w, int h) {
+	/**
+	 * Content is left undefined if data is NULL, use Update() to fill it.
+	 * flags are NVGimageFlags.
+	 */
+	void Create(struct NVGcontext* vg, int w, int h, const unsigned char *data = NULL, int flags = NVG_IMAGE_NEAREST) {
 		if (NULL == m_vg) {
 			m_vg = vg;
 		}
-		unsigned char* data = new unsigned char[w * h * 4];
-		for (size_t i = 0; i < w * h * 4; ++i) {
-			data[i] = 255;
+		Delete();
+		m_flags = flags;
+		m_img = nvgCreateImageRGBA(m_vg, w, h, flags, data);
+		m_width = w;
+		m_height = h;
+	}
+
+	/**
+	 * Reallocate the image, keeping the content of the area that the old and
+	 * new sizes have in common. The copy happens on the GPU, the rest of the
+	 * content is left undefined.
+	 */
+	void Resize(int w, int h) {
+		if (m_img == -1) {
+			Create(NULL, w, h, NULL, m_flags);
+			return;
 		}
-		m_img = nvgCreateImageRGBA(vg, w, h, NVG_IMAGE_NEAREST, data);
-		delete[] data;
+		int oldImg = m_img;
+		int keptWidth = std::min(w, m_width);
+		int keptHeight = std::min(h, m_height);
+		m_img = nvgCreateImageRGBA(m_vg, w, h, m_flags, NULL);
 		m_width = w;
 		m_height = h;
+
+		GLuint frameBuffer;
+		glGenFramebuffers(1, &frameBuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, nvglImageHandleGLES3(m_vg, oldImg), 0);
+		glBindTexture(GL_TEXTURE_2D, nvglImageHandleGLES3(m_vg, m_img));
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, keptWidth, keptHeight);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &frameBuffer);
+
+		nvgDeleteImage(m_vg, oldImg);
 	}
 
 	void Delete() {
@@ -80,57 +131,46 @@ public:
 		}
 	}
 
-	void Resize(int w, int h) {
+	/**
+	 * Upload a sub-rectangle of the image. rowLength is the number of pixels
+	 * between the beginning of two consecutive rows in data.
+	 */
+	void Update(int x, int y, int w, int h, const unsigned char *data, int rowLength) {
 		if (m_img == -1) {
 			return;
 		}
 
-		// Get old image data through a framebuffer
 		GLuint tex = nvglImageHandleGLES3(m_vg, m_img);
-		unsigned char* oldData = new unsigned char[m_width * m_height * 4];
-		
-		GLuint fbo;
-		glGenFramebuffers(1, &fbo);
-		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
 		glBindTexture(GL_TEXTURE_2D, tex);
-		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
-
-		glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, oldData);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, rowLength);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, data);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		glDeleteFramebuffers(1, &fbo);
-
-		// Copy from old to new data
-		unsigned char* data = new unsigned char[w * h * 4];
-		for (size_t j = 0; j < h; ++j) {
-			for (size_t i = 0; i < w; ++i) {
-				if (i < m_width && j < m_height) {
-					for (size_t k = 0; k < 4; ++k) {
-						data[(j * w + i) * 4 + k] = oldData[(j * m_width + i) * 4 + k];
-					}
-				}
-				else {
-					for (size_t k = 0; k < 4; ++k) {
-						data[(j * w + i) * 4 + k] = 255;
-					}
-				}
-			}
+	/**
+	 * Paint the image at (x, y), magnified by scale. w and h crop it.
+	 */
+	void Paint(float x, float y, float w = -1, float h = -1, float scale = 1.0f) const {
+		if (NULL != m_vg && m_img > -1) {
+			nvgBeginPath(m_vg);
+			nvgRect(m_vg, x, y, w >= 0 ? w : m_width * scale, h >= 0 ? h : m_height * scale);
+			nvgFillPaint(m_vg, nvgImagePattern(m_vg, x, y, m_width * scale, m_height * scale, 0, m_img, 1.0f));
+			nvgFill(m_vg);
 		}
-
-		delete[] oldData;
-		
-		nvgDeleteImage(m_vg, m_img);
-		m_img = nvgCreateImageRGBA(m_vg, w, h, NVG_IMAGE_NEAREST, data);
-		delete[] data;
-		m_width = w;
-		m_height = h;
 	}
 
-	void Paint(float x, float y, float w = -1, float h = -1) const {
-		if (NULL != m_vg && m_img > -1) {
+	/**
+	 * Paint only the part of the image that falls in clip, the image being
+	 * placed at (x, y) and magnified by scale.
+	 */
+	void Paint(float x, float y, float scale, const ::Rect & clip) const {
+		if (NULL != m_vg && m_img > -1 && !clip.IsEmpty()) {
 			nvgBeginPath(m_vg);
-			nvgRect(m_vg, x, y, w >= 0 ? w : m_width, h >= 0 ? h : m_height);
-			nvgFillPaint(m_vg, nvgImagePattern(m_vg, x, y, m_width, m_height, 0, m_img, 1.0f));
+			nvgRect(m_vg, clip.x, clip.y, clip.w, clip.h);
+			nvgFillPaint(m_vg, nvgImagePattern(m_vg, x, y, m_width * scale, m_height * scale, 0, m_img, 1.0f));
 			nvgFill(m_vg);
 		}
 	}
@@ -143,31 +183,480 @@ public:
 private:
 	int m_img; /// Image ID
 	struct NVGcontext* m_vg; /// Parent context
+	int m_flags; /// Flags the image got created with
 	int m_width, m_height;
 };
 
+/**
+ * Display image of one level of detail of a document, and the tiles of this
+ * level that changed since they were last uploaded to it
+ */
+struct LevelImage {
+	Image img;
+	std::unordered_set<uint64_t> dirtyTiles; /// Tiles changed in canvas but not uploaded yet
+};
+
 /**
  * Document properties
+ * Pixels live in a tiled canvas on the CPU side, the image is only used to
+ * display them and as a render target for the GPU stroke engine. The image
+ * may be larger than the canvas, so that resizing the canvas seldom needs to
+ * reallocate it, and then only the edges that grew are uploaded.
+ * Edits must happen between BeginEdit() and EndEdit() to be undoable.
+ *
+ * Zoomed out views display a downsampled level of the canvas instead (see
+ * MipPyramid), that has its own image, created the first time it is shown.
+ *
+ * Every edit reports the area it changed. Tiles changed on the CPU side are
+ * Invalidate()-d and marked dirty. Each call to Upload() sends the dirty
+ * tiles of the displayed level that are in view to its image with
+ * glTexSubImage2D until the per frame byte budget is spent, so that a huge
+ * edit gets spread over several frames and tiles out of view wait until they
+ * get scrolled to. All areas that changed in the displayed image accumulate
+ * in Damage() until the display takes them.
+ *
+ * While something is selected, tools write wherever they like and then
+ * Clip() puts back what they wrote outside of the selection.
  */
 class Document {
 public:
+	Document()
+		: m_pyramid(m_canvas)
+	{}
+
 	void CreateImage(NVGcontext* vg, int w, int h) {
-		m_img.Create(vg, w, h);
+		m_vg = vg;
+		m_canvas.Reset(w, h, MakePixel(255, 255, 255));
+		m_pyramid.Reset();
+		m_levels.clear();
+		m_levels.push_back(std::unique_ptr<LevelImage>(new LevelImage()));
+		m_levels[0]->img.Create(vg, w, h);
+		m_displayLevel = 0;
+		InvalidateImage(0, ::Rect(0, 0, w, h));
 	}
 
-	const Image & Img() const { return m_img; }
+	/// Full resolution image
+	const Image & Img() const { return m_levels[0]->img; }
 
-	int Width() const { return m_width; }
-	int Height() const { return m_height; }
+	const TiledCanvas & Canvas() const { return m_canvas; }
+	TiledCanvas & Canvas() { return m_canvas; }
+
+	const ::History & History() const { return m_history; }
+	::History & History() { return m_history; }
+
+	int Width() const { return m_canvas.Width(); }
+	int Height() const { return m_canvas.Height(); }
 	void SetSize(int w, int h) {
-		m_width = w;
-		m_height = h;
-		m_img.Resize(w, h);
+		int oldWidth = Width(), oldHeight = Height();
+		BeginEdit();
+		// Remember what gets cropped out
+		Touch(::Rect(w, 0, Width() - w, Height()));
+		Touch(::Rect(0, h, Width(), Height() - h));
+		m_canvas.Resize(w, h);
+		EndEdit();
+
+		OnResize();
+		Invalidate(::Rect(oldWidth, 0, w - oldWidth, h));
+		Invalidate(::Rect(0, oldHeight, w, h - oldHeight));
+	}
+
+	/// Stretch the whole image to w x h
+	void Scale(int w, int h, ResampleFilter filter) {
+		if (w <= 0 || h <= 0 || (w == Width() && h == Height())) {
+			return;
+		}
+		TiledCanvas scaled;
+		Resampler().Resize(m_canvas, scaled, w, h, filter);
+		Replace(scaled);
+	}
+
+	/// Turn or mirror the whole image
+	void Orient(Orientation orientation) {
+		TiledCanvas oriented;
+		Transformer().Orient(m_canvas, oriented, orientation);
+		Replace(oriented);
+	}
+
+	/// Turn the whole image clockwise, growing it to fit
+	void Rotate(float degrees) {
+		TiledCanvas rotated;
+		Transformer().Rotate(m_canvas, rotated, degrees);
+		Replace(rotated);
+	}
+
+	/// Keep only the bounds of the selection
+	void CropToSelection() {
+		if (!HasSelection()) {
+			return;
+		}
+		::Rect bounds = m_selection.Bounds();
+		SetSelection(::Selection());
+		BeginEdit();
+		Touch(::Rect(0, 0, Width(), Height()));
+		// Tiles are moved rather than copied when bounds are on the tile grid
+		m_canvas.Crop(bounds);
+		EndEdit();
+
+		OnResize();
+		Invalidate(::Rect(0, 0, Width(), Height()));
+	}
+
+	/// Number of levels of detail, the first one being the canvas itself
+	int LevelCount() const { return m_pyramid.LevelCount(); }
+
+	/**
+	 * Level of detail to display the document with at a given zoom. It is
+	 * the level that gets shrunk by less than 2 but never magnified, except
+	 * that the canvas itself, sampled with nearest filtering, would alias
+	 * when shrunk. Below zoom 1, level 1 is used instead, magnified by less
+	 * than 2 with linear filtering.
+	 */
+	static int LevelForZoom(float zoom) {
+		if (zoom >= 1.0f) {
+			return 0;
+		}
+		int level = 1;
+		while (level < 30 && zoom * (2 << level) <= 1.0f) {
+			++level;
+		}
+		return level;
+	}
+
+	int DisplayLevel() const { return m_displayLevel; }
+	/// Image of the displayed level, its pixels are 2^DisplayLevel() canvas pixels wide
+	const Image & DisplayImg() const { return m_levels[m_displayLevel]->img; }
+	void SetDisplayLevel(int level) {
+		level = std::min(std::max(level, 0), LevelCount() - 1);
+		if ((int)m_levels.size() <= level) {
+			m_levels.resize(level + 1);
+		}
+		if (!m_levels[level]) {
+			m_levels[level].reset(new LevelImage());
+			ReserveImage(level);
+			InvalidateImage(level, ::Rect(0, 0, Width(), Height()));
+		}
+		if (level != m_displayLevel) {
+			m_displayLevel = level;
+			Damage(::Rect(0, 0, Width(), Height()));
+		}
+	}
+
+	void BeginEdit() {
+		m_history.BeginStep(m_canvas);
+		m_editSnapshot.Clear();
+	}
+	/// Call before writing to r during an edit
+	void Touch(const ::Rect & r) {
+		m_history.Touch(m_canvas, r);
+		if (HasSelection()) {
+			m_editSnapshot.Touch(m_canvas, r);
+		}
+	}
+	void EndEdit() {
+		m_history.EndStep(m_canvas);
+		m_editSnapshot.Clear();
+	}
+
+	/// Pixels that tools may change, everything if empty
+	const ::Selection & Selection() const { return m_selection; }
+	bool HasSelection() const { return !m_selection.IsEmpty(); }
+	void SetSelection(const ::Selection & selection) {
+		// Outlines get redrawn
+		Damage(m_selection.Bounds().United(selection.Bounds()));
+		m_selection = selection;
+	}
+
+	/// Copy the selected pixels to clipboard
+	void Copy(Clipboard & clipboard) const {
+		clipboard.Copy(m_canvas, m_selection);
+	}
+
+	/// Copy the selected pixels to clipboard, then fill them with color
+	void Cut(Clipboard & clipboard, Pixel color) {
+		Copy(clipboard);
+		if (clipboard.IsEmpty()) {
+			return;
+		}
+		::Rect bounds = m_selection.Bounds();
+		BeginEdit();
+		Touch(bounds);
+		m_selection.ForEachRectInside(bounds, [&](const ::Rect & part) {
+			m_canvas.FillRect(part, color);
+		});
+		EndEdit();
+		Invalidate(bounds);
+	}
+
+	/// Paste clipboard with its top left corner at (x, y), and select what
+	/// got pasted
+	void Paste(const Clipboard & clipboard, int x, int y) {
+		if (clipboard.IsEmpty()) {
+			return;
+		}
+		::Rect bounds = clipboard.PasteBounds(x, y);
+		BeginEdit();
+		Touch(bounds);
+		::Selection pasted = clipboard.Paste(m_canvas, x, y);
+		EndEdit();
+		Invalidate(bounds);
+		SetSelection(pasted);
+	}
+
+	/// Put back pixels of r that are not selected as they were when the
+	/// edit began. Call after writing to r, before Invalidate(r).
+	void Clip(const ::Rect & r) {
+		if (!HasSelection() || m_selection.Contains(r)) {
+			return;
+		}
+		::Rect area = r.Intersected(::Rect(0, 0, Width(), Height()));
+		m_selection.ForEachRectOutside(area, [&](const ::Rect & outside) {
+			m_canvas.ForEachTile(outside, [&](int, int, const ::Rect & part) {
+				m_clipBuffer.resize(TileSize * TileSize);
+				m_editSnapshot.ReadRect(m_canvas, part, m_clipBuffer.data(), part.w);
+				m_canvas.WriteRect(part, m_clipBuffer.data(), part.w);
+			});
+		});
+	}
+
+	bool Undo() {
+		::Rect damage;
+		if (!m_history.Undo(m_canvas, damage)) {
+			return false;
+		}
+		ApplyHistory(damage);
+		return true;
+	}
+
+	bool Redo() {
+		::Rect damage;
+		if (!m_history.Redo(m_canvas, damage)) {
+			return false;
+		}
+		ApplyHistory(damage);
+		return true;
+	}
+
+	/// Call after writing to r in the canvas
+	void Invalidate(const ::Rect & r) {
+		m_pyramid.Invalidate(r);
+		InvalidateImages(r, 0);
+	}
+
+	/// Call after drawing to r directly in the image (and reading it back)
+	void Damage(const ::Rect & r) {
+		m_damage = m_damage.United(r.Intersected(::Rect(0, 0, Width(), Height())));
+	}
+
+	/// Area changed since last call to TakeDamage()
+	const ::Rect & Damage() const { return m_damage; }
+	::Rect TakeDamage() {
+		::Rect damage = m_damage;
+		m_damage = ::Rect();
+		return damage;
+	}
+
+	/// Maximum number of bytes sent to the images per frame.
+	/// At least one tile is sent anyway, so that uploads always progress.
+	void SetUploadBudget(size_t budget) { m_uploadBudget = budget; }
+	size_t UploadBudget() const { return m_uploadBudget; }
+	/// Bytes sent to the images during the frame that the last call to
+	/// Upload() ended, including immediate uploads
+	size_t LastUploadByteSize() const { return m_lastUploadByteSize; }
+	/// Number of tiles of the displayed level waiting for upload
+	size_t PendingUploadCount() const { return m_levels[m_displayLevel]->dirtyTiles.size(); }
+
+	/**
+	 * Send dirty tiles of the displayed level that intersect visible (in
+	 * canvas pixels) to its image, within the upload budget. The cost only
+	 * depends on the size of the visible area. Call once per frame.
+	 */
+	void Upload(const ::Rect & visible) {
+		int level = m_displayLevel;
+		LevelImage & image = *m_levels[level];
+		if (!image.dirtyTiles.empty()) {
+			const TiledCanvas & canvas = m_pyramid.Level(level);
+
+			// Tiles are picked first, so that the level gets updated at once
+			std::vector<::Rect> tiles;
+			::Rect area;
+			size_t byteSize = m_frameUploadByteSize;
+			bool isBudgetSpent = false;
+			canvas.ForEachTile(MipPyramid::LevelRect(visible, level), [&](int tx, int ty, const ::Rect &) {
+				uint64_t key = TileKey(tx, ty);
+				if (isBudgetSpent || image.dirtyTiles.find(key) == image.dirtyTiles.end()) {
+					return;
+				}
+				::Rect tileRect = canvas.TileRect(tx, ty);
+				size_t tileByteSize = tileRect.w * tileRect.h * sizeof(Pixel);
+				if (byteSize > 0 && byteSize + tileByteSize > m_uploadBudget) {
+					isBudgetSpent = true;
+					return;
+				}
+				image.dirtyTiles.erase(key);
+				byteSize += tileByteSize;
+				tiles.push_back(tileRect);
+				area = area.United(tileRect);
+			});
+			m_pyramid.Update(level, area);
+			for (const ::Rect & tileRect : tiles) {
+				UploadLevel(level, tileRect);
+			}
+		}
+
+		m_lastUploadByteSize = m_frameUploadByteSize;
+		m_frameUploadByteSize = 0;
+	}
+
+	/// Send the tiles intersecting r to the full resolution image right
+	/// away, regardless of the budget.
+	void UploadNow(const ::Rect & r) {
+		UploadLevel(0, r);
+	}
+
+	/**
+	 * Copy back into the canvas pixels that the GPU drew to the image.
+	 * The image must be attached to the currently bound framebuffer.
+	 */
+	void ReadBack(const ::Rect & r) {
+		::Rect clipped = r.Intersected(::Rect(0, 0, Width(), Height()));
+		if (clipped.IsEmpty()) {
+			return;
+		}
+		m_readBackBuffer.resize(clipped.w * clipped.h);
+		glReadPixels(clipped.x, clipped.y, clipped.w, clipped.h, GL_RGBA, GL_UNSIGNED_BYTE, m_readBackBuffer.data());
+		Touch(clipped);
+		m_canvas.WriteRect(clipped, m_readBackBuffer.data(), clipped.w);
+		// Only the full resolution image is already up to date
+		m_pyramid.Invalidate(clipped);
+		InvalidateImages(clipped, 1);
+		Damage(clipped);
 	}
 
 private:
-	int m_width, m_height;
-	Image m_img;
+	/// Swap the whole canvas for another one, tiles being shared with it,
+	/// as a single step of the history
+	void Replace(const TiledCanvas & canvas) {
+		SetSelection(::Selection());
+		BeginEdit();
+		Touch(::Rect(0, 0, Width(), Height()));
+		m_canvas.Resize(canvas.Width(), canvas.Height());
+		Touch(::Rect(0, 0, Width(), Height()));
+		for (int ty = 0; ty < m_canvas.TilesY(); ++ty) {
+			for (int tx = 0; tx < m_canvas.TilesX(); ++tx) {
+				m_canvas.SetTile(tx, ty, canvas.SharedTileAt(tx, ty));
+			}
+		}
+		EndEdit();
+
+		OnResize();
+		Invalidate(::Rect(0, 0, Width(), Height()));
+	}
+
+	void ApplyHistory(const ::Rect & damage) {
+		OnResize();
+		Invalidate(damage);
+	}
+
+	/// Follow a change of the size of the canvas
+	void OnResize() {
+		m_pyramid.Resize();
+		if ((int)m_levels.size() > LevelCount()) {
+			m_levels.resize(LevelCount());
+		}
+		for (int level = 0; level < (int)m_levels.size(); ++level) {
+			if (m_levels[level]) {
+				ReserveImage(level);
+			}
+		}
+		SetDisplayLevel(m_displayLevel);
+	}
+
+	/// Mark dirty the tiles of the images of levels from firstLevel on
+	/// that cover rect r of the canvas
+	void InvalidateImages(const ::Rect & r, int firstLevel) {
+		for (int level = firstLevel; level < (int)m_levels.size(); ++level) {
+			if (m_levels[level]) {
+				InvalidateImage(level, r);
+			}
+		}
+	}
+
+	void InvalidateImage(int level, const ::Rect & r) {
+		LevelImage & image = *m_levels[level];
+		m_pyramid.Level(level).ForEachTile(MipPyramid::LevelRect(r, level), [&](int tx, int ty, const ::Rect &) {
+			image.dirtyTiles.insert(TileKey(tx, ty));
+		});
+	}
+
+	/// Send the tiles of level intersecting r (in level pixels) to its
+	/// image, without updating the level
+	void UploadLevel(int level, const ::Rect & r) {
+		const TiledCanvas & canvas = m_pyramid.Level(level);
+		Image & img = m_levels[level]->img;
+		canvas.ForEachTile(r, [&](int tx, int ty, const ::Rect & part) {
+			const Tile *tile = canvas.TileAt(tx, ty);
+			const Pixel *data;
+			if (tile && !tile->IsUniform()) {
+				data = tile->Row(part.y - ty * TileSize) + (part.x - tx * TileSize);
+			} else {
+				// Uniform tiles are expanded in a scratch buffer
+				m_uploadBuffer.assign(TileSize * TileSize, tile ? tile->Color() : canvas.Background());
+				data = m_uploadBuffer.data();
+			}
+			img.Update(part.x, part.y, part.w, part.h, reinterpret_cast<const unsigned char*>(data), TileSize);
+			m_frameUploadByteSize += part.w * part.h * sizeof(Pixel);
+			if (level == m_displayLevel) {
+				Damage(::Rect(part.x << level, part.y << level, part.w << level, part.h << level));
+			}
+		});
+	}
+
+	/// Make sure that the image of level is at least as large as the level
+	void ReserveImage(int level) {
+		const TiledCanvas & canvas = m_pyramid.Level(level);
+		Image & img = m_levels[level]->img;
+		if (img.Handle() == -1) {
+			img.Create(m_vg, Capacity(canvas.Width(), 0), Capacity(canvas.Height(), 0), NULL, level > 0 ? 0 : NVG_IMAGE_NEAREST);
+			return;
+		}
+		if (canvas.Width() <= img.Width() && canvas.Height() <= img.Height()) {
+			return;
+		}
+		img.Resize(Capacity(canvas.Width(), img.Width()), Capacity(canvas.Height(), img.Height()));
+	}
+
+	/// Image size to allocate for a canvas size, growing by at least half of
+	/// the current capacity and rounded to whole tiles
+	static int Capacity(int size, int capacity) {
+		if (size <= capacity) {
+			return capacity;
+		}
+		size = std::max(size, capacity + capacity / 2);
+		return (size + TileSize - 1) / TileSize * TileSize;
+	}
+
+	static uint64_t TileKey(int tx, int ty) {
+		return ((uint64_t)(uint32_t)ty << 32) | (uint32_t)tx;
+	}
+
+private:
+	TiledCanvas m_canvas;
+	MipPyramid m_pyramid;
+	::History m_history;
+	::Selection m_selection;
+	/// Canvas as it was when the edit began, where it got touched
+	CanvasSnapshot m_editSnapshot;
+	std::vector<Pixel> m_clipBuffer;
+	NVGcontext *m_vg = NULL;
+	/// Indexed by level, NULL for levels that have never been displayed
+	std::vector<std::unique_ptr<LevelImage> > m_levels;
+	int m_displayLevel = 0;
+	size_t m_uploadBudget = 8 * 1024 * 1024;
+	size_t m_frameUploadByteSize = 0;
+	size_t m_lastUploadByteSize = 0;
+	::Rect m_damage; /// Changed in the displayed image since the display last looked
+	std::vector<Pixel> m_uploadBuffer;
+	std::vector<Pixel> m_readBackBuffer;
 };
 
 /**
@@ -190,11 +679,30 @@ enum Tool {
 	NaturalPencilBrushTool,
 	WatercolorBrushTool,
 	SelectTool,
+	ShapeTool,
 };
 enum ColorRole {
 	ForegroundColor,
 	BackgroundColor,
 };
+/// Where strokes get rasterized
+enum StrokeBackend {
+	GpuStrokeBackend,
+	CpuStrokeBackend,
+};
+/// How the select tool picks pixels
+enum SelectionShape {
+	RectangleSelection,
+	FreeFormSelection,
+	MagicWandSelection, /// Pixels connected to the clicked one, of similar color
+};
+/// What the eraser leaves behind
+enum EraseMode {
+	BackgroundEraseMode, /// Paint with the background color
+	AlphaEraseMode, /// Make pixels transparent
+};
+class DocumentArea;
+
 struct Editor {
 	float zoom = 1.0f;
 	NVGcolor foregroundColor = nvgRGB(0, 0, 0);
@@ -202,6 +710,28 @@ struct Editor {
 	Tool currentTool = BrushTool;
 	ColorRole currentColor = ForegroundColor;
 	float strokeSize = 3.5;
+	int fillTolerance = 0; /// Per channel difference up to which the fill tool spreads
+	int pickSampleSize = 1; /// Side of the square averaged by the color picker (1, 3 or 5)
+	StrokeBackend strokeBackend = GpuStrokeBackend;
+	EraseMode eraseMode = BackgroundEraseMode;
+	SelectionShape selectionShape = RectangleSelection;
+	ResampleFilter resampleFilter = BicubicFilter; /// Used to resize the image
+	float textSize = 24; /// In canvas pixels
+	ShapeKind currentShape = LineShape;
+	bool isShapeOutlined = true; /// "Contour", with the foreground color
+	bool isShapeFilled = false; /// "Remplissage", with the background color
+	bool showUploadStats = false;
+	bool showLayoutStats = false;
+	bool showStrokeStats = false;
+
+	Clipboard clipboard;
+	Font font; /// Of the text tool
+	GlyphAtlas glyphAtlas;
+	/// Text being typed with the text tool, until it gets committed
+	TextLayer text;
+	bool isTyping = false;
+	/// Part of the document in view, in canvas pixels
+	::Rect visibleCanvasRect;
 
 	// UI state
 	bool isSizePopupOpened = false;
@@ -209,11 +739,134 @@ struct Editor {
 
 	// This is supposed to be a global editing state, not a place for pointers, but as for now this is the less dirty I can do
 	UiLayout *popupLayout = NULL;
+	DocumentArea *documentArea = NULL;
+	Document *document = NULL;
 };
 
 // TODO: get rid of this global (might require some kind of signals or passing a pointer to this global state to all the widgets)
 Editor *ed;
 
+/// Brush tools stamp dabs, other drawing tools draw plain lines
+inline bool IsBrushTool(Tool tool) {
+	switch (tool) {
+	case BrushTool:
+	case Calligraphy1BrushTool:
+	case Calligraphy2BrushTool:
+	case AirBrushTool:
+	case OilBrushTool:
+	case CrayonTool:
+	case MarkerBrushTool:
+	case NaturalPencilBrushTool:
+	case WatercolorBrushTool:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/// Dab parameters of each brush tool
+inline BrushSettings BrushSettingsForTool(Tool tool) {
+	BrushSettings s;
+	switch (tool) {
+	case Calligraphy1BrushTool:
+	case Calligraphy2BrushTool:
+		s.size = 3.0f;
+		s.roundness = 0.25f;
+		s.angle = tool == Calligraphy1BrushTool ? 0.785f : -0.785f;
+		s.spacing = 0.05f;
+		break;
+	case AirBrushTool:
+		// Many small dabs sprayed around the cursor
+		s.size = 0.4f;
+		s.jitter = 5.0f;
+		s.spacing = 0.1f;
+		s.flow = 0.6f;
+		s.isBuildUp = true;
+		break;
+	case OilBrushTool:
+		s.size = 3.0f;
+		s.hardness = 0.6f;
+		s.flow = 0.9f;
+		s.sizeJitter = 0.1f;
+		s.texture = 0.3f;
+		s.spacing = 0.05f;
+		break;
+	case CrayonTool:
+		s.size = 2.0f;
+		s.texture = 0.7f;
+		break;
+	case MarkerBrushTool:
+		s.tip = SquareBrushTip;
+		s.size = 3.0f;
+		s.flow = 0.6f;
+		s.spacing = 0.05f;
+		break;
+	case NaturalPencilBrushTool:
+		s.size = 1.0f;
+		s.flow = 0.8f;
+		s.texture = 0.5f;
+		break;
+	case WatercolorBrushTool:
+		s.size = 4.0f;
+		s.hardness = 0.1f;
+		s.flow = 0.15f;
+		s.jitter = 0.2f;
+		s.texture = 0.2f;
+		s.isBuildUp = true;
+		break;
+	case BrushTool:
+	default:
+		s.size = 2.0f;
+		s.hardness = 0.8f;
+		break;
+	}
+	return s;
+}
+
+/// Change the zoom, and the level of detail the document is displayed with
+inline void SetZoom(float zoom) {
+	ed->zoom = std::min(std::max(zoom, 1.0f / 64), 32.0f);
+	if (NULL != ed->document) {
+		ed->document->SetDisplayLevel(Document::LevelForZoom(ed->zoom));
+	}
+}
+
+inline Pixel ColorToPixel(const NVGcolor & color) {
+	return MakePixel(
+		(unsigned char)(color.r * 255.0f + 0.5f),
+		(unsigned char)(color.g * 255.0f + 0.5f),
+		(unsigned char)(color.b * 255.0f + 0.5f),
+		(unsigned char)(color.a * 255.0f + 0.5f)
+	);
+}
+
+inline NVGcolor PixelToColor(Pixel p) {
+	return nvgRGBA(PixelR(p), PixelG(p), PixelB(p), PixelA(p));
+}
+
+/// Copy the selection, and leave the background color in its place if cut
+void CopySelection(GLFWwindow *window, bool isCut) {
+	if (NULL == ed->document || !ed->document->HasSelection()) {
+		return;
+	}
+	if (isCut) {
+		ed->document->Cut(ed->clipboard, ColorToPixel(ed->backgroundColor));
+	} else {
+		ed->document->Copy(ed->clipboard);
+	}
+	OfferSystemClipboardImage(window, []() -> const std::vector<unsigned char> & {
+		return ed->clipboard.Dib();
+	});
+}
+
+/// Paste at the top left corner of the view, like MS Paint does
+void PasteClipboard() {
+	if (NULL == ed->document) {
+		return;
+	}
+	ed->document->Paste(ed->clipboard, std::max(ed->visibleCanvasRect.x, 0), std::max(ed->visibleCanvasRect.y, 0));
+}
+
 // Custom UI elements
 
 /// Add IsMouseOver() to UiMouseAwareElement
@@ -305,7 +958,7 @@ private:
 	std::string m_label;
 };
 
-class FileButton : public UiTabButton {
+class FileButton final : public UiTabButton {
 public:
 	FileButton()
 		: m_isFadingOut(false)
@@ -329,6 +982,7 @@ public: // protected
 				t = 1.0f;
 			}
 			SetBackgroundColor(nvgLerpRGBA(nvgRGB(41, 140, 225), nvgRGB(25, 121, 202), pow(t, 0.5)));
+			Invalidate();
 		}
 	}
 
@@ -351,6 +1005,7 @@ public: // protected
 	void OnMouseLeave() override {
 		m_isFadingOut = true;
 		m_fadingStartTime = glfwGetTime();
+		AnimationScheduler::Global().Start(this, m_fadingStartTime + m_fadingDuration);
 	}
 
 private:
@@ -359,7 +1014,7 @@ private:
 	const float m_fadingDuration; // in seconds
 };
 
-class HomeButton : public UiTabButton {
+class HomeButton final : public UiTabButton {
 public:
 	HomeButton() {
 		SetSizeHint(::Rect(0, 0, 64, 0));
@@ -384,7 +1039,7 @@ public:
 	}
 };
 
-class ViewButton : public UiTabButton {
+class ViewButton final : public UiTabButton {
 public:
 	ViewButton()
 		: m_isFadingOut(false)
@@ -408,6 +1063,7 @@ public: // protected
 				t = 1.0f;
 			}
 			SetBorderColor(nvgLerpRGBA(nvgRGB(235, 236, 236), nvgRGB(253, 253, 255), pow(t, 0.5)));
+			Invalidate();
 		}
 	}
 
@@ -439,6 +1095,7 @@ public: // protected
 	void OnMouseLeave() override {
 		m_isFadingOut = true;
 		m_fadingStartTime = glfwGetTime();
+		AnimationScheduler::Global().Start(this, m_fadingStartTime + m_fadingDuration);
 	}
 
 private:
@@ -447,7 +1104,7 @@ private:
 	const float m_fadingDuration; // in seconds
 };
 
-class ColorButton : public UiTrackMouseElement {
+class ColorButton final : public UiTrackMouseElement {
 public:
 	ColorButton()
 		: m_isEnabled(true)
@@ -503,7 +1160,7 @@ private:
 };
 
 /// Should inherit from ImageButton?
-class ToolButton : public UiDefaultButton {
+class ToolButton final : public UiDefaultButton {
 public:
 	~ToolButton() {
 		DeleteImage();
@@ -551,7 +1208,7 @@ private:
 	Image m_imageActive;
 };
 
-class MenuBar : public HBoxLayout {
+class MenuBar final : public HBoxLayout {
 public:
 	MenuBar() {
 		SetSizeHint(0, 0, 0, 24);
@@ -576,7 +1233,7 @@ public: // protected
 	}
 };
 
-class StatusBar : public HBoxLayout {
+class StatusBar final : public HBoxLayout {
 public:
 	StatusBar() {
 		SetSizeHint(0, 0, 0, 25);
@@ -636,6 +1293,15 @@ public: // protected
 		m_zoomOutImg.Paint(r.x + r.w - 143, r.y + 4);
 		m_zoomInImg.Paint(r.x + r.w - 21, r.y + 4);
 
+		if (NULL != ed->document && ed->document->HasSelection()) {
+			::Rect bounds = ed->document->Selection().Bounds();
+			std::string size = std::to_string(bounds.w) + " x " + std::to_string(bounds.h) + "px";
+			nvgFontSize(vg, 15);
+			nvgTextAlign(vg, NVG_ALIGN_LEFT);
+			nvgFillColor(vg, nvgRGB(60, 60, 60));
+			nvgText(vg, r.x + 159 + 24, r.y + 17, size.c_str(), NULL);
+		}
+
 		HBoxLayout::Paint(vg);
 	}
 
@@ -644,16 +1310,36 @@ private:
 };
 
 /// May not be a good idea to mix UI and paint stroke engine
-class DrawingArea : public UiMouseAwareElement {
+class DrawingArea final : public UiMouseAwareElement {
 public:
 	DrawingArea()
 		: UiMouseAwareElement()
 		, m_doc(NULL)
+		, m_frameBufferImage(-1)
 		, m_init(false)
 		, m_lastMouseX(0)
 		, m_lastMouseY(0)
 		, m_isStroking(false)
-	{}
+		, m_isBrushStroke(false)
+		, m_isEraseStroke(false)
+		, m_isSelecting(false)
+		, m_isSelectionReplaced(true)
+		, m_selectionOp(UnionSelectionOp)
+		, m_brushStrokeCount(0)
+		, m_pickedColor(0)
+		, m_isTextEditing(false)
+		, m_textRevision(0)
+		, m_isShapeEditing(false)
+		, m_isShapeDragged(false)
+		, m_isShapeChanged(false)
+		, m_flushedPointCount(0)
+		, m_segmentCount(0)
+		, m_flushCount(0)
+		, m_lastFlushSegmentCount(0)
+	{
+		// Strokes, typing, edits and scrolling all follow input events
+		AnimationScheduler::Global().Listen(this);
+	}
 
 	~DrawingArea() {
 		if (m_init) {
@@ -667,12 +1353,83 @@ public:
 	void SetStrokeEngine(struct NVGcontext* vg) { m_vg = vg; }
 
 	Document * Document() const { return m_doc; }
-	void SetDocument(::Document *doc) { m_doc = doc; }
+	void SetDocument(::Document *doc) {
+		m_doc = doc;
+		// For its first upload
+		AnimationScheduler::Global().Start(this);
+	}
+
+	/**
+	 * Leave the text being typed, or the shape being drawn, in the
+	 * document. Their history step stays open until then, so call this
+	 * before anything else edits the document.
+	 */
+	void CommitEdits() {
+		CommitText();
+		CommitShape();
+	}
+
+	/// Number of segments drawn by the last flush of the stroke engine
+	int LastFlushSegmentCount() const { return m_lastFlushSegmentCount; }
+
+	/// Part of the window through which the drawing is seen
+	void SetViewport(const ::Rect & viewport) {
+		if (viewport != m_viewport) {
+			m_viewport = viewport;
+			// Tiles coming into view need uploading
+			AnimationScheduler::Global().Start(this);
+		}
+	}
+	const ::Rect & Viewport() const { return m_viewport; }
+
+	/// Part of the canvas that is seen through the viewport, in canvas pixels
+	::Rect VisibleCanvasRect() const {
+		const ::Rect & r = InnerRect();
+		::Rect visible = r.Intersected(m_viewport);
+		if (visible.IsEmpty()) {
+			return ::Rect();
+		}
+		int x0 = (int)floor((visible.x - r.x) / ed->zoom);
+		int y0 = (int)floor((visible.y - r.y) / ed->zoom);
+		int x1 = (int)ceil((visible.x + visible.w - r.x) / ed->zoom);
+		int y1 = (int)ceil((visible.y + visible.h - r.y) / ed->zoom);
+		return ::Rect(x0, y0, x1 - x0, y1 - y0);
+	}
 
 public: // protected
+	void Update() override {
+		// Zooming and scrolling bring other tiles into view
+		AnimationScheduler::Global().Start(this);
+	}
+
 	void OnMouseOver(int x, int y) override {
+		if (ed->currentTool == PickTool && NULL != Document()) {
+			// Served from the CPU canvas, so it never waits for the GPU
+			m_pickedColor = Pick(x, y);
+			Damage(PickPreviewRect());
+			Damage(PickPreviewRect(x, y));
+		}
+		if (m_isShapeDragged) {
+			const ::Rect & r = InnerRect();
+			StrokePoint point = { (x - r.x) / ed->zoom, (y - r.y) / ed->zoom };
+			m_shape.MoveLastPoint(point);
+			m_isShapeChanged = true;
+		}
+		if (m_isSelecting) {
+			const ::Rect & r = InnerRect();
+			StrokePoint point = { (x - r.x) / ed->zoom, (y - r.y) / ed->zoom };
+			Damage(SelectionPreviewRect());
+			if (ed->selectionShape == RectangleSelection) {
+				m_selectionPoints.resize(1);
+			}
+			m_selectionPoints.push_back(point);
+			Damage(SelectionPreviewRect());
+		}
 		if (m_isStroking) {
-			Stroke(m_lastMouseX, m_lastMouseY, x, y);
+			// Segments are only drawn once per frame, in OnTick()
+			const ::Rect & r = InnerRect();
+			StrokePoint point = { (x - r.x) / ed->zoom, (y - r.y) / ed->zoom };
+			m_strokePoints.push_back(point);
 		}
 
 		m_lastMouseX = x;
@@ -680,28 +1437,141 @@ public: // protected
 	}
 
 	void OnMouseClick(int button, int action, int mods) override {
+		if (action == GLFW_PRESS && ed->currentTool != TextTool) {
+			CommitText();
+		}
+		if (action == GLFW_PRESS && ed->currentTool != ShapeTool) {
+			CommitShape();
+		}
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && ed->currentTool == TextTool) {
+			BeginText();
+			return;
+		}
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && ed->currentTool == ShapeTool) {
+			PressShape();
+			return;
+		}
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE && m_isShapeDragged) {
+			m_isShapeDragged = false;
+			// Polygons get more vertices until closed
+			if (m_shape.Kind() != PolygonShape) {
+				CommitShape();
+			}
+			return;
+		}
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && ed->currentTool == FillTool) {
+			Fill();
+			return;
+		}
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && ed->currentTool == SelectTool) {
+			BeginSelection(mods);
+			return;
+		}
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE && m_isSelecting) {
+			EndSelection();
+			return;
+		}
+		if (action == GLFW_PRESS && ed->currentTool == PickTool) {
+			m_pickedColor = Pick(m_lastMouseX, m_lastMouseY);
+			if (button == GLFW_MOUSE_BUTTON_LEFT) {
+				ed->foregroundColor = PixelToColor(m_pickedColor);
+			} else if (button == GLFW_MOUSE_BUTTON_RIGHT) {
+				ed->backgroundColor = PixelToColor(m_pickedColor);
+			}
+			return;
+		}
 		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
 			m_isStroking = true;
+			Document()->BeginEdit();
+			const ::Rect & r = InnerRect();
+			StrokePoint point = { (m_lastMouseX - r.x) / ed->zoom, (m_lastMouseY - r.y) / ed->zoom };
+			m_strokePoints.assign(1, point);
+			// One more pixel, as StrokeGpu() includes the far edges of areas
+			m_strokeGrid.Reset(::Rect(0, 0, Document()->Width() + 1, Document()->Height() + 1), ed->strokeSize / 2 + 1);
+			m_flushedPointCount = 1;
+			m_segmentCount = 0;
+			m_flushCount = 0;
+			m_isBrushStroke = IsBrushTool(ed->currentTool);
+			m_isEraseStroke = ed->currentTool == EraseTool;
+			if (m_isBrushStroke) {
+				m_brushSettings = BrushSettingsForTool(ed->currentTool);
+				m_brush.BeginStroke(++m_brushStrokeCount);
+				// A null segment, so that a single click stamps a dab
+				m_strokePoints.push_back(point);
+			}
+			m_rasterizer.BeginStroke();
+			m_snapshot.Clear();
 		}
-		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE) {
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE && m_isStroking) {
+			FlushStroke();
 			m_isStroking = false;
+			m_strokePoints.clear();
+			m_rasterizer.EndStroke();
+			m_brush.EndStroke();
+			m_snapshot.Clear();
+			Document()->EndEdit();
+			if (ed->showStrokeStats && m_flushCount > 0) {
+				std::cout << "Stroke: " << m_segmentCount << " segments in " << m_flushCount << " flushes ("
+					<< (float)m_segmentCount / m_flushCount << " segments per flush)" << std::endl;
+			}
+		}
+	}
+
+	void OnTick() override {
+		FlushStroke();
+		if (m_isTextEditing && (!ed->isTyping || ed->currentTool != TextTool)) {
+			CommitText();
+		}
+		UpdateText();
+		if (m_isShapeEditing && (ed->currentTool != ShapeTool || ed->currentShape != m_shape.Kind())) {
+			CommitShape();
+		}
+		UpdateShape();
+		ed->visibleCanvasRect = VisibleCanvasRect();
+		if (NULL != Document()) {
+			Document()->Upload(VisibleCanvasRect());
+			if (ed->showUploadStats && Document()->LastUploadByteSize() > 0) {
+				std::cout << "Upload: " << Document()->LastUploadByteSize() << " bytes, "
+					<< Document()->PendingUploadCount() << " tiles pending" << std::endl;
+			}
+			// Only what changed in the displayed image gets repainted
+			Damage(WindowRect(Document()->TakeDamage()));
+			// Tiles over the budget wait for the next frames
+			if (Document()->LastUploadByteSize() > 0) {
+				AnimationScheduler::Global().Start(this);
+			}
 		}
 	}
 
 	void Paint(NVGcontext *vg) const override {
+		// Only the visible part gets drawn
 		const ::Rect & r = InnerRect();
+		::Rect visible = r.Intersected(m_viewport);
 		nvgBeginPath(vg);
-		nvgRect(vg, r.x, r.y, r.w, r.h);
+		nvgRect(vg, visible.x, visible.y, visible.w, visible.h);
 		nvgFillColor(vg, nvgRGB(255, 255, 255));
 		nvgFill(vg);
 
 		if (NULL != Document()) {
-			Document()->Img().Paint(r.x, r.y, r.w, r.h);
+			// Zoomed out views show a downsampled level of the document
+			float scale = ed->zoom * (1 << Document()->DisplayLevel());
+			Document()->DisplayImg().Paint(r.x, r.y, scale, visible);
 		}
-	}
 
-	void Update() override {
-		UpdateStrokeEngine();
+		PaintSelection(vg);
+		PaintText(vg);
+		PaintShape(vg);
+
+		if (ed->currentTool == PickTool && r.Contains((int)m_lastMouseX, (int)m_lastMouseY)) {
+			// Preview of the color under the cursor, within PickPreviewRect()
+			nvgBeginPath(vg);
+			nvgRect(vg, m_lastMouseX + 12.5f, m_lastMouseY + 12.5f, 16, 16);
+			nvgFillColor(vg, PixelToColor(m_pickedColor));
+			nvgFill(vg);
+			nvgStrokeColor(vg, nvgRGB(0, 0, 0));
+			nvgStrokeWidth(vg, 1);
+			nvgStroke(vg);
+		}
 	}
 
 private:
@@ -715,77 +1585,543 @@ private:
 	}
 
 	void UpdateStrokeEngine() {
+		if (m_init) {
+			glDeleteFramebuffers(1, &m_frameBuffer);
+		}
 		glGenFramebuffers(1, &m_frameBuffer);
 		glBindFramebuffer(GL_FRAMEBUFFER, m_frameBuffer);
 
-		GLuint tex = nvglImageHandleGLES3(m_vg, Document()->Img().Handle());
+		m_frameBufferImage = Document()->Img().Handle();
+		GLuint tex = nvglImageHandleGLES3(m_vg, m_frameBufferImage);
 		glBindTexture(GL_TEXTURE_2D, tex);
 		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
 
 		if (m_init) {
 			glDeleteRenderbuffers(1, &m_stencilBuffer);
 		}
-		glGenRenderbuffers(1, &m_stencilBuffer);
-		glBindRenderbuffer(GL_RENDERBUFFER, m_stencilBuffer);
-		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, Document()->Width(), Document()->Height());
-		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_stencilBuffer);
+		glGenRenderbuffers(1, &m_stencilBuffer);
+		glBindRenderbuffer(GL_RENDERBUFFER, m_stencilBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, Document()->Img().Width(), Document()->Img().Height());
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_stencilBuffer);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	/**
+	 * Window area where rect r of the canvas is displayed, with some margin
+	 * for the outlines drawn over it, and that can be seen through the
+	 * viewport.
+	 */
+	::Rect WindowRect(const ::Rect & r) const {
+		if (r.IsEmpty()) {
+			return ::Rect();
+		}
+		const ::Rect & inner = InnerRect();
+		int x0 = inner.x + (int)floor(r.x * ed->zoom);
+		int y0 = inner.y + (int)floor(r.y * ed->zoom);
+		int x1 = inner.x + (int)ceil((r.x + r.w) * ed->zoom);
+		int y1 = inner.y + (int)ceil((r.y + r.h) * ed->zoom);
+		return ::Rect(x0, y0, x1 - x0, y1 - y0).Grown(PaintOverflow).Intersected(m_viewport);
+	}
+
+	/// Window area of the color preview of the pick tool, next to the mouse
+	::Rect PickPreviewRect(float x, float y) const {
+		return ::Rect((int)floor(x) + 12, (int)floor(y) + 12, 18, 18).Grown(PaintOverflow);
+	}
+	::Rect PickPreviewRect() const {
+		return PickPreviewRect(m_lastMouseX, m_lastMouseY);
+	}
+
+	/// Window area of the outline of the selection being drawn
+	::Rect SelectionPreviewRect() const {
+		if (m_selectionPoints.empty()) {
+			return ::Rect();
+		}
+		float minX = m_selectionPoints[0].x, maxX = minX, minY = m_selectionPoints[0].y, maxY = minY;
+		for (const StrokePoint & p : m_selectionPoints) {
+			minX = std::min(minX, p.x); maxX = std::max(maxX, p.x);
+			minY = std::min(minY, p.y); maxY = std::max(maxY, p.y);
+		}
+		int x0 = (int)floor(minX), y0 = (int)floor(minY);
+		return WindowRect(::Rect(x0, y0, (int)ceil(maxX) - x0 + 1, (int)ceil(maxY) - y0 + 1));
+	}
+
+	/// Color of the document under window position (x, y), averaged over
+	/// ed->pickSampleSize pixels wide
+	Pixel Pick(float x, float y) const {
+		const ::Rect & r = InnerRect();
+		int px = (int)floor((x - r.x) / ed->zoom);
+		int py = (int)floor((y - r.y) / ed->zoom);
+		int radius = std::max(ed->pickSampleSize, 1) / 2;
+		return Document()->Canvas().AveragePixel(::Rect(px - radius, py - radius, 2 * radius + 1, 2 * radius + 1));
+	}
+
+	/**
+	 * Start selecting. Shift adds to the current selection, Alt removes from
+	 * it and both keep their intersection, otherwise it gets replaced.
+	 */
+	void BeginSelection(int mods) {
+		bool isAdding = (mods & GLFW_MOD_SHIFT) != 0;
+		bool isRemoving = (mods & GLFW_MOD_ALT) != 0;
+		m_isSelectionReplaced = !isAdding && !isRemoving;
+		m_selectionOp = isAdding && isRemoving ? IntersectSelectionOp : isRemoving ? SubtractSelectionOp : UnionSelectionOp;
+
+		const ::Rect & r = InnerRect();
+		StrokePoint point = { (m_lastMouseX - r.x) / ed->zoom, (m_lastMouseY - r.y) / ed->zoom };
+		if (ed->selectionShape == MagicWandSelection) {
+			// Same search as the fill tool, but only keeping the region
+			m_floodFill.Find(Document()->Canvas(), (int)floor(point.x), (int)floor(point.y), ed->fillTolerance);
+			SelectionBuilder builder;
+			m_floodFill.ForEachRun([&](int y, int x0, int x1) {
+				builder.AddRun(y, x0, x1);
+			});
+			ApplySelection(builder.Finish());
+			return;
+		}
+		m_isSelecting = true;
+		m_selectionPoints.assign(1, point);
+	}
+
+	void EndSelection() {
+		m_isSelecting = false;
+		Damage(SelectionPreviewRect());
+		::Selection shape;
+		if (ed->selectionShape == FreeFormSelection) {
+			shape = ::Selection::FromPolygon(m_selectionPoints);
+		} else if (m_selectionPoints.size() > 1) {
+			const StrokePoint & a = m_selectionPoints.front();
+			const StrokePoint & b = m_selectionPoints.back();
+			int x0 = (int)floor(std::min(a.x, b.x) + 0.5f), x1 = (int)floor(std::max(a.x, b.x) + 0.5f);
+			int y0 = (int)floor(std::min(a.y, b.y) + 0.5f), y1 = (int)floor(std::max(a.y, b.y) + 0.5f);
+			shape = ::Selection::FromRect(::Rect(x0, y0, x1 - x0, y1 - y0));
+		}
+		m_selectionPoints.clear();
+		ApplySelection(shape);
+	}
+
+	void ApplySelection(const ::Selection & shape) {
+		::Selection canvasShape = shape.Intersected(::Selection::FromRect(::Rect(0, 0, Document()->Width(), Document()->Height())));
+		if (m_isSelectionReplaced) {
+			Document()->SetSelection(canvasShape);
+		} else {
+			Document()->SetSelection(Document()->Selection().Combined(canvasShape, m_selectionOp));
+		}
+	}
+
+	/// Outline of the selection, and of the one being drawn
+	void PaintSelection(NVGcontext *vg) const {
+		const ::Rect & r = InnerRect();
+		float zoom = ed->zoom;
+		::Rect visible = VisibleCanvasRect();
+		nvgBeginPath(vg);
+		Document()->Selection().ForEachEdge([&](int x0, int y0, int x1, int y1) {
+			if (std::max(x0, x1) < visible.x || std::min(x0, x1) > visible.x + visible.w
+				|| std::max(y0, y1) < visible.y || std::min(y0, y1) > visible.y + visible.h) {
+				return;
+			}
+			nvgMoveTo(vg, r.x + x0 * zoom + 0.5f, r.y + y0 * zoom + 0.5f);
+			nvgLineTo(vg, r.x + x1 * zoom + 0.5f, r.y + y1 * zoom + 0.5f);
+		});
+		if (m_isSelecting && !m_selectionPoints.empty()) {
+			const StrokePoint & a = m_selectionPoints.front();
+			const StrokePoint & b = m_selectionPoints.back();
+			if (ed->selectionShape == RectangleSelection) {
+				nvgRect(vg, r.x + std::min(a.x, b.x) * zoom + 0.5f, r.y + std::min(a.y, b.y) * zoom + 0.5f, fabs(b.x - a.x) * zoom, fabs(b.y - a.y) * zoom);
+			} else {
+				nvgMoveTo(vg, r.x + a.x * zoom, r.y + a.y * zoom);
+				for (const StrokePoint & p : m_selectionPoints) {
+					nvgLineTo(vg, r.x + p.x * zoom, r.y + p.y * zoom);
+				}
+			}
+		}
+		StrokeOverlay(vg);
+	}
+
+	/// Start typing at the mouse position, after committing the text being typed
+	void BeginText() {
+		CommitText();
+		const ::Rect & r = InnerRect();
+		float x = floor((m_lastMouseX - r.x) / ed->zoom);
+		float y = floor((m_lastMouseY - r.y) / ed->zoom);
+		ed->text.Reset(&ed->font, ed->textSize, ColorToPixel(ed->foregroundColor), x, y);
+		ed->isTyping = true;
+		m_isTextEditing = true;
+		m_textRevision = ed->text.Revision() - 1;
+		m_textBounds = ::Rect();
+		Document()->BeginEdit();
+		m_snapshot.Clear();
+	}
+
+	/**
+	 * Draw the text again after it changed, over the pixels that were there
+	 * before typing began, as the GPU stroke engine does. Glyphs come from
+	 * the atlas, so only the ones that were never drawn get rasterized.
+	 */
+	void UpdateText() {
+		if (!m_isTextEditing || ed->text.Revision() == m_textRevision) {
+			return;
+		}
+		m_textRevision = ed->text.Revision();
+		::Rect bounds = ed->text.Bounds();
+		::Rect area = m_textBounds.United(bounds).Intersected(::Rect(0, 0, Document()->Width(), Document()->Height()));
+		Document()->Damage(m_textBounds.United(bounds));
+		m_textBounds = bounds;
+		if (area.IsEmpty()) {
+			return;
+		}
+
+		RestoreSnapshot(area);
+		ed->text.Render(Document()->Canvas(), ed->glyphAtlas, area);
+		Document()->Clip(area);
+		Document()->Invalidate(area);
+	}
+
+	/// Put pixels of area back as they were when m_snapshot was cleared
+	void RestoreSnapshot(const ::Rect & area) {
+		TiledCanvas & canvas = Document()->Canvas();
+		m_snapshot.Touch(canvas, area);
+		m_restoreBuffer.resize(area.w * area.h);
+		m_snapshot.ReadRect(canvas, area, m_restoreBuffer.data(), area.w);
+		Document()->Touch(area);
+		canvas.WriteRect(area, m_restoreBuffer.data(), area.w);
+	}
+
+	/// Leave the text in the document, as a single step of the history
+	void CommitText() {
+		if (!m_isTextEditing) {
+			return;
+		}
+		UpdateText();
+		m_isTextEditing = false;
+		ed->isTyping = false;
+		m_snapshot.Clear();
+		Document()->EndEdit();
+		Document()->Damage(m_textBounds);
+	}
+
+	/// Box around the text being typed, and its caret
+	void PaintText(NVGcontext *vg) const {
+		if (!m_isTextEditing) {
+			return;
+		}
+		const ::Rect & r = InnerRect();
+		float zoom = ed->zoom;
+		float x, y, height;
+		ed->text.Caret(x, y, height);
+		nvgBeginPath(vg);
+		nvgRect(vg, r.x + m_textBounds.x * zoom + 0.5f, r.y + m_textBounds.y * zoom + 0.5f, m_textBounds.w * zoom, m_textBounds.h * zoom);
+		nvgMoveTo(vg, r.x + x * zoom + 0.5f, r.y + y * zoom);
+		nvgLineTo(vg, r.x + x * zoom + 0.5f, r.y + (y + height) * zoom);
+		StrokeOverlay(vg);
+	}
+
+	/**
+	 * Start a shape at the mouse position, or add a vertex to the polygon
+	 * being drawn. Clicking again where the last vertex is, or on the first
+	 * one, closes the polygon.
+	 */
+	void PressShape() {
+		const ::Rect & r = InnerRect();
+		StrokePoint point = { (m_lastMouseX - r.x) / ed->zoom, (m_lastMouseY - r.y) / ed->zoom };
+		if (m_isShapeEditing && m_shape.Kind() == PolygonShape) {
+			const std::vector<StrokePoint> & points = m_shape.Points();
+			float tolerance = 4 / ed->zoom;
+			for (const StrokePoint & end : { points.front(), points.back() }) {
+				if (fabs(end.x - point.x) <= tolerance && fabs(end.y - point.y) <= tolerance) {
+					CommitShape();
+					return;
+				}
+			}
+			m_shape.AddPoint(point);
+		} else {
+			CommitText();
+			CommitShape();
+			ShapeStyle style;
+			style.width = ed->strokeSize;
+			style.isOutlined = ed->isShapeOutlined;
+			style.isFilled = ed->isShapeFilled;
+			style.outlineColor = ColorToPixel(ed->foregroundColor);
+			style.fillColor = ColorToPixel(ed->backgroundColor);
+			m_shape.Reset(ed->currentShape, style, point);
+			m_isShapeEditing = true;
+			m_shapeBounds = ::Rect();
+			Document()->BeginEdit();
+			m_snapshot.Clear();
+		}
+		m_isShapeDragged = true;
+		m_isShapeChanged = true;
+	}
+
+	/**
+	 * Draw the shape again after it changed. Only the union of its old and
+	 * new bounds gets restored and redrawn, so the cost follows the size of
+	 * the shape rather than the one of the canvas.
+	 */
+	void UpdateShape() {
+		if (!m_isShapeEditing || !m_isShapeChanged) {
+			return;
+		}
+		m_isShapeChanged = false;
+		::Rect bounds = m_shape.Bounds();
+		::Rect area = m_shapeBounds.United(bounds).Intersected(::Rect(0, 0, Document()->Width(), Document()->Height()));
+		Document()->Damage(m_shapeBounds.United(bounds));
+		m_shapeBounds = bounds;
+		if (area.IsEmpty()) {
+			return;
+		}
+		RestoreSnapshot(area);
+		m_shape.Render(Document()->Canvas(), m_rasterizer);
+		Document()->Clip(area);
+		Document()->Invalidate(area);
+	}
+
+	/// Leave the shape in the document, as a single step of the history
+	void CommitShape() {
+		if (!m_isShapeEditing) {
+			return;
+		}
+		UpdateShape();
+		m_isShapeEditing = false;
+		m_isShapeDragged = false;
+		m_snapshot.Clear();
+		Document()->EndEdit();
+		Document()->Damage(m_shapeBounds);
+	}
+
+	/// Box around the shape being drawn
+	void PaintShape(NVGcontext *vg) const {
+		if (!m_isShapeEditing) {
+			return;
+		}
+		const ::Rect & r = InnerRect();
+		float zoom = ed->zoom;
+		nvgBeginPath(vg);
+		nvgRect(vg, r.x + m_shapeBounds.x * zoom + 0.5f, r.y + m_shapeBounds.y * zoom + 0.5f, m_shapeBounds.w * zoom, m_shapeBounds.h * zoom);
+		StrokeOverlay(vg);
+	}
+
+	/// Stroke the current path so that it is visible over both dark and
+	/// light pixels
+	static void StrokeOverlay(NVGcontext *vg) {
+		nvgStrokeColor(vg, nvgRGB(255, 255, 255));
+		nvgStrokeWidth(vg, 3);
+		nvgStroke(vg);
+		nvgStrokeColor(vg, nvgRGB(0, 120, 215));
+		nvgStrokeWidth(vg, 1);
+		nvgStroke(vg);
+	}
+
+	/// Bucket fill from the pixel under the mouse, on the CPU canvas.
+	/// Only the bounding box of the filled region gets uploaded back.
+	void Fill() {
+		const ::Rect & r = InnerRect();
+		int x = (int)floor((m_lastMouseX - r.x) / ed->zoom);
+		int y = (int)floor((m_lastMouseY - r.y) / ed->zoom);
+		TiledCanvas & canvas = Document()->Canvas();
+		::Rect bounds = m_floodFill.Find(canvas, x, y, ed->fillTolerance);
+		if (bounds.IsEmpty()) {
+			return;
+		}
+		Document()->BeginEdit();
+		Document()->Touch(bounds);
+		m_floodFill.Fill(canvas, ColorToPixel(ed->foregroundColor));
+		Document()->Clip(bounds);
+		Document()->EndEdit();
+		Document()->Invalidate(bounds);
+	}
+
+	/// Draw segments queued since last flush, as a single polyline
+	void FlushStroke() {
+		if (m_strokePoints.size() <= m_flushedPointCount) {
+			return;
+		}
+		size_t firstPoint = m_flushedPointCount - 1;
+		m_lastFlushSegmentCount = (int)(m_strokePoints.size() - m_flushedPointCount);
+		m_segmentCount += m_lastFlushSegmentCount;
+		++m_flushCount;
+
+		std::vector<StrokeSegment> segments(m_lastFlushSegmentCount);
+		for (size_t i = 0; i < segments.size(); ++i) {
+			segments[i].x0 = m_strokePoints[firstPoint + i].x;
+			segments[i].y0 = m_strokePoints[firstPoint + i].y;
+			segments[i].x1 = m_strokePoints[firstPoint + i + 1].x;
+			segments[i].y1 = m_strokePoints[firstPoint + i + 1].y;
+		}
+		if (m_isBrushStroke) {
+			// Brushes only have a CPU implementation
+			::Rect bounds = BrushEngine::Bounds(segments, ed->strokeSize, m_brushSettings);
+			Document()->Touch(bounds);
+			m_brush.Stroke(Document()->Canvas(), segments, ed->strokeSize, ColorToPixel(ed->foregroundColor), m_brushSettings);
+			Document()->Clip(bounds);
+			Document()->Invalidate(bounds);
+			m_flushedPointCount = m_strokePoints.size();
+			return;
+		}
+
+		::Rect bounds = StrokeRasterizer::Bounds(segments, ed->strokeSize);
+
+		if (m_isEraseStroke) {
+			// Only the bounds of the new segments are touched, and tiles
+			// that end up all erased go back to uniform or blank storage
+			Document()->Touch(bounds);
+			if (ed->eraseMode == AlphaEraseMode) {
+				m_rasterizer.Erase(Document()->Canvas(), segments, ed->strokeSize);
+			} else {
+				m_rasterizer.Stroke(Document()->Canvas(), segments, ed->strokeSize, ColorToPixel(ed->backgroundColor));
+			}
+			Document()->Clip(bounds);
+			Document()->Canvas().Compact(bounds);
+			Document()->Invalidate(bounds);
+		} else if (ed->strokeBackend == CpuStrokeBackend) {
+			Document()->Touch(bounds);
+			m_rasterizer.Stroke(Document()->Canvas(), segments, ed->strokeSize, ColorToPixel(ed->foregroundColor));
+			Document()->Clip(bounds);
+			Document()->Invalidate(bounds);
+		} else {
+			StrokeGpu(bounds);
+			if (Document()->HasSelection()) {
+				// The image got the unclipped stroke
+				Document()->Clip(bounds);
+				Document()->Invalidate(bounds);
+			}
+		}
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		m_flushedPointCount = m_strokePoints.size();
 	}
 
-	void Stroke(float startX, float startY, float endX, float endY) {
-		if (!m_init) {
+	/**
+	 * Pixels of bounds are put back as they were before the stroke, then the
+	 * whole stroke is drawn over them as a single path. This way, the stroke
+	 * color is blended only once, even where segments of different flushes
+	 * overlap.
+	 */
+	void StrokeGpu(const ::Rect & bounds) {
+		::Rect area = bounds.Intersected(::Rect(0, 0, Document()->Width(), Document()->Height()));
+		if (area.IsEmpty()) {
+			return;
+		}
+		// The GPU stroke engine is only set up once first used, and again
+		// when the document reallocates its image
+		if (!m_init || m_frameBufferImage != Document()->Img().Handle()) {
 			InitStrokeEngine();
 		}
 
-		const ::Rect & r = InnerRect();
-		int fbWidth = 1024, fbHeight = 1024;
+		RestoreSnapshot(area);
+		Document()->UploadNow(area);
 
+		// Everything is restricted to the area: the viewport clips rendering
+		// and blending, and the scissor test limits the clear.
+		// Framebuffer rows are image rows, so y is flipped for NanoVG.
 		glBindFramebuffer(GL_FRAMEBUFFER, m_frameBuffer);
+		glViewport(area.x, area.y, area.w, area.h);
 
-		glViewport(0, 0, fbWidth, fbHeight);
-
-		// Render
-		// Clear the colorbuffer
-		glClearColor(0.2f, 0.3f, 0.8f, 1.0f);
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(area.x, area.y, area.w, area.h);
 		glClear(GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
 
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 		glEnable(GL_CULL_FACE);
 		glDisable(GL_DEPTH_TEST);
 
-		nvgBeginFrame(m_vg, fbWidth, fbHeight, 1.0f);
+		nvgBeginFrame(m_vg, area.w, area.h, 1.0f);
 		nvgSave(m_vg);
-		nvgTranslate(m_vg, 0, 1024);
+		nvgTranslate(m_vg, -area.x, area.y + area.h);
 		nvgScale(m_vg, 1, -1);
 
+		// Only segments reaching the area are needed, as sub-paths. They are
+		// looked up in the grid, where the segments added since the last
+		// flush get indexed first, so a flush does not go through the whole
+		// stroke.
+		for (size_t i = m_strokeGrid.Count(); i + 1 < m_strokePoints.size(); ++i) {
+			m_strokeGrid.Add(m_strokePoints[i], m_strokePoints[i + 1]);
+		}
+		// The test below includes the far edges of the area
+		m_strokeGrid.Query(::Rect(area.x, area.y, area.w + 1, area.h + 1), m_strokeSegmentIndices);
+		float margin = m_strokeGrid.Margin();
+		bool isSubPathOpen = false;
+		size_t previous = 0;
 		nvgBeginPath(m_vg);
-		nvgMoveTo(m_vg, startX - r.x, startY - r.y);
-		nvgLineTo(m_vg, endX - r.x, endY - r.y);
+		for (uint32_t i : m_strokeSegmentIndices) {
+			const StrokePoint & a = m_strokePoints[i];
+			const StrokePoint & b = m_strokePoints[i + 1];
+			bool reachesArea =
+				std::max(a.x, b.x) + margin >= area.x && std::min(a.x, b.x) - margin <= area.x + area.w &&
+				std::max(a.y, b.y) + margin >= area.y && std::min(a.y, b.y) - margin <= area.y + area.h;
+			if (!reachesArea) {
+				isSubPathOpen = false;
+				continue;
+			}
+			if (!isSubPathOpen || i != previous + 1) {
+				nvgMoveTo(m_vg, a.x, a.y);
+				isSubPathOpen = true;
+			}
+			nvgLineTo(m_vg, b.x, b.y);
+			previous = i;
+		}
 		nvgStrokeColor(m_vg, ed->foregroundColor);
 		nvgStrokeWidth(m_vg, ed->strokeSize);
 		nvgLineCap(m_vg, NVG_ROUND);
+		nvgLineJoin(m_vg, NVG_ROUND);
 		nvgStroke(m_vg);
 
 		nvgRestore(m_vg);
 		nvgEndFrame(m_vg);
 
+		// Keep the canvas in sync with what has just been drawn
+		Document()->ReadBack(area);
+
 		// restore framebuffer
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
 private:
 	::Document *m_doc;
+	::Rect m_viewport;
 	GLuint m_frameBuffer;
 	GLuint m_stencilBuffer;
+	int m_frameBufferImage; /// Document image attached to m_frameBuffer
 	bool m_init;
 	struct NVGcontext *m_vg;
+	StrokeRasterizer m_rasterizer;
+	BrushEngine m_brush;
+	FloodFill m_floodFill;
 	float m_lastMouseX, m_lastMouseY;
 	bool m_isStroking;
+	bool m_isBrushStroke;
+	bool m_isEraseStroke;
+	bool m_isSelecting;
+	bool m_isSelectionReplaced;
+	SelectionOp m_selectionOp; /// How the new shape combines with the selection, when not replaced
+	/// Points of the selection being drawn, in canvas pixels
+	std::vector<StrokePoint> m_selectionPoints;
+	BrushSettings m_brushSettings;
+	uint32_t m_brushStrokeCount; /// Seeds random brushes
+	Pixel m_pickedColor; /// Color under the mouse, with the pick tool
+	bool m_isTextEditing; /// The edit of the text being typed is still open
+	int m_textRevision; /// Revision of the text last drawn
+	::Rect m_textBounds; /// Area of the text last drawn
+	/// Shape being drawn with the shape tool, until committed
+	Shape m_shape;
+	bool m_isShapeEditing; /// The edit of the shape is still open
+	bool m_isShapeDragged; /// Its last point follows the mouse
+	bool m_isShapeChanged; /// It needs to be drawn again
+	::Rect m_shapeBounds; /// Area of the shape last drawn
+	/// Points of the current stroke, the first m_flushedPointCount are drawn already
+	std::vector<StrokePoint> m_strokePoints;
+	SegmentGrid m_strokeGrid; /// Of m_strokePoints, for the GPU stroke engine
+	std::vector<uint32_t> m_strokeSegmentIndices;
+	size_t m_flushedPointCount;
+	/// Canvas before the stroke, for the GPU engine to redraw strokes over it,
+	/// or before typing or drawing a shape, for them to be drawn again
+	CanvasSnapshot m_snapshot;
+	std::vector<Pixel> m_restoreBuffer;
+	// Batching statistics of the current stroke
+	int m_segmentCount, m_flushCount, m_lastFlushSegmentCount;
 };
 
-class DocumentArea : public UiMouseAwareElement {
+class DocumentArea final : public UiMouseAwareElement {
 public:
 	DocumentArea()
 		: UiMouseAwareElement()
@@ -793,10 +2129,21 @@ public:
 		, m_drawingArea(NULL)
 		, m_isResizingWidth(false)
 		, m_isResizingHeight(false)
+		, m_isPanning(false)
 		, m_mouseX(0)
 		, m_mouseY(0)
+		, m_scrollX(0)
+		, m_scrollY(0)
+		, m_contentWidth(0)
+		, m_contentHeight(0)
+		, m_layoutWidth(0)
+		, m_layoutHeight(0)
+		, m_layoutZoom(0)
 	{
 		m_drawingArea = new DrawingArea();
+		m_drawingArea->SetParent(this);
+		// Checks after each input whether the document got resized
+		AnimationScheduler::Global().Listen(this);
 	}
 
 	~DocumentArea() {
@@ -811,6 +2158,14 @@ public:
 		if (NULL != m_drawingArea) {
 			m_drawingArea->SetDocument(doc);
 		}
+		InvalidateLayout();
+	}
+
+	/// See DrawingArea::CommitEdits()
+	void CommitEdits() {
+		if (NULL != m_drawingArea) {
+			m_drawingArea->CommitEdits();
+		}
 	}
 
 	struct NVGcontext* StrokeEngine() { return m_drawingArea == NULL ? NULL : m_drawingArea->StrokeEngine(); }
@@ -822,6 +2177,11 @@ public:
 
 public: // protected
 	void OnMouseOver(int x, int y) override {
+		if (m_isPanning) {
+			m_scrollX -= x - m_mouseX;
+			m_scrollY -= y - m_mouseY;
+			Update();
+		}
 		m_mouseX = x;
 		m_mouseY = y;
 
@@ -831,14 +2191,28 @@ public: // protected
 		if (m_isResizingHeight) {
 			m_rubberBand.h = m_startDeltaY + m_mouseY;
 		}
-		if (!(m_isResizingWidth || m_isResizingHeight)) {
-			if (m_drawingArea->Rect().Contains(x, y)) {
+		if (m_isResizingWidth || m_isResizingHeight) {
+			Invalidate();
+		}
+		if (!(m_isResizingWidth || m_isResizingHeight || m_isPanning)) {
+			if (IsOverDrawing(x, y)) {
 				m_drawingArea->OnMouseOver(x, y);
 			}
 		}
 	}
 
+	void OnScroll(double xoffset, double yoffset) override {
+		m_scrollX -= (int)(xoffset * ScrollStep);
+		m_scrollY -= (int)(yoffset * ScrollStep);
+		Update();
+	}
+
 	void OnMouseClick(int button, int action, int mods) override {
+		if (button == GLFW_MOUSE_BUTTON_MIDDLE) {
+			m_isPanning = action == GLFW_PRESS;
+			return;
+		}
+
 		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
 			float drawingWidth = Document()->Width() * ed->zoom;
 			float drawingHeight = Document()->Height() * ed->zoom;
@@ -869,7 +2243,8 @@ public: // protected
 
 		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_RELEASE) {
 			if (m_isResizingWidth || m_isResizingHeight) {
-				Document()->SetSize(m_rubberBand.w / ed->zoom, m_rubberBand.h / ed->zoom);
+				CommitEdits();
+				Document()->SetSize(std::max(1, (int)(m_rubberBand.w / ed->zoom)), std::max(1, (int)(m_rubberBand.h / ed->zoom)));
 
 				Update();
 			}
@@ -878,19 +2253,32 @@ public: // protected
 			m_isResizingHeight = false;
 		}
 
-		if (m_drawingArea->Rect().Contains(m_mouseX, m_mouseY)) {
+		// Releases always go through, so that strokes ending out of the drawing get closed
+		if (IsOverDrawing(m_mouseX, m_mouseY) || action == GLFW_RELEASE) {
 			m_drawingArea->OnMouseClick(button, action, mods);
 		}
 	}
 
+	void ClearDamage() override {
+		UiMouseAwareElement::ClearDamage();
+		m_drawingArea->ClearDamage();
+	}
+
+	void OnTick() override {
+		// Undo, zoom, transforms and pasting may all change the drawing size
+		if (NULL != Document() && (Document()->Width() != m_layoutWidth || Document()->Height() != m_layoutHeight || ed->zoom != m_layoutZoom)) {
+			InvalidateLayout();
+		}
+	}
+
 	void OnMouseEnter() override {
-		if (m_drawingArea->Rect().Contains(m_mouseX, m_mouseY)) {
+		if (IsOverDrawing(m_mouseX, m_mouseY)) {
 			m_drawingArea->OnMouseEnter();
 		}
 	}
 
 	void OnMouseLeave() override {
-		if (m_drawingArea->Rect().Contains(m_mouseX, m_mouseY)) {
+		if (IsOverDrawing(m_mouseX, m_mouseY)) {
 			m_drawingArea->OnMouseLeave();
 		}
 	}
@@ -900,11 +2288,27 @@ public: // protected
 		float drawingWidth = Document()->Width() * ed->zoom;
 		float drawingHeight = Document()->Height() * ed->zoom;
 
-		m_widthHandle = ::Rect(r.x + 5 + drawingWidth, r.y + 5 + floor((drawingHeight - 5) / 2.), 5, 5);
-		m_heightHandle = ::Rect(r.x + 5 + floor((drawingWidth - 5) / 2.), r.y + 5 + drawingHeight, 5, 5);
-		m_bothHandle = ::Rect(r.x + 5 + drawingWidth, r.y + 5 + drawingHeight, 5, 5);
+		// The drawing, its margin and its handles may be larger than the
+		// area, in which case it scrolls
+		m_contentWidth = 5 + (int)ceil(drawingWidth) + 10;
+		m_contentHeight = 5 + (int)ceil(drawingHeight) + 10;
+		m_scrollX = std::min(std::max(m_scrollX, 0), std::max(m_contentWidth - r.w, 0));
+		m_scrollY = std::min(std::max(m_scrollY, 0), std::max(m_contentHeight - r.h, 0));
+		int x = r.x + 5 - m_scrollX;
+		int y = r.y + 5 - m_scrollY;
+		m_layoutWidth = Document()->Width();
+		m_layoutHeight = Document()->Height();
+		m_layoutZoom = ed->zoom;
+
+		m_widthHandle = ::Rect(x + drawingWidth, y + floor((drawingHeight - 5) / 2.), 5, 5);
+		m_heightHandle = ::Rect(x + floor((drawingWidth - 5) / 2.), y + drawingHeight, 5, 5);
+		m_bothHandle = ::Rect(x + drawingWidth, y + drawingHeight, 5, 5);
+
+		m_drawingArea->SetViewport(r);
+		m_drawingArea->SetRect(x, y, drawingWidth, drawingHeight);
 
-		m_drawingArea->SetRect(r.x + 5, r.y + 5, drawingWidth, drawingHeight);
+		// Scrolling moves everything
+		Invalidate();
 	}
 
 	void Paint(NVGcontext *vg) const override {
@@ -912,7 +2316,9 @@ public: // protected
 		float drawingWidth = Document()->Width() * ed->zoom;
 		float drawingHeight = Document()->Height() * ed->zoom;
 
-		nvgScissor(vg, r.x, r.y, r.w, r.h);
+		// Within the area being repainted
+		nvgSave(vg);
+		nvgIntersectScissor(vg, r.x, r.y, r.w, r.h);
 
 		nvgBeginPath(vg);
 		nvgRect(vg, r.x, r.y, r.w, r.h);
@@ -921,14 +2327,27 @@ public: // protected
 		nvgFill(vg);
 
 		// Shadow
+		const ::Rect & d = m_drawingArea->Rect();
 		nvgBeginPath(vg);
-		nvgRect(vg, r.x + 5 + 10, r.y + 5 + 10, drawingWidth, drawingHeight);
-		nvgFillPaint(vg, nvgBoxGradient(vg, r.x + 5, r.y + 5, drawingWidth + 4.5, drawingHeight + 4.5,
+		nvgRect(vg, d.x + 10, d.y + 10, drawingWidth, drawingHeight);
+		nvgFillPaint(vg, nvgBoxGradient(vg, d.x, d.y, drawingWidth + 4.5, drawingHeight + 4.5,
 			-5, 9, nvgRGBA(51, 96, 131, 30), nvgRGBA(0, 0, 0, 0)));
 		nvgFill(vg);
 
 		if (NULL != m_drawingArea) {
-			m_drawingArea->Paint(vg);
+			if (m_isResizingWidth || m_isResizingHeight) {
+				// Preview the new size, the canvas only changes on release
+				nvgSave(vg);
+				nvgIntersectScissor(vg, m_rubberBand.x, m_rubberBand.y, m_rubberBand.w, m_rubberBand.h);
+				nvgBeginPath(vg);
+				nvgRect(vg, m_rubberBand.x, m_rubberBand.y, m_rubberBand.w, m_rubberBand.h);
+				nvgFillColor(vg, nvgRGB(255, 255, 255));
+				nvgFill(vg);
+				m_drawingArea->Paint(vg);
+				nvgRestore(vg);
+			} else {
+				m_drawingArea->Paint(vg);
+			}
 		}
 
 		// Handles
@@ -951,20 +2370,48 @@ public: // protected
 			nvgStroke(vg);
 		}
 
-		nvgResetScissor(vg);
+		// Scroll bars, only shown when the content overflows
+		nvgFillColor(vg, nvgRGBA(0, 0, 0, 80));
+		if (m_contentWidth > r.w) {
+			nvgBeginPath(vg);
+			nvgRoundedRect(vg, r.x + (float)m_scrollX * r.w / m_contentWidth, r.y + r.h - 6, (float)r.w * r.w / m_contentWidth, 4, 2);
+			nvgFill(vg);
+		}
+		if (m_contentHeight > r.h) {
+			nvgBeginPath(vg);
+			nvgRoundedRect(vg, r.x + r.w - 6, r.y + (float)m_scrollY * r.h / m_contentHeight, 4, (float)r.h * r.h / m_contentHeight, 2);
+			nvgFill(vg);
+		}
+
+		nvgRestore(vg);
+	}
+
+private:
+	/// The drawing only gets events for the part of it that is in view
+	bool IsOverDrawing(int x, int y) const {
+		return Rect().Contains(x, y) && m_drawingArea->Rect().Contains(x, y);
 	}
 
 private:
+	/// Pixels scrolled per wheel step
+	static const int ScrollStep = 40;
+
 	::Document *m_doc;
 	DrawingArea *m_drawingArea;
 	bool m_isResizingWidth, m_isResizingHeight;
+	bool m_isPanning;
 	int m_mouseX, m_mouseY;
+	int m_scrollX, m_scrollY;
+	int m_contentWidth, m_contentHeight;
+	/// What the last Update() laid the drawing out for
+	int m_layoutWidth, m_layoutHeight;
+	float m_layoutZoom;
 	float m_startDeltaX, m_startDeltaY;
 	::Rect m_widthHandle, m_heightHandle, m_bothHandle;
 	::Rect m_rubberBand;
 };
 
-class Shelf : public HBoxLayout {
+class Shelf final : public HBoxLayout {
 public: // protected
 	void Paint(NVGcontext *vg) const override {
 		const ::Rect & r = InnerRect();
@@ -977,7 +2424,7 @@ public: // protected
 	}
 };
 
-class ShelfSection : public VBoxLayout {
+class ShelfSection final : public VBoxLayout {
 public:
 	ShelfSection() : VBoxLayout() {
 		UiElement *content = new UiElement();
@@ -1005,7 +2452,7 @@ private:
 };
 
 /// Vertical lines between shelf sections
-class ShelfSeparator : public UiElement {
+class ShelfSeparator final : public UiElement {
 public:
 	ShelfSeparator() : UiElement() {
 		SetSizeHint(0, 0, 1, 0);
@@ -1022,9 +2469,12 @@ public: // protected
 	}
 };
 /// This is a mouse aware vbox layout with frame on hover
-class DoubleShelfButtonLayout : public VBoxLayout {
+class DoubleShelfButtonLayout final : public VBoxLayout {
 public:
-	DoubleShelfButtonLayout() : m_isMouseOver(false) {}
+	DoubleShelfButtonLayout()
+		: m_isMouseOver(false)
+		, m_wasMouseOver(false)
+	{}
 
 public: // protected
 	void Paint(NVGcontext *vg) const override {
@@ -1061,6 +2511,9 @@ public: // protected
 
 	void ResetMouse() override {
 		VBoxLayout::ResetMouse();
+		if (m_isMouseOver != m_wasMouseOver) {
+			Invalidate();
+		}
 		if (m_isMouseOver && !m_wasMouseOver) {
 			OnMouseEnter();
 		}
@@ -1078,13 +2531,14 @@ public: // protected
 	virtual void OnMouseLeave() {
 	}
 
-	bool IsMouseOver() const { return m_isMouseOver; }
+	/// State since the last move, m_isMouseOver is only being built during one
+	bool IsMouseOver() const { return m_wasMouseOver; }
 
 private:
 	bool m_isMouseOver, m_wasMouseOver;
 };
 
-class ColorShelfButton : public UiDefaultButton {
+class ColorShelfButton final : public UiDefaultButton {
 public:
 	ColorShelfButton()
 		: m_colorRole(ForegroundColor)
@@ -1236,7 +2690,7 @@ protected:
 	}
 };
 
-class SizePopup : public VBoxLayout {
+class SizePopup final : public VBoxLayout {
 public:
 	SizePopup()
 		: VBoxLayout()
@@ -1272,7 +2726,7 @@ public: // protected
 	}
 };
 
-class BrushPopup : public GridLayout {
+class BrushPopup final : public GridLayout {
 public:
 	BrushPopup()
 		: GridLayout()
@@ -1308,7 +2762,7 @@ public: // protected
 	}
 };
 
-class StrokeButton : public UiDefaultButton {
+class StrokeButton final : public UiDefaultButton {
 public:
 	StrokeButton(float thickness = 2.0)
 		: UiDefaultButton()
@@ -1345,7 +2799,7 @@ private:
 	float m_thickness;
 };
 
-class SizeShelfButton : public TextImageButton {
+class SizeShelfButton final : public TextImageButton {
 public:
 	~SizeShelfButton() {
 		DeleteArrowImage();
@@ -1398,7 +2852,133 @@ private:
 };
 
 /// Should inherit from ToolButton?
-class BrushButton : public ImageButton {
+class PasteButton final : public ImageButton {
+public: // protected
+	void OnMouseClick(int button, int action, int mods) override {
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+			if (NULL != ed->documentArea) {
+				ed->documentArea->CommitEdits();
+			}
+			PasteClipboard();
+		}
+	}
+};
+
+/// Large button of the select tool
+class SelectButton final : public ImageButton {
+public: // protected
+	void OnMouseClick(int button, int action, int mods) override {
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+			ed->currentTool = SelectTool;
+		}
+	}
+
+protected:
+	bool IsCurrent() const override { return ed->currentTool == SelectTool; }
+};
+
+/// Cycle through the shapes of the select tool
+class SelectionShapeButton final : public ArrowTextButton {
+public: // protected
+	void OnMouseClick(int button, int action, int mods) override {
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+			ed->currentTool = SelectTool;
+			switch (ed->selectionShape) {
+			case RectangleSelection:
+				ed->selectionShape = FreeFormSelection;
+				SetText("Forme libre");
+				break;
+			case FreeFormSelection:
+				ed->selectionShape = MagicWandSelection;
+				SetText("Baguette");
+				break;
+			default:
+				ed->selectionShape = RectangleSelection;
+				SetText(u8"Slectionner");
+				break;
+			}
+		}
+	}
+};
+
+/// Item of the shape gallery, showing its own shape
+class ShapeButton final : public UiDefaultButton {
+public:
+	ShapeButton() : m_shape(LineShape) {}
+
+	ShapeKind TargetShape() const { return m_shape; }
+	void SetTargetShape(ShapeKind shape) { m_shape = shape; }
+
+protected:
+	bool IsCurrent() const override {
+		return ed->currentTool == ShapeTool && ed->currentShape == m_shape;
+	}
+
+public: // protected
+	void Paint(NVGcontext *vg) const override {
+		UiDefaultButton::Paint(vg);
+		const ::Rect & r = InnerRect();
+		StrokePoint a = { r.x + 4.5f, r.y + 4.5f }, b = { r.x + r.w - 4.5f, r.y + r.h - 4.5f };
+		if (m_shape == LineShape) {
+			std::swap(a.y, b.y);
+		}
+		ShapeStyle style = { 1, true, false, 0, 0 };
+		Shape shape;
+		shape.Reset(m_shape, style, a);
+		if (m_shape == PolygonShape) {
+			StrokePoint c = { a.x + 3, b.y }, d = { a.x, a.y + 7 };
+			shape.MoveLastPoint(b);
+			shape.AddPoint(c);
+			shape.AddPoint(d);
+		} else {
+			shape.MoveLastPoint(b);
+		}
+		std::vector<StrokePoint> path;
+		shape.Path(path);
+		nvgBeginPath(vg);
+		nvgMoveTo(vg, path[0].x, path[0].y);
+		for (const StrokePoint & p : path) {
+			nvgLineTo(vg, p.x, p.y);
+		}
+		nvgStrokeColor(vg, nvgRGB(60, 60, 60));
+		nvgStrokeWidth(vg, 1);
+		nvgStroke(vg);
+	}
+
+	void OnMouseClick(int button, int action, int mods) override {
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS) {
+			ed->currentTool = ShapeTool;
+			ed->currentShape = m_shape;
+		}
+	}
+
+private:
+	ShapeKind m_shape;
+};
+
+/// Toggle for the outline ("Contour") or the fill ("Remplissage") of shapes
+class ShapeStyleButton final : public TextButton {
+public:
+	ShapeStyleButton() : m_option(NULL) {}
+
+	/// Editor flag that the button toggles
+	void SetOption(bool *option) { m_option = option; }
+
+protected:
+	bool IsCurrent() const override { return NULL != m_option && *m_option; }
+
+public: // protected
+	void OnMouseClick(int button, int action, int mods) override {
+		if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS && NULL != m_option) {
+			*m_option = !*m_option;
+		}
+	}
+
+private:
+	bool *m_option;
+};
+
+class BrushButton final : public ImageButton {
 public:
 	const Tool & TargetTool() const { return m_targetTool; }
 	void SetTargetTool(const Tool & tool) { m_targetTool = tool; }
@@ -1428,7 +3008,7 @@ private:
 	Tool m_targetTool;
 };
 
-class BrushPopupButton : public ArrowTextButton {
+class BrushPopupButton final : public ArrowTextButton {
 public:
 	BrushPopupButton() : m_vg(NULL) {}
 
@@ -1496,7 +3076,7 @@ private:
 	mutable NVGcontext * m_vg;
 };
 
-class MainLayout : public PopupStackLayout {
+class MainLayout final : public PopupStackLayout {
 public: // protected
 	void OnMouseClick(int button, int action, int mods) override {
 		bool closeSizePopup = false;
@@ -1523,11 +3103,22 @@ public: // protected
 	}
 };
 
+/**
+ * Frames are drawn to an offscreen target that keeps the previous ones, so
+ * that only the part of the window that got damaged needs to be drawn
+ * again, before being copied to the screen. Frames where nothing got
+ * damaged are neither drawn nor swapped.
+ */
 class UiWindow {
 public:
 	UiWindow()
 		: m_isValid(false)
 		, m_content(NULL)
+		, m_frameBuffer(0)
+		, m_colorBuffer(0)
+		, m_stencilBuffer(0)
+		, m_fbWidth(0)
+		, m_fbHeight(0)
 	{
 		std::cout << "Starting GLFW context, OpenGL ES 3.0" << std::endl;
 		// Init GLFW
@@ -1553,8 +3144,10 @@ public:
 		// Set the required callback functions
 		glfwSetWindowUserPointer(m_window, static_cast<void*>(this));
 		glfwSetKeyCallback(m_window, key_callback);
+		glfwSetCharCallback(m_window, char_callback);
 		glfwSetCursorPosCallback(m_window, cursor_pos_callback);
 		glfwSetMouseButtonCallback(m_window, mouse_button_callback);
+		glfwSetScrollCallback(m_window, scroll_callback);
 		glfwSetWindowSizeCallback(m_window, window_size_callback);
 
 		if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
@@ -1586,6 +3179,12 @@ public:
 			delete m_content;
 		}
 
+		if (0 != m_frameBuffer) {
+			glDeleteFramebuffers(1, &m_frameBuffer);
+			glDeleteRenderbuffers(1, &m_colorBuffer);
+			glDeleteRenderbuffers(1, &m_stencilBuffer);
+		}
+
 		// Destroy NanoVG ctxw
 		nvgDeleteGLES3(m_vg);
 
@@ -1599,22 +3198,56 @@ public:
 		return glfwWindowShouldClose(m_window);
 	}
 
-	void BeginRender() const {
-		int winWidth, winHeight;
+	/**
+	 * Start drawing the damaged part of the window. Returns false if there
+	 * is none, in which case EndRender() must not be called.
+	 */
+	bool BeginRender() {
+		// Ticking may draw to offscreen targets (e.g. strokes), so it must
+		// happen before the frame begins
+		AnimationScheduler::Global().Tick(glfwGetTime());
+
 		int fbWidth, fbHeight;
 		float pxRatio;
 
 		glfwGetWindowSize(m_window, &m_width, &m_height);
 		glfwGetFramebufferSize(m_window, &fbWidth, &fbHeight);
+		if (fbWidth <= 0 || fbHeight <= 0 || m_width <= 0 || m_height <= 0) {
+			// Minimized
+			return false;
+		}
+		if (fbWidth != m_fbWidth || fbHeight != m_fbHeight) {
+			ResizeTarget(fbWidth, fbHeight);
+			Content()->Damage(::Rect(0, 0, m_width, m_height));
+		}
+
+		// Arrange what ticking or input invalidated, before painting it
+		Content()->Layout();
+
+		::Rect damage = Content()->TakeDamage().Intersected(::Rect(0, 0, m_width, m_height));
+		if (damage.IsEmpty()) {
+			return false;
+		}
+
 		// Calculate pixel ration for hi-dpi devices.
 		pxRatio = (float)fbWidth / (float)m_width;
 
+		// Damage in framebuffer pixels, whose rows go up
+		int x0 = (int)floor(damage.x * pxRatio);
+		int y0 = (int)floor(damage.y * pxRatio);
+		int x1 = std::min((int)ceil((damage.x + damage.w) * pxRatio), fbWidth);
+		int y1 = std::min((int)ceil((damage.y + damage.h) * pxRatio), fbHeight);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, m_frameBuffer);
 		glViewport(0, 0, fbWidth, fbHeight);
 
 		// Render
-		// Clear the colorbuffer
+		// Clear the damaged part of the colorbuffer
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(x0, fbHeight - y1, x1 - x0, y1 - y0);
 		glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+		glDisable(GL_SCISSOR_TEST);
 
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -1622,47 +3255,285 @@ public:
 		glDisable(GL_DEPTH_TEST);
 
 		nvgBeginFrame(m_vg, m_width, m_height, pxRatio);
+		// NanoVG turns the GL scissor test off, so it clips by itself, on the
+		// same framebuffer pixels as the clear
+		nvgScissor(m_vg, x0 / pxRatio, y0 / pxRatio, (x1 - x0) / pxRatio, (y1 - y0) / pxRatio);
+		UiElement::SetPaintArea(damage);
+		return true;
 	}
 
-	void EndRender() const {
+	void EndRender() {
 		// UI Objects
-		Content()->OnTick();
 		Content()->Paint(m_vg);
 
 		nvgEndFrame(m_vg);
 
+		// The screen does not keep its content across swaps, so all of the
+		// frame gets copied
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, m_frameBuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, m_fbWidth, m_fbHeight, 0, 0, m_fbWidth, m_fbHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
 		// Swap the screen buffers
 		glfwSwapBuffers(m_window);
 	}
 
-	void Render() const {
-		BeginRender();
-		EndRender();
+	void Render() {
+		if (BeginRender()) {
+			EndRender();
+		}
 	}
 
 	int Width() const { return m_width; }
 	int Height() const { return m_height; }
 
 	UiElement *Content() const { return m_content; }
-	void SetContent(UiElement *element) { m_content = element; }
+	void SetContent(UiElement *element) {
+		m_content = element;
+		m_content->Invalidate();
+	}
+
+private:
+	/// Allocate the offscreen target that frames are drawn to
+	void ResizeTarget(int width, int height) {
+		if (0 == m_frameBuffer) {
+			glGenFramebuffers(1, &m_frameBuffer);
+			glGenRenderbuffers(1, &m_colorBuffer);
+			glGenRenderbuffers(1, &m_stencilBuffer);
+		}
+		glBindRenderbuffer(GL_RENDERBUFFER, m_colorBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, m_stencilBuffer);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, m_frameBuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_colorBuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_stencilBuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+		m_fbWidth = width;
+		m_fbHeight = height;
+	}
 
 private:
 	bool m_isValid;
 	GLFWwindow* m_window;
 	struct NVGcontext* m_vg;
 	UiElement *m_content;
-	mutable int m_width, m_height;
+	int m_width, m_height;
+	GLuint m_frameBuffer; /// Offscreen target, that keeps previous frames
+	GLuint m_colorBuffer, m_stencilBuffer;
+	int m_fbWidth, m_fbHeight; /// Size of the offscreen target
 };
 
+/**
+ * Stamp rows of 64 px dabs over a large canvas, flushing them in small
+ * batches as strokes do, and report the throughput of the brush engine.
+ * Does not need a window, run with PAINT_BENCHMARK=brush.
+ */
+int RunBrushBenchmark()
+{
+	const float size = 64;
+	BrushSettings settings = BrushSettingsForTool(BrushTool);
+	settings.size = 1.0f;
+	for (unsigned int threadCount : { 1u, 0u }) {
+		ThreadPool pool(threadCount);
+		BrushEngine brush(pool);
+		TiledCanvas canvas;
+		canvas.Reset(4000, 4000, MakePixel(255, 255, 255));
+
+		auto start = std::chrono::steady_clock::now();
+		brush.BeginStroke();
+		std::vector<StrokeSegment> segments(1);
+		for (float y = 50; y < canvas.Height() - 50; y += 90) {
+			for (float x = 40; x < canvas.Width() - 40; x += 32) {
+				segments[0] = { x, y, x + 32, y };
+				brush.Stroke(canvas, segments, size, MakePixel(0, 0, 0), settings);
+			}
+		}
+		size_t dabCount = brush.DabCount();
+		brush.EndStroke();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << "Brush: " << dabCount << " dabs of " << size << " px on " << pool.ThreadCount() << " thread(s) in "
+			<< seconds * 1000 << " ms (" << dabCount / seconds << " dabs/s, "
+			<< dabCount / seconds / pool.ThreadCount() << " dabs/s per thread)" << std::endl;
+	}
+	return 0;
+}
+
+/**
+ * Fill the background of a 50 megapixel canvas crossed by thin walls, and
+ * report how long the search and the painting take.
+ * Does not need a window, run with PAINT_BENCHMARK=fill.
+ */
+int RunFillBenchmark()
+{
+	TiledCanvas canvas;
+	canvas.Reset(8000, 6250, MakePixel(255, 255, 255));
+	for (int i = 0; i < 200; ++i) {
+		canvas.FillRect(::Rect(i * 40, i * 30, 3, 3000), MakePixel(0, 0, 0));
+	}
+
+	FloodFill floodFill;
+	auto start = std::chrono::steady_clock::now();
+	::Rect bounds = floodFill.Find(canvas, canvas.Width() - 1, 0, 0);
+	auto found = std::chrono::steady_clock::now();
+	floodFill.Fill(canvas, MakePixel(255, 0, 0));
+	auto filled = std::chrono::steady_clock::now();
+
+	std::cout << "Fill: " << floodFill.PixelCount() << " pixels in a " << bounds.w << "x" << bounds.h << " box, found in "
+		<< std::chrono::duration<double, std::milli>(found - start).count() << " ms, painted in "
+		<< std::chrono::duration<double, std::milli>(filled - found).count() << " ms" << std::endl;
+	return 0;
+}
+
+/**
+ * Scale a 12 megapixel canvas up and down with each filter, first with the
+ * scalar code on a single thread then with SIMD on all threads, and report
+ * the throughput in output megapixels per second.
+ * Does not need a window, run with PAINT_BENCHMARK=resample.
+ */
+int RunResampleBenchmark()
+{
+	TiledCanvas canvas;
+	canvas.Reset(4000, 3000, MakePixel(255, 255, 255));
+	for (int x = 0; x < canvas.Width(); x += 7) {
+		canvas.FillRect(::Rect(x, 0, 3, canvas.Height()), MakePixel(x % 256, 40, 90, 200));
+	}
+
+	const char *names[] = { "nearest", "bilinear", "bicubic", "lanczos3" };
+	const int sizes[][2] = { { 2600, 1900 }, { 6000, 4500 } };
+	for (int filter = NearestFilter; filter <= Lanczos3Filter; ++filter) {
+		for (const int *size : sizes) {
+			for (bool isSimd : { false, true }) {
+				ThreadPool pool(isSimd ? 0 : 1);
+				Resampler resampler(pool);
+				resampler.SetSimdEnabled(isSimd);
+				TiledCanvas scaled;
+				auto start = std::chrono::steady_clock::now();
+				resampler.Resize(canvas, scaled, size[0], size[1], (ResampleFilter)filter);
+				double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+				std::cout << "Resample: " << names[filter] << " to " << size[0] << "x" << size[1] << ", "
+					<< (isSimd ? "SIMD" : "scalar") << " on " << pool.ThreadCount() << " thread(s) in "
+					<< seconds * 1000 << " ms (" << size[0] * size[1] / seconds / 1e6 << " MP/s)" << std::endl;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Turn and flip a 48 megapixel canvas of noise, and compare the throughput
+ * with copying the same amount of memory, which bounds it.
+ * Does not need a window, run with PAINT_BENCHMARK=rotate.
+ */
+int RunRotateBenchmark()
+{
+	TiledCanvas canvas;
+	canvas.Reset(8000, 6000, MakePixel(255, 255, 255));
+	uint32_t seed = 1;
+	for (int ty = 0; ty < canvas.TilesY(); ++ty) {
+		for (int tx = 0; tx < canvas.TilesX(); ++tx) {
+			Pixel *pixels = canvas.MutableTile(tx, ty)->MutableData();
+			for (int i = 0; i < TileSize * TileSize; ++i) {
+				seed = seed * 1664525 + 1013904223;
+				pixels[i] = seed;
+			}
+		}
+	}
+	size_t pixelCount = (size_t)canvas.Width() * canvas.Height();
+	double megabytes = pixelCount * sizeof(Pixel) / 1e6;
+
+	std::vector<Pixel> from(pixelCount, 1), to(pixelCount);
+	auto start = std::chrono::steady_clock::now();
+	std::copy(from.begin(), from.end(), to.begin());
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Rotate: copy in " << seconds * 1000 << " ms (" << megabytes / seconds << " MB/s)" << std::endl;
+
+	const char *names[] = { "right", "left", "half turn", "horizontal flip", "vertical flip" };
+	for (int orientation = RotateRight; orientation <= FlipVertical; ++orientation) {
+		for (bool isSimd : { false, true }) {
+			Transformer transformer;
+			transformer.SetSimdEnabled(isSimd);
+			TiledCanvas oriented;
+			start = std::chrono::steady_clock::now();
+			transformer.Orient(canvas, oriented, (Orientation)orientation);
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "Rotate: " << names[orientation] << ", " << (isSimd ? "SIMD" : "scalar") << " in "
+				<< seconds * 1000 << " ms (" << megabytes / seconds << " MB/s)" << std::endl;
+		}
+	}
+
+	TiledCanvas rotated;
+	start = std::chrono::steady_clock::now();
+	Transformer().Rotate(canvas, rotated, 30.0f);
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Rotate: 30 degrees in " << seconds * 1000 << " ms ("
+		<< (double)rotated.Width() * rotated.Height() / seconds / 1e6 << " MP/s)" << std::endl;
+	return 0;
+}
+
 int main()
 {
+	const char *benchmark = getenv("PAINT_BENCHMARK");
+	if (NULL != benchmark && std::string(benchmark) == "brush") {
+		return RunBrushBenchmark();
+	}
+	if (NULL != benchmark && std::string(benchmark) == "fill") {
+		return RunFillBenchmark();
+	}
+	if (NULL != benchmark && std::string(benchmark) == "resample") {
+		return RunResampleBenchmark();
+	}
+	if (NULL != benchmark && std::string(benchmark) == "rotate") {
+		return RunRotateBenchmark();
+	}
+
 	UiWindow window;
 	struct NVGcontext* vg = window.DrawingContext();
 
 	// Document
 	//Editor *ed = new Editor(); // made global
 	ed = new Editor();
+	// Machines without a usable GPU can switch strokes to the CPU
+	const char *strokeBackend = getenv("PAINT_STROKE_BACKEND");
+	if (NULL != strokeBackend && std::string(strokeBackend) == "cpu") {
+		ed->strokeBackend = CpuStrokeBackend;
+	}
+	// Log texture uploads per frame, in bytes
+	ed->showUploadStats = NULL != getenv("PAINT_UPLOAD_STATS");
+	// Log how many elements each window resize lays out
+	ed->showLayoutStats = NULL != getenv("PAINT_LAYOUT_STATS");
+	// Log how each stroke got batched into flushes
+	ed->showStrokeStats = NULL != getenv("PAINT_STROKE_STATS");
+	// The eraser makes pixels transparent rather than painting the background
+	const char *eraseMode = getenv("PAINT_ERASE_MODE");
+	if (NULL != eraseMode && std::string(eraseMode) == "alpha") {
+		ed->eraseMode = AlphaEraseMode;
+	}
+	// Filter used to resize the image: nearest, bilinear, bicubic or lanczos3
+	const char *resampleFilter = getenv("PAINT_RESAMPLE_FILTER");
+	if (NULL != resampleFilter) {
+		std::string name(resampleFilter);
+		ed->resampleFilter =
+			name == "nearest" ? NearestFilter :
+			name == "bilinear" ? BilinearFilter :
+			name == "lanczos3" ? Lanczos3Filter :
+			BicubicFilter;
+	}
+	// Color picker averaging, e.g. 3 for 3x3 samples
+	const char *pickSampleSize = getenv("PAINT_PICK_SAMPLE");
+	if (NULL != pickSampleSize) {
+		ed->pickSampleSize = std::max(1, std::min(atoi(pickSampleSize), 5));
+	}
 	Document *doc = new Document();
+	const char *uploadBudget = getenv("PAINT_UPLOAD_BUDGET");
+	if (NULL != uploadBudget) {
+		doc->SetUploadBudget((size_t)atol(uploadBudget));
+	}
 	doc->CreateImage(vg, 1, 1);
 	doc->SetSize(254, 280);
 	
@@ -1696,7 +3567,7 @@ int main()
 	DoubleShelfButtonLayout *clipboardButtons = new DoubleShelfButtonLayout();
 	clipboardButtons->SetMargin(6, 4, 70, 0);
 	// Top
-	ImageButton *topClipboardButton = new ImageButton();
+	PasteButton *topClipboardButton = new PasteButton();
 	topClipboardButton->SetInnerSizeHint(0, 0, 42, 38);
 	topClipboardButton->LoadImage(vg, "images\\pasteOff32.png");
 	clipboardButtons->AddItem(topClipboardButton);
@@ -1721,12 +3592,12 @@ int main()
 	DoubleShelfButtonLayout *selectButtons = new DoubleShelfButtonLayout();
 	selectButtons->SetMargin(4, 4, 6 + 111, 0);
 	// Top
-	ImageButton *topSelectButton = new ImageButton();
+	SelectButton *topSelectButton = new SelectButton();
 	topSelectButton->SetInnerSizeHint(0, 0, 68, 38);
 	topSelectButton->LoadImage(vg, "images\\select32.png");
 	selectButtons->AddItem(topSelectButton);
 	// Bottom
-	ArrowTextButton *bottomSelectButton = new ArrowTextButton();
+	SelectionShapeButton *bottomSelectButton = new SelectionShapeButton();
 	bottomSelectButton->SetMargin(0, -1, 0, 0); // merge border with previous button
 	bottomSelectButton->SetInnerSizeHint(0, 0, 68, 29);
 	bottomSelectButton->LoadImage(vg, "images\\arrow8.png");
@@ -1803,6 +3674,41 @@ int main()
 	ShelfSection *shapeShelf = new ShelfSection();
 	shapeShelf->SetLabelText("Formes");
 	shapeShelf->SetSizeHint(0, 0, 270, 0);
+
+	HBoxLayout *shapeWidgets = new HBoxLayout();
+
+	GridLayout *shapeGrid = new GridLayout();
+	shapeGrid->SetInnerSizeHint(0, 0, 69, 51);
+	shapeGrid->SetRowCount(2);
+	shapeGrid->SetColCount(3);
+	shapeGrid->SetRowSpacing(7);
+	shapeGrid->SetColSpacing(0);
+	const ShapeKind shapes[] = { LineShape, RectangleShape, EllipseShape, PolygonShape, ArrowShape };
+	for (ShapeKind shape : shapes) {
+		ShapeButton *shapeButton = new ShapeButton();
+		shapeButton->SetTargetShape(shape);
+		shapeGrid->AddItem(shapeButton);
+	}
+	shapeWidgets->AddItem(shapeGrid);
+
+	VBoxLayout *shapeStyleButtons = new VBoxLayout();
+	shapeStyleButtons->SetMargin(12, 0, 0, 0);
+	ShapeStyleButton *outlineButton = new ShapeStyleButton();
+	outlineButton->SetInnerSizeHint(0, 0, 90, 22);
+	outlineButton->SetOption(&ed->isShapeOutlined);
+	outlineButton->SetText("Contour");
+	shapeStyleButtons->AddItem(outlineButton);
+	ShapeStyleButton *fillButton = new ShapeStyleButton();
+	fillButton->SetInnerSizeHint(0, 0, 90, 22);
+	fillButton->SetOption(&ed->isShapeFilled);
+	fillButton->SetText("Remplissage");
+	shapeStyleButtons->AddItem(fillButton);
+	shapeStyleButtons->AutoSizeHint();
+	shapeWidgets->AddItem(shapeStyleButtons);
+
+	shapeWidgets->SetMargin(4, 0, 6, 0);
+	shapeWidgets->AutoSizeHint();
+	shapeShelf->SetContent(shapeWidgets);
 	shelf->AddItem(shapeShelf);
 
 	shelf->AddItem(new ShelfSeparator());
@@ -1897,6 +3803,7 @@ int main()
 	DocumentArea *paintArea = new DocumentArea();
 	paintArea->SetDocument(doc);
 	paintArea->SetStrokeEngine(vg);
+	ed->documentArea = paintArea;
 	layout->AddItem(paintArea);
 
 	StatusBar *statusBar = new StatusBar();
@@ -1906,6 +3813,7 @@ int main()
 	popupLayout->AddItem(layout);
 
 	ed->popupLayout = popupLayout;
+	ed->document = doc;
 	popupLayout->SetRect(0, 0, WIDTH, HEIGHT);
 
 	// Load images
@@ -1914,63 +3822,77 @@ int main()
 	Image rotateImg(vg, "images\\rotate18.png");
 
 	int font = nvgCreateFont(vg, "SegeoUI", (shareDir + "fonts\\segoeui.ttf").c_str());
+	// Same font for the text tool, rasterized on the CPU
+	if (!ed->font.Load(shareDir + "fonts\\segoeui.ttf")) {
+		std::cout << "Could not load the font of the text tool" << std::endl;
+	}
 
 	// Main loop
+	const double FramePeriod = 1.0 / 60; // in seconds
 	while (!window.ShouldClose())
 	{
-		window.BeginRender();
-		int winWidth = window.Width();
-		int winHeight = window.Height();
+		double frameStart = glfwGetTime();
 
-		nvgFontFaceId(vg, font);
-		nvgFontSize(vg, 15);
+		// Nothing gets drawn unless something got damaged
+		if (window.BeginRender()) {
+			int winWidth = window.Width();
+			int winHeight = window.Height();
 
-		// Shelf
-		nvgBeginPath(vg);
-		nvgRect(vg, 0, 24, winWidth, 92);
-		nvgFillColor(vg, nvgRGBA(245, 246, 247, 255));
-		nvgFill(vg);
+			nvgFontFaceId(vg, font);
+			nvgFontSize(vg, 15);
+
+			// Shelf
+			nvgBeginPath(vg);
+			nvgRect(vg, 0, 24, winWidth, 92);
+			nvgFillColor(vg, nvgRGBA(245, 246, 247, 255));
+			nvgFill(vg);
 
-		// // Shelf images
-		// Clipboard
+			// // Shelf images
+			// Clipboard
 		
-		nvgTextAlign(vg, NVG_ALIGN_LEFT);
-		nvgFillColor(vg, nvgRGBA(141, 141, 141, 255));
-		nvgText(vg, 70, 43, "Couper", NULL);
+			// Enabled when there is something to cut or copy (Ctrl+X, Ctrl+C)
+			NVGcolor clipboardTextColor = doc->HasSelection() ? nvgRGBA(60, 60, 60, 255) : nvgRGBA(141, 141, 141, 255);
+			nvgTextAlign(vg, NVG_ALIGN_LEFT);
+			nvgFillColor(vg, clipboardTextColor);
+			nvgText(vg, 70, 43, "Couper", NULL);
 		
-		nvgFillColor(vg, nvgRGBA(141, 141, 141, 255));
-		nvgText(vg, 70, 65, "Copier", NULL);
-
-		// Image
-		cropOffImg.Paint(194, 24 + 5);
-		resizeImg.Paint(194, 24 + 28);
-		rotateImg.Paint(194, 24 + 50);
-
-		nvgTextAlign(vg, NVG_ALIGN_LEFT);
-		nvgFillColor(vg, nvgRGBA(141, 141, 141, 255));
-		nvgText(vg, 214, 43, "Rogner", NULL);
+			nvgFillColor(vg, clipboardTextColor);
+			nvgText(vg, 70, 65, "Copier", NULL);
 
-		nvgTextAlign(vg, NVG_ALIGN_LEFT);
-		nvgFillColor(vg, nvgRGBA(60, 60, 60, 255));
-		nvgText(vg, 214, 65, "Redimensionner", NULL);
+			// Image
+			cropOffImg.Paint(194, 24 + 5);
+			resizeImg.Paint(194, 24 + 28);
+			rotateImg.Paint(194, 24 + 50);
 
-		nvgTextAlign(vg, NVG_ALIGN_LEFT);
-		nvgFillColor(vg, nvgRGBA(60, 60, 60, 255));
-		nvgText(vg, 214, 87, "Faire pivoter", NULL);
+			// Enabled when there is a selection to crop to (Ctrl+Shift+X)
+			nvgTextAlign(vg, NVG_ALIGN_LEFT);
+			nvgFillColor(vg, clipboardTextColor);
+			nvgText(vg, 214, 43, "Rogner", NULL);
 
-		// Shapes
-		nvgTextAlign(vg, NVG_ALIGN_LEFT);
-		nvgFillColor(vg, nvgRGBA(141, 141, 141, 255));
-		nvgText(vg, 637, 43, "Contour", NULL);
+			nvgTextAlign(vg, NVG_ALIGN_LEFT);
+			nvgFillColor(vg, nvgRGBA(60, 60, 60, 255));
+			nvgText(vg, 214, 65, "Redimensionner", NULL);
 
-		nvgTextAlign(vg, NVG_ALIGN_LEFT);
-		nvgFillColor(vg, nvgRGBA(141, 141, 141, 255));
-		nvgText(vg, 637, 65, "Remplissage", NULL);
+			nvgTextAlign(vg, NVG_ALIGN_LEFT);
+			nvgFillColor(vg, nvgRGBA(60, 60, 60, 255));
+			nvgText(vg, 214, 87, "Faire pivoter", NULL);
 
-		window.EndRender();
+			window.EndRender();
+		}
 
-		// Check if any events have been activated (key pressed, mouse moved etc.) and call corresponding response functions
-		glfwPollEvents();
+		// Check if any events have been activated (key pressed, mouse moved etc.) and call corresponding response functions.
+		// Sleeps until there is one, unless something animates, in which case
+		// it only waits for the next frame.
+		if (!AnimationScheduler::Global().IsRunning()) {
+			glfwWaitEvents();
+		} else {
+			double timeout = frameStart + FramePeriod - glfwGetTime();
+			if (timeout > 0) {
+				glfwWaitEventsTimeout(timeout);
+			} else {
+				glfwPollEvents();
+			}
+		}
 	}
 
 	// Free images
@@ -1988,44 +3910,169 @@ int main()
 // Is called whenever a key is pressed/released via GLFW
 void key_callback(GLFWwindow* glfwWindow, int key, int scancode, int action, int mode)
 {
+	AnimationScheduler::Global().OnInput();
 	UiWindow* window = static_cast<UiWindow*>(glfwGetWindowUserPointer(glfwWindow));
 	if (!window) {
 		return;
 	}
 
 	std::cout << key << std::endl;
+	// Shortcuts may change any state that is displayed, while typing only
+	// damages the text
+	if (!ed->isTyping) {
+		window->Content()->Invalidate();
+	}
+	if (ed->isTyping && (action == GLFW_PRESS || action == GLFW_REPEAT)) {
+		// Escape leaves the text as typed
+		if (key == GLFW_KEY_ESCAPE) {
+			ed->isTyping = false;
+			return;
+		}
+		if (key == GLFW_KEY_BACKSPACE) {
+			ed->text.Erase();
+		}
+		if (key == GLFW_KEY_ENTER || key == GLFW_KEY_KP_ENTER) {
+			ed->text.Insert('\n');
+		}
+	}
+
 	if (key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
 		glfwSetWindowShouldClose(glfwWindow, GL_TRUE);
+
+	if (key == GLFW_KEY_F2 && action == GLFW_PRESS) {
+		ed->strokeBackend = ed->strokeBackend == GpuStrokeBackend ? CpuStrokeBackend : GpuStrokeBackend;
+		std::cout << "Stroke backend: " << (ed->strokeBackend == GpuStrokeBackend ? "GPU" : "CPU") << std::endl;
+	}
+
+	if ((mode & GLFW_MOD_CONTROL) && (action == GLFW_PRESS || action == GLFW_REPEAT) && NULL != ed->document) {
+		bool redo = key == GLFW_KEY_Y || (key == GLFW_KEY_Z && (mode & GLFW_MOD_SHIFT));
+		bool undo = key == GLFW_KEY_Z && !redo;
+		bool isCut = key == GLFW_KEY_X && !(mode & GLFW_MOD_SHIFT);
+		bool isCrop = key == GLFW_KEY_X && (mode & GLFW_MOD_SHIFT);
+		bool isDocumentEdit = undo || redo || isCut || isCrop
+			|| key == GLFW_KEY_V || key == GLFW_KEY_W || key == GLFW_KEY_R || key == GLFW_KEY_H;
+		if (isDocumentEdit) {
+			// Text being typed and shapes being drawn hold a history step
+			// open, and pixels they restore from before the edit would land
+			// in the new canvas
+			if (NULL != ed->documentArea) {
+				ed->documentArea->CommitEdits();
+			}
+			// A stroke still being drawn
+			if (ed->document->History().IsInStep()) {
+				return;
+			}
+		}
+		if (undo) {
+			ed->document->Undo();
+		}
+		if (redo) {
+			ed->document->Redo();
+		}
+
+		bool zoomIn = key == GLFW_KEY_EQUAL || key == GLFW_KEY_KP_ADD;
+		bool zoomOut = key == GLFW_KEY_MINUS || key == GLFW_KEY_KP_SUBTRACT;
+		if (zoomIn || zoomOut || key == GLFW_KEY_0) {
+			SetZoom(zoomIn ? ed->zoom * 2 : (zoomOut ? ed->zoom / 2 : 1.0f));
+		}
+
+		if ((key == GLFW_KEY_C || isCut) && action == GLFW_PRESS) {
+			CopySelection(glfwWindow, key == GLFW_KEY_X);
+		}
+		if (key == GLFW_KEY_V && action == GLFW_PRESS) {
+			PasteClipboard();
+		}
+
+		// Resize the image to half, or twice its size
+		if (key == GLFW_KEY_W && action == GLFW_PRESS) {
+			Document *doc = ed->document;
+			if (mode & GLFW_MOD_SHIFT) {
+				doc->Scale(doc->Width() * 2, doc->Height() * 2, ed->resampleFilter);
+			} else {
+				doc->Scale(std::max(1, doc->Width() / 2), std::max(1, doc->Height() / 2), ed->resampleFilter);
+			}
+		}
+
+		// Turn (Alt: by 15 degrees) or flip the image, Shift going the other way
+		if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+			if (mode & GLFW_MOD_ALT) {
+				ed->document->Rotate((mode & GLFW_MOD_SHIFT) ? -15.0f : 15.0f);
+			} else {
+				ed->document->Orient((mode & GLFW_MOD_SHIFT) ? RotateLeft : RotateRight);
+			}
+		}
+		if (key == GLFW_KEY_H && action == GLFW_PRESS) {
+			ed->document->Orient((mode & GLFW_MOD_SHIFT) ? FlipVertical : FlipHorizontal);
+		}
+		// Crop to the selection
+		if (isCrop && action == GLFW_PRESS) {
+			ed->document->CropToSelection();
+		}
+
+		// Select all, or nothing
+		if (key == GLFW_KEY_A && action == GLFW_PRESS) {
+			Document *doc = ed->document;
+			doc->SetSelection((mode & GLFW_MOD_SHIFT) ? Selection() : Selection::FromRect(::Rect(0, 0, doc->Width(), doc->Height())));
+		}
+	}
+}
+
+// Is called for each character typed, after keyboard layout and dead keys
+void char_callback(GLFWwindow* glfwWindow, unsigned int codepoint)
+{
+	AnimationScheduler::Global().OnInput();
+	if (ed->isTyping) {
+		ed->text.Insert(codepoint);
+	}
 }
 
 void cursor_pos_callback(GLFWwindow* glfwWindow, double xpos, double ypos)
 {
+	AnimationScheduler::Global().OnInput();
 	UiWindow* window = static_cast<UiWindow*>(glfwGetWindowUserPointer(glfwWindow));
 	if (!window) {
 		return;
 	}
 
-	window->Content()->ResetDebug();
-	window->Content()->ResetMouse();
-	window->Content()->OnMouseOver(xpos, ypos);
+	HoverTracker::Global().MouseMove(window->Content(), xpos, ypos);
 }
 
 
 void mouse_button_callback(GLFWwindow* glfwWindow, int button, int action, int mods)
 {
+	AnimationScheduler::Global().OnInput();
 	UiWindow* window = static_cast<UiWindow*>(glfwGetWindowUserPointer(glfwWindow));
 	if (!window) {
 		return;
 	}
 
 	window->Content()->OnMouseClick(button, action, mods);
+	// Clicks may change any state that is displayed
+	window->Content()->Invalidate();
+}
+
+void scroll_callback(GLFWwindow* glfwWindow, double xoffset, double yoffset)
+{
+	AnimationScheduler::Global().OnInput();
+	UiWindow* window = static_cast<UiWindow*>(glfwGetWindowUserPointer(glfwWindow));
+	if (!window) {
+		return;
+	}
+
+	window->Content()->OnScroll(xoffset, yoffset);
 }
 
 void window_size_callback(GLFWwindow* glfwWindow, int width, int height) {
+	AnimationScheduler::Global().OnInput();
 	UiWindow* window = static_cast<UiWindow*>(glfwGetWindowUserPointer(glfwWindow));
 	if (!window) {
 		return;
 	}
 
+	size_t passCount = UiElement::LayoutPassCount();
 	window->Content()->SetRect(0, 0, width, height);
+	if (ed->showLayoutStats) {
+		std::cout << "Layout: " << UiElement::LayoutPassCount() - passCount << " elements for "
+			<< width << "x" << height << std::endl;
+	}
 }
@@ -0,0 +1,160 @@
+/**
+ * Paint Portable
+ * Copyright (c) 2018 - Elie Michel
+ */
+
+/*
+ * Lays out random trees of layouts with BoxLayout<axis> and with the box
+ * layouts it replaced, then checks that both give the same rects and find
+ * the same items under the same positions.
+ */
+
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "nanovg.h"
+#include "BaseUi.h"
+
+#define BUI_HBOX_IMPLEMENTATION
+#include "_ReferenceBoxLayout.inc.h"
+#undef BUI_HBOX_IMPLEMENTATION
+#include "_ReferenceBoxLayout.inc.h"
+
+/// Box layout whose GetIndexAt() can be called from the test
+template <typename Layout>
+class Probe final : public Layout {
+public:
+	bool IndexAt(size_t & idx, int x, int y) { return this->GetIndexAt(idx, x, y); }
+};
+
+struct Tree {
+	UiElement *root;
+	/// In creation order, which is the same for both implementations
+	std::vector<UiElement*> elements;
+	/// GetIndexAt() of box layouts, empty for other elements
+	std::vector<std::function<bool(size_t &, int, int)> > indexAt;
+};
+
+/// Both implementations must be built from generators in the same state
+template <typename HBox, typename VBox>
+UiElement *Build(std::mt19937 & rng, int depth, Tree & tree) {
+	UiElement *element;
+	std::function<bool(size_t &, int, int)> indexAt;
+	int kind = depth >= 3 ? 3 : (int)(rng() % 4);
+	if (kind < 3) {
+		int count = 1 + (int)(rng() % 5);
+		std::vector<UiElement*> items;
+		for (int i = 0; i < count; ++i) {
+			items.push_back(Build<HBox, VBox>(rng, depth + 1, tree));
+		}
+		UiLayout *layout;
+		if (kind == 0) {
+			Probe<HBox> *box = new Probe<HBox>();
+			if (rng() % 2) {
+				box->SetOverflowBehavior(HideOverflow);
+			}
+			indexAt = [box](size_t & idx, int x, int y) { return box->IndexAt(idx, x, y); };
+			layout = box;
+		} else if (kind == 1) {
+			Probe<VBox> *box = new Probe<VBox>();
+			indexAt = [box](size_t & idx, int x, int y) { return box->IndexAt(idx, x, y); };
+			layout = box;
+		} else {
+			GridLayout *grid = new GridLayout();
+			grid->SetColCount(1 + (int)(rng() % 3));
+			grid->SetRowCount(1 + (int)(rng() % 3));
+			grid->SetColSpacing((int)(rng() % 3));
+			layout = grid;
+		}
+		for (UiElement *item : items) {
+			layout->AddItem(item);
+		}
+		element = layout;
+	} else {
+		element = new UiElement();
+	}
+	if (rng() % 3 == 0) {
+		element->SetMargin((int)(rng() % 4), (int)(rng() % 4), (int)(rng() % 4), (int)(rng() % 4));
+	}
+	if (rng() % 2) {
+		element->SetSizeHint(0, 0, (int)(rng() % 80), (int)(rng() % 80));
+	}
+	tree.elements.push_back(element);
+	tree.indexAt.push_back(indexAt);
+	return element;
+}
+
+/// Number of differences between both trees
+int Compare(const Tree & tree, const Tree & reference, std::mt19937 & rng) {
+	int differences = 0;
+	for (size_t i = 0; i < tree.elements.size(); ++i) {
+		if (tree.elements[i]->Rect() != reference.elements[i]->Rect()
+			|| tree.elements[i]->InnerRect() != reference.elements[i]->InnerRect()) {
+			++differences;
+		}
+	}
+	const ::Rect & r = tree.root->Rect();
+	for (int k = 0; k < 20; ++k) {
+		int x = r.x - 30 + (int)(rng() % (r.w + 60));
+		int y = r.y - 30 + (int)(rng() % (r.h + 60));
+		for (size_t i = 0; i < tree.indexAt.size(); ++i) {
+			if (!tree.indexAt[i]) {
+				continue;
+			}
+			size_t idx = 0, referenceIdx = 0;
+			bool isFound = tree.indexAt[i](idx, x, y);
+			bool isReferenceFound = reference.indexAt[i](referenceIdx, x, y);
+			if (isFound != isReferenceFound || (isFound && idx != referenceIdx)) {
+				++differences;
+			}
+		}
+	}
+	return differences;
+}
+
+int main() {
+	int failedSeeds = 0;
+	for (unsigned int seed = 0; seed < 2000; ++seed) {
+		std::mt19937 rng(seed), referenceRng(seed);
+		Tree tree, reference;
+		tree.root = Build<HBoxLayout, VBoxLayout>(rng, 0, tree);
+		reference.root = Build<ReferenceHBoxLayout, ReferenceVBoxLayout>(referenceRng, 0, reference);
+
+		int differences = 0;
+		for (int step = 0; step < 6; ++step) {
+			if (step % 3 == 2) {
+				// Only what depends on the new hint gets laid out again
+				size_t i = rng() % tree.elements.size();
+				::Rect hint(0, 0, (int)(rng() % 80), (int)(rng() % 80));
+				tree.elements[i]->SetSizeHint(hint);
+				reference.elements[i]->SetSizeHint(hint);
+				tree.root->Layout();
+				reference.root->Layout();
+			} else {
+				int w = 50 + (int)(rng() % 600);
+				int h = 50 + (int)(rng() % 400);
+				tree.root->SetRect(0, 0, w, h);
+				reference.root->SetRect(0, 0, w, h);
+			}
+			differences += Compare(tree, reference, rng);
+		}
+		if (differences > 0) {
+			std::cerr << "Seed " << seed << ": " << differences << " differences" << std::endl;
+			++failedSeeds;
+		}
+
+		delete tree.root;
+		delete reference.root;
+	}
+
+	if (failedSeeds > 0) {
+		std::cerr << failedSeeds << " trees laid out differently" << std::endl;
+		return EXIT_FAILURE;
+	}
+	std::cout << "Box layouts match their reference" << std::endl;
+	return EXIT_SUCCESS;
+}
@@ -4,16 +4,16 @@
 */
 
 /*
- * Do not include this if you simply use the BaseUi toolkit.
- * This is a hacky way of defining both VBox and HBox layouts with not too much code duplication.
- * Define BUI_HBOX_IMPLEMENTATION to define the HBoxLayout and undef it for VBoxLayout
+ * Box layouts as they were before BoxLayout<axis>, kept for tests to check
+ * that it lays out the same. Included twice, with BUI_HBOX_IMPLEMENTATION
+ * defined for ReferenceHBoxLayout and undefined for ReferenceVBoxLayout.
  */
 
 #undef _BoxLayout
 #ifdef BUI_HBOX_IMPLEMENTATION
-#define _BoxLayout HBoxLayout
+#define _BoxLayout ReferenceHBoxLayout
 #else
-#define _BoxLayout VBoxLayout
+#define _BoxLayout ReferenceVBoxLayout
 #endif
 
 class _BoxLayout : public UiLayout {
@@ -23,22 +23,13 @@ public:
 		, m_overflowBehavior(ShrinkOverflow)
 	{}
 
-	void SetOverflowBehavior(BoxLayoutOverflowBehavior behavior) { m_overflowBehavior = behavior; }
-	BoxLayoutOverflowBehavior OverflowBehavior() const { return m_overflowBehavior; }
-
-	/// Take ownership of the item
-	void AddItem(UiElement *item) {
-		Items().push_back(item);
-	}
-	/// Hand ownership of the item
-	UiElement *RemoveItem() {
-		if (Items().size() == 0) {
-			return NULL;
+	void SetOverflowBehavior(BoxLayoutOverflowBehavior behavior) {
+		if (behavior != m_overflowBehavior) {
+			m_overflowBehavior = behavior;
+			InvalidateLayout();
 		}
-		UiElement *item = Items().back();
-		Items().pop_back();
-		return item;
 	}
+	BoxLayoutOverflowBehavior OverflowBehavior() const { return m_overflowBehavior; }
 
 	/// Automatically infer size hint from content.
 	void AutoSizeHint() {
@@ -80,17 +71,23 @@ public:
 		}
 		//*/
 
+		// Measure: read each hint once, null hints share what remains
+		m_hints.resize(Items().size());
 		int sumVHints = 0;
 		int nullHints = 0;
-		for (auto item : Items()) {
-			const ::Rect & rect = item->SizeHint();
+		for (size_t i = 0; i < Items().size(); ++i) {
+			const ::Rect & rect = Items()[i]->SizeHint();
+			if (rect.IsNull()) {
+				m_hints[i] = -1;
+				nullHints++;
+			}
+			else {
 #ifdef BUI_HBOX_IMPLEMENTATION
-			sumVHints += rect.w;
+				m_hints[i] = rect.w;
 #else
-			sumVHints += rect.h;
+				m_hints[i] = rect.h;
 #endif
-			if (rect.IsNull()) {
-				nullHints++;
+				sumVHints += m_hints[i];
 			}
 		}
 		int nonNullHints = Items().size() - nullHints;
@@ -110,22 +107,19 @@ public:
 			lastHintedItemHeightDelta = 0;
 		}
 
+		// Arrange: SetRect() only updates items that moved or need it
 		int offset = 0;
 		int nullCount = 0;
 		int nonNullCount = 0;
-		for (auto item : Items()) {
+		for (size_t i = 0; i < Items().size(); ++i) {
+			UiElement *item = Items()[i];
 			int height = 0;
-			const ::Rect & hint = item->SizeHint();
-			if (hint.IsNull()) {
+			if (m_hints[i] < 0) {
 				height = nullCount == nullHints - 1 ? lastItemHeight : itemHeight;
 				nullCount++;
 			}
 			else {
-#ifdef BUI_HBOX_IMPLEMENTATION
-				height = hint.w;
-#else
-				height = hint.h;
-#endif
+				height = m_hints[i];
 				height += (nonNullCount == nonNullHints - 1 ? lastHintedItemHeightDelta : hintedItemHeightDelta);
 				nonNullCount++;
 			}
@@ -134,36 +128,53 @@ public:
 #else
 			item->SetRect(InnerRect().x, InnerRect().y + offset, InnerRect().w, height);
 #endif
-			item->Update();
 			offset += height;
 		}
+
+		CacheItemEnds();
 	}
 
 protected:
+	/// Binary search over the item ends cached by Update()
 	bool GetIndexAt(size_t & idx, int x, int y) override {
-		/* for regular items
-		int itemHeight = Rect().h / m_items.size();
-		size_t i = std::min((size_t)(floor((y - Rect().y) / itemHeight)), m_items.size() - 1);
-		m_items[i]->QueryAt(x, y);
-		*/
+		if (m_itemEnds.size() != Items().size()) {
+			// Items were added or removed since
+			CacheItemEnds();
+		}
+#ifdef BUI_HBOX_IMPLEMENTATION
+		auto it = std::upper_bound(m_itemEnds.begin(), m_itemEnds.end(), x);
+#else
+		auto it = std::upper_bound(m_itemEnds.begin(), m_itemEnds.end(), y);
+#endif
+		if (it == m_itemEnds.end()) {
+			return false;
+		}
+		idx = it - m_itemEnds.begin();
+		return true;
+	}
 
+private:
+	/// Where each item ends along the axis, summing their inner sizes. Kept
+	/// from decreasing, which leaves the first item ending after any
+	/// position unchanged.
+	void CacheItemEnds() {
+		m_itemEnds.resize(Items().size());
 		int offset = 0;
+		int end = INT_MIN;
 		for (size_t i = 0; i < Items().size(); ++i) {
 #ifdef BUI_HBOX_IMPLEMENTATION
 			offset += Items()[i]->InnerRect().w;
-			if (InnerRect().x + offset > x) {
+			end = std::max(end, InnerRect().x + offset);
 #else
 			offset += Items()[i]->InnerRect().h;
-			if (InnerRect().y + offset > y) {
+			end = std::max(end, InnerRect().y + offset);
 #endif
-				idx = i;
-				return true;
-			}
+			m_itemEnds[i] = end;
 		}
-
-		return false;
 	}
 
 private:
 	BoxLayoutOverflowBehavior m_overflowBehavior;
+	std::vector<int> m_hints; /// Along the axis, -1 for null hints
+	std::vector<int> m_itemEnds;
 };